@@ -0,0 +1,120 @@
+// Tokenizer microbenchmark: the original strtok/strdup lexer against the
+// arena-backed Lexer, both reading the same script through stdio.
+//
+//   make lexer-bench
+//   ./bench/lexer_bench [commands]
+#define _GNU_SOURCE
+#include "lexer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BASELINE_BUFFER_SIZE 1024
+
+// The lexer as it was before the arena rewrite: a fresh line buffer per
+// command, one realloc per token and one strdup per token
+typedef struct {
+    char ** items;
+    size_t size;
+} baseline_tokenlist;
+
+static char * baseline_get_input(FILE *in) {
+    char *buffer = malloc(BASELINE_BUFFER_SIZE * sizeof(char));
+    if (fgets(buffer, BASELINE_BUFFER_SIZE, in) != NULL) {
+        size_t len = strlen(buffer);
+        if (len > 0 && buffer[len - 1] == '\n') {
+            buffer[len - 1] = '\0';
+        }
+        return buffer;
+    }
+    free(buffer);
+    return NULL;
+}
+
+static baseline_tokenlist * baseline_get_tokens(char *input) {
+    baseline_tokenlist *tokens = malloc(sizeof(baseline_tokenlist));
+    tokens->items = NULL;
+    tokens->size = 0;
+    char *token = strtok(input, " ");
+    while (token != NULL) {
+        tokens->size += 1;
+        tokens->items = realloc(tokens->items, tokens->size * sizeof(char *));
+        tokens->items[tokens->size - 1] = strdup(token);
+        token = strtok(NULL, " ");
+    }
+    return tokens;
+}
+
+static void baseline_free_tokens(baseline_tokenlist *tokens) {
+    for (size_t i = 0; i < tokens->size; i++) {
+        free(tokens->items[i]);
+    }
+    free(tokens->items);
+    free(tokens);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *templates[] = {
+    "creat FILE%05lu.TXT",
+    "mkdir DIR%05lu",
+    "cd DIR%05lu/SUB",
+    "open FILE%05lu.TXT -rw",
+    "write FILE%05lu.TXT \"the quick brown fox jumps over the lazy dog\"",
+    "read FILE%05lu.TXT 4096",
+    "lseek FILE%05lu.TXT 128",
+    "close FILE%05lu.TXT",
+    "ls",
+};
+
+int main(int argc, char *argv[]) {
+    unsigned long commands = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t num_templates = sizeof(templates) / sizeof(templates[0]);
+
+    // Build the script in memory so both runs read identical input
+    char *script = NULL;
+    size_t script_size = 0;
+    FILE *out = open_memstream(&script, &script_size);
+    for (unsigned long i = 0; i < commands; i++) {
+        fprintf(out, templates[i % num_templates], i);
+        fputc('\n', out);
+    }
+    fclose(out);
+
+    size_t checksum_baseline = 0;
+    FILE *in = fmemopen(script, script_size, "r");
+    double start = now();
+    char *input;
+    while ((input = baseline_get_input(in)) != NULL) {
+        baseline_tokenlist *tokens = baseline_get_tokens(input);
+        checksum_baseline += tokens->size;
+        baseline_free_tokens(tokens);
+        free(input);
+    }
+    double baseline_seconds = now() - start;
+    fclose(in);
+
+    size_t checksum_arena = 0;
+    Lexer lexer;
+    lexer_init(&lexer);
+    in = fmemopen(script, script_size, "r");
+    start = now();
+    while ((input = lexer_read_line(&lexer, in)) != NULL) {
+        checksum_arena += lexer_tokenize(&lexer, input)->size;
+    }
+    double arena_seconds = now() - start;
+    fclose(in);
+    lexer_free(&lexer);
+    free(script);
+
+    printf("commands: %lu\n", commands);
+    printf("baseline: %.0f commands/s (%lu tokens)\n", commands / baseline_seconds, (unsigned long)checksum_baseline);
+    printf("arena:    %.0f commands/s (%lu tokens)\n", commands / arena_seconds, (unsigned long)checksum_arena);
+    printf("speedup:  %.2fx\n", baseline_seconds / arena_seconds);
+    return 0;
+}
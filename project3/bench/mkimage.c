@@ -0,0 +1,325 @@
+// Synthetic FAT32 image generator for the benchmark suite.
+//
+//   ./bench/mkimage [-s size_mb] [-c cluster_bytes] [-f fanout] [-d depth]
+//                   [-n files] [-z file_bytes] [-F fragmentation] [-S seed] image
+//
+// Builds a directory tree FANOUT wide and DEPTH deep (depth 0 puts every
+// file in the root), spreads FILES files of FILE_BYTES each over the
+// deepest level and fills them with a fixed pattern. FRAGMENTATION is
+// the percentage of cluster boundaries at which allocation skips ahead,
+// so 0 gives perfectly contiguous chains. The same arguments and seed
+// always produce the same image.
+#define _GNU_SOURCE
+#include "fat32.h"
+#include "dir_iter.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SECTOR_SIZE 512
+#define RESERVED_SECTORS 32
+#define NUM_FATS 2
+#define EOC 0x0FFFFFFF
+
+typedef struct {
+    uint32_t parent;           // index of the parent directory
+    uint32_t first_child;      // children are numbered consecutively
+    uint32_t num_children;
+    uint32_t first_file;
+    uint32_t num_files;
+    uint32_t cluster;          // first cluster of the directory
+    uint32_t name;             // number used for "Dnnnnnnn"
+} GenDir;
+
+typedef struct {
+    int fd;
+    uint32_t cluster_size;
+    uint32_t sectors_per_cluster;
+    uint32_t fat_sectors;
+    uint32_t num_clusters;     // data clusters
+    uint64_t data_offset;
+    uint32_t *fat;
+    uint32_t cursor;           // next cluster to hand out
+    uint32_t fragmentation;
+    uint64_t rng;
+} Generator;
+
+static uint32_t next_random(Generator *gen) {
+    // xorshift64*
+    gen->rng ^= gen->rng >> 12;
+    gen->rng ^= gen->rng << 25;
+    gen->rng ^= gen->rng >> 27;
+    return (uint32_t)((gen->rng * 2685821657736338717ULL) >> 32);
+}
+
+static uint32_t allocate(Generator *gen) {
+    if (gen->fragmentation > 0 && next_random(gen) % 100 < gen->fragmentation) {
+        gen->cursor += 1 + next_random(gen) % 16;
+    }
+    if (gen->cursor >= gen->num_clusters + 2) {
+        fprintf(stderr, "Error: image is too small for the requested tree.\n");
+        exit(1);
+    }
+    return gen->cursor++;
+}
+
+// Allocates a chain of COUNT clusters and links it in the FAT
+static uint32_t allocate_chain(Generator *gen, uint32_t count) {
+    uint32_t first = 0;
+    uint32_t previous = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t cluster = allocate(gen);
+        if (previous == 0) {
+            first = cluster;
+        } else {
+            gen->fat[previous] = cluster;
+        }
+        gen->fat[cluster] = EOC;
+        previous = cluster;
+    }
+    return first;
+}
+
+static uint64_t cluster_offset(Generator *gen, uint32_t cluster) {
+    return gen->data_offset + (uint64_t)(cluster - 2) * gen->cluster_size;
+}
+
+static void write_at(Generator *gen, uint64_t offset, const void *data, size_t length) {
+    if (pwrite(gen->fd, data, length, (off_t)offset) != (ssize_t)length) {
+        perror("Error writing image");
+        exit(1);
+    }
+}
+
+static void set_entry(DirectoryEntry *entry, const char *name, uint8_t attr, uint32_t cluster, uint32_t size) {
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->name, name, 11);
+    entry->attr = attr;
+    entry->firstclusthi = (cluster >> 16) & 0xFFFF;
+    entry->firstclustlo = cluster & 0xFFFF;
+    entry->filesize = size;
+}
+
+// Writes a directory's entries into its chain, following the FAT
+static void write_directory(Generator *gen, DirectoryEntry *entries, uint32_t count, uint32_t cluster) {
+    uint32_t per_cluster = gen->cluster_size / sizeof(DirectoryEntry);
+    for (uint32_t i = 0; i < count; i += per_cluster) {
+        uint32_t n = count - i < per_cluster ? count - i : per_cluster;
+        write_at(gen, cluster_offset(gen, cluster), entries + i, n * sizeof(DirectoryEntry));
+        cluster = gen->fat[cluster];
+    }
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-s size_mb] [-c cluster_bytes] [-f fanout] [-d depth] [-n files] [-z file_bytes] [-F fragmentation] [-S seed] image\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t size_mb = 64;
+    uint32_t cluster_bytes = 4096;
+    uint32_t fanout = 0;
+    uint32_t depth = 0;
+    uint32_t num_files = 0;
+    uint32_t file_bytes = 0;
+    Generator gen;
+    int opt;
+
+    memset(&gen, 0, sizeof(gen));
+    gen.rng = 0x9E3779B97F4A7C15ULL;
+    while ((opt = getopt(argc, argv, "s:c:f:d:n:z:F:S:")) != -1) {
+        uint32_t value = (uint32_t)strtoul(optarg, NULL, 10);
+        switch (opt) {
+        case 's': size_mb = value; break;
+        case 'c': cluster_bytes = value; break;
+        case 'f': fanout = value; break;
+        case 'd': depth = value; break;
+        case 'n': num_files = value; break;
+        case 'z': file_bytes = value; break;
+        case 'F': gen.fragmentation = value > 100 ? 100 : value; break;
+        case 'S': gen.rng ^= (uint64_t)value * 0xBF58476D1CE4E5B9ULL; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || cluster_bytes < SECTOR_SIZE || cluster_bytes > 32768 ||
+        (cluster_bytes & (cluster_bytes - 1)) != 0 || (depth > 0 && fanout == 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Geometry: grow the FAT until it covers every data cluster
+    uint32_t total_sectors = (uint32_t)((uint64_t)size_mb * 1024 * 1024 / SECTOR_SIZE);
+    gen.cluster_size = cluster_bytes;
+    gen.sectors_per_cluster = cluster_bytes / SECTOR_SIZE;
+    gen.fat_sectors = 1;
+    while (1) {
+        uint32_t data_sectors = total_sectors - RESERVED_SECTORS - NUM_FATS * gen.fat_sectors;
+        gen.num_clusters = data_sectors / gen.sectors_per_cluster;
+        uint32_t needed = (uint32_t)(((uint64_t)gen.num_clusters + 2) * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        if (needed <= gen.fat_sectors) {
+            break;
+        }
+        gen.fat_sectors = needed;
+    }
+    if (gen.num_clusters < 65525) {
+        // The shell does not care, but other FAT drivers would see FAT16
+        fprintf(stderr, "Warning: %u clusters is below the FAT32 minimum of 65525.\n", gen.num_clusters);
+    }
+    gen.data_offset = (uint64_t)(RESERVED_SECTORS + NUM_FATS * gen.fat_sectors) * SECTOR_SIZE;
+    gen.fat = calloc(gen.num_clusters + 2, sizeof(uint32_t));
+    gen.fat[0] = 0x0FFFFFF8;
+    gen.fat[1] = EOC;
+    gen.cursor = 2;
+
+    gen.fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (gen.fd < 0 || ftruncate(gen.fd, (off_t)total_sectors * SECTOR_SIZE) != 0) {
+        perror("Error creating image");
+        return 1;
+    }
+
+    // The tree, level by level; directory 0 is the root
+    uint32_t num_dirs = 1;
+    uint32_t level_width = 1;
+    for (uint32_t d = 0; d < depth; d++) {
+        level_width *= fanout;
+        num_dirs += level_width;
+    }
+    GenDir *dirs = calloc(num_dirs, sizeof(GenDir));
+    uint32_t next_dir = 1;
+    uint32_t leaf_start = 0;
+    uint32_t level_start = 0;
+    uint32_t level_end = 1;
+    for (uint32_t d = 0; d < depth; d++) {
+        for (uint32_t i = level_start; i < level_end; i++) {
+            dirs[i].first_child = next_dir;
+            dirs[i].num_children = fanout;
+            for (uint32_t c = 0; c < fanout; c++) {
+                dirs[next_dir].parent = i;
+                dirs[next_dir].name = c;
+                next_dir++;
+            }
+        }
+        level_start = level_end;
+        level_end = next_dir;
+    }
+    leaf_start = level_start;
+    uint32_t num_leaves = level_end - leaf_start;
+    for (uint32_t f = 0; f < num_files; f++) {
+        dirs[leaf_start + f % num_leaves].num_files++;
+    }
+    uint32_t first_file = 0;
+    for (uint32_t i = leaf_start; i < level_end; i++) {
+        dirs[i].first_file = first_file;
+        first_file += dirs[i].num_files;
+    }
+
+    // Directory chains first so every entry can point at its target
+    uint32_t per_cluster = cluster_bytes / sizeof(DirectoryEntry);
+    for (uint32_t i = 0; i < num_dirs; i++) {
+        uint32_t entries = (i == 0 ? 0 : 2) + dirs[i].num_children + dirs[i].num_files + 1;
+        dirs[i].cluster = allocate_chain(&gen, (entries + per_cluster - 1) / per_cluster);
+    }
+
+    uint32_t file_clusters = (file_bytes + cluster_bytes - 1) / cluster_bytes;
+    uint8_t *pattern = malloc(cluster_bytes);
+    DirectoryEntry *entries = NULL;
+    uint32_t entries_capacity = 0;
+    for (uint32_t i = 0; i < num_dirs; i++) {
+        GenDir *dir = &dirs[i];
+        uint32_t count = 0;
+        uint32_t needed = 3 + dir->num_children + dir->num_files;
+        if (needed > entries_capacity) {
+            entries_capacity = needed;
+            entries = realloc(entries, entries_capacity * sizeof(DirectoryEntry));
+        }
+
+        if (i != 0) {
+            uint32_t parent_cluster = dir->parent == 0 ? 0 : dirs[dir->parent].cluster;
+            set_entry(&entries[count++], ".          ", ATTR_DIRECTORY, dir->cluster, 0);
+            set_entry(&entries[count++], "..         ", ATTR_DIRECTORY, parent_cluster, 0);
+        }
+        for (uint32_t c = 0; c < dir->num_children; c++) {
+            char name[12];
+            snprintf(name, sizeof(name), "D%07u   ", dirs[dir->first_child + c].name);
+            set_entry(&entries[count++], name, ATTR_DIRECTORY, dirs[dir->first_child + c].cluster, 0);
+        }
+        for (uint32_t f = 0; f < dir->num_files; f++) {
+            uint32_t index = dir->first_file + f;
+            uint32_t first = file_clusters ? allocate_chain(&gen, file_clusters) : 0;
+            char name[12];
+            snprintf(name, sizeof(name), "F%07uDAT", index);
+            set_entry(&entries[count++], name, 0x20, first, file_bytes);
+
+            uint32_t cluster = first;
+            for (uint32_t k = 0; k < file_clusters; k++) {
+                for (uint32_t b = 0; b < cluster_bytes; b++) {
+                    pattern[b] = (uint8_t)(index * 31 + k * 7 + b);
+                }
+                write_at(&gen, cluster_offset(&gen, cluster), pattern, cluster_bytes);
+                cluster = gen.fat[cluster];
+            }
+        }
+        memset(&entries[count++], 0, sizeof(DirectoryEntry));
+        write_directory(&gen, entries, count, dir->cluster);
+    }
+
+    // Boot sector, FSInfo and their backups
+    uint8_t sector[SECTOR_SIZE];
+    FAT32BootSector *bs = (FAT32BootSector *)sector;
+    memset(sector, 0, sizeof(sector));
+    memcpy(bs->jump_boot, "\xEB\x58\x90", 3);
+    memcpy(bs->oem_name, "MKIMAGE ", 8);
+    bs->bytes_per_sector = SECTOR_SIZE;
+    bs->sectors_per_cluster = (uint8_t)gen.sectors_per_cluster;
+    bs->reserved_sector_count = RESERVED_SECTORS;
+    bs->num_fats = NUM_FATS;
+    bs->media = 0xF8;
+    bs->sectors_per_track = 32;
+    bs->num_heads = 64;
+    bs->total_sectors_32 = total_sectors;
+    bs->fat_size_32 = gen.fat_sectors;
+    bs->root_cluster = dirs[0].cluster;
+    bs->fs_info = 1;
+    bs->backup_boot_sector = 6;
+    bs->drive_number = 0x80;
+    bs->boot_signature = 0x29;
+    bs->volume_id = 0x20240000;
+    memcpy(bs->volume_label, "BENCH      ", 11);
+    memcpy(bs->fs_type, "FAT32   ", 8);
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+    write_at(&gen, 0, sector, SECTOR_SIZE);
+    write_at(&gen, 6 * SECTOR_SIZE, sector, SECTOR_SIZE);
+
+    uint32_t free_clusters = 0;
+    for (uint32_t c = 2; c < gen.num_clusters + 2; c++) {
+        free_clusters += gen.fat[c] == 0;
+    }
+    FSInfo info;
+    memset(&info, 0, sizeof(info));
+    info.lead_sig = 0x41615252;
+    info.struct_sig = 0x61417272;
+    info.free_count = free_clusters;
+    info.next_free = gen.cursor;
+    info.trail_sig = 0xAA550000;
+    write_at(&gen, SECTOR_SIZE, &info, sizeof(info));
+    write_at(&gen, 7 * SECTOR_SIZE, &info, sizeof(info));
+
+    for (uint32_t copy = 0; copy < NUM_FATS; copy++) {
+        uint64_t offset = (uint64_t)(RESERVED_SECTORS + copy * gen.fat_sectors) * SECTOR_SIZE;
+        write_at(&gen, offset, gen.fat, (size_t)(gen.num_clusters + 2) * sizeof(uint32_t));
+    }
+
+    printf("%s: %u MiB, %u-byte clusters, %u directories, %u files, %u clusters used\n",
+           argv[optind], size_mb, cluster_bytes, num_dirs, num_files, gen.num_clusters - free_clusters);
+
+    free(entries);
+    free(pattern);
+    free(dirs);
+    free(gen.fat);
+    close(gen.fd);
+    return 0;
+}
@@ -0,0 +1,150 @@
+#!/usr/bin/env bash
+# Scripted workloads against generated images, driven through batch mode.
+#
+#   make bench                 # or: ./bench/run_bench.sh [filesys] [mkimage]
+#
+# Prints one JSON object per workload on stdout:
+#   {"bench":"bulk_creat","ops":5000,"bytes":0,"seconds":0.041,"ops_per_sec":121951,"mb_per_sec":0.00}
+# Sizes can be scaled with the BENCH_* variables below; the work directory
+# (BENCH_DIR) is removed afterwards unless BENCH_KEEP=1.
+set -euo pipefail
+
+FILESYS=${1:-./filesys}
+MKIMAGE=${2:-./bench/mkimage}
+BENCH_DIR=${BENCH_DIR:-$(mktemp -d /tmp/fsbench.XXXXXX)}
+BENCH_CLUSTER=${BENCH_CLUSTER:-4096}
+BENCH_IMAGE_MB=${BENCH_IMAGE_MB:-1024}
+BENCH_FILES=${BENCH_FILES:-5000}
+BENCH_DIRS=${BENCH_DIRS:-1000}
+BENCH_LS_ENTRIES=${BENCH_LS_ENTRIES:-20000}
+BENCH_DEPTH=${BENCH_DEPTH:-12}
+BENCH_IO_MB=${BENCH_IO_MB:-64}
+BENCH_RANDOM_OPS=${BENCH_RANDOM_OPS:-2000}
+BENCH_FRAGMENTATION=${BENCH_FRAGMENTATION:-50}
+BENCH_TREE_FILES=${BENCH_TREE_FILES:-1200}
+
+mkdir -p "$BENCH_DIR"
+if [ "${BENCH_KEEP:-0}" != 1 ]; then
+    trap 'rm -rf "$BENCH_DIR"' EXIT
+fi
+
+now() {
+    date +%s%N
+}
+
+# mkimage ARGS... IMAGE, quietly
+make_image() {
+    "$MKIMAGE" -s "$BENCH_IMAGE_MB" -c "$BENCH_CLUSTER" "$@" > /dev/null 2>&1
+}
+
+# run NAME OPS BYTES IMAGE SCRIPT: times one batch run and reports it
+run() {
+    local name=$1 ops=$2 bytes=$3 image=$4 script=$5
+    local start end
+    start=$(now)
+    "$FILESYS" -b "$script" "$image" > "$BENCH_DIR/$name.out"
+    end=$(now)
+    if grep -q '^Error' "$BENCH_DIR/$name.out"; then
+        echo "$name: workload reported errors, see $BENCH_DIR/$name.out" >&2
+        BENCH_KEEP=1
+        trap - EXIT
+    fi
+    awk -v name="$name" -v ops="$ops" -v bytes="$bytes" -v ns="$((end - start))" 'BEGIN {
+        s = ns / 1e9
+        printf "{\"bench\":\"%s\",\"ops\":%d,\"bytes\":%d,\"seconds\":%.4f,\"ops_per_sec\":%.0f,\"mb_per_sec\":%.2f}\n",
+               name, ops, bytes, s, ops / s, bytes / 1048576 / s
+    }'
+}
+
+empty="$BENCH_DIR/empty.img"
+
+# Bulk creat and mkdir into one growing directory
+make_image "$empty"
+awk -v n="$BENCH_FILES" 'BEGIN { print "mkdir B"; print "cd B"; for (i = 0; i < n; i++) printf "creat F%d\n", i }' > "$BENCH_DIR/creat.txt"
+run bulk_creat "$BENCH_FILES" 0 "$empty" "$BENCH_DIR/creat.txt"
+
+make_image "$empty"
+awk -v n="$BENCH_DIRS" 'BEGIN { print "mkdir B"; print "cd B"; for (i = 0; i < n; i++) printf "mkdir D%d\n", i }' > "$BENCH_DIR/mkdir.txt"
+run bulk_mkdir "$BENCH_DIRS" 0 "$empty" "$BENCH_DIR/mkdir.txt"
+
+# Deep cd: a binary tree BENCH_DEPTH levels deep, walked from the root each time
+make_image -f 2 -d "$BENCH_DEPTH" "$BENCH_DIR/deep.img"
+awk -v n="$BENCH_RANDOM_OPS" -v depth="$BENCH_DEPTH" 'BEGIN {
+    srand(1)
+    for (i = 0; i < n; i++) {
+        path = ""
+        for (d = 0; d < depth; d++) path = path "/D000000" int(rand() * 2)
+        print "cd " path
+        print "cd /"
+    }
+}' > "$BENCH_DIR/cd.txt"
+run deep_cd "$((BENCH_RANDOM_OPS * 2))" 0 "$BENCH_DIR/deep.img" "$BENCH_DIR/cd.txt"
+
+# ls of one huge directory
+make_image -n "$BENCH_LS_ENTRIES" "$BENCH_DIR/huge.img"
+awk 'BEGIN { for (i = 0; i < 20; i++) print "ls" }' > "$BENCH_DIR/ls.txt"
+run ls_huge 20 0 "$BENCH_DIR/huge.img" "$BENCH_DIR/ls.txt"
+
+# Sequential write (import) and read of one large file
+io_bytes=$((BENCH_IO_MB * 1048576))
+head -c "$io_bytes" /dev/urandom > "$BENCH_DIR/seq.bin"
+make_image "$empty"
+printf 'import %s\n' "$BENCH_DIR/seq.bin" > "$BENCH_DIR/seqw.txt"
+run seq_write 1 "$io_bytes" "$empty" "$BENCH_DIR/seqw.txt"
+
+printf 'open SEQ.BIN -r\nread SEQ.BIN %d /dev/null\nclose SEQ.BIN\n' "$io_bytes" > "$BENCH_DIR/seqr.txt"
+run seq_read 1 "$io_bytes" "$empty" "$BENCH_DIR/seqr.txt"
+
+# Random 4 KiB reads and 64-byte writes inside the same file
+awk -v n="$BENCH_RANDOM_OPS" -v size="$io_bytes" 'BEGIN {
+    srand(2)
+    print "open SEQ.BIN -r"
+    for (i = 0; i < n; i++) {
+        printf "lseek SEQ.BIN %d\n", int(rand() * (size - 4096))
+        print "read SEQ.BIN 4096 /dev/null"
+    }
+}' > "$BENCH_DIR/randr.txt"
+run random_read "$BENCH_RANDOM_OPS" "$((BENCH_RANDOM_OPS * 4096))" "$empty" "$BENCH_DIR/randr.txt"
+
+awk -v n="$BENCH_RANDOM_OPS" -v size="$io_bytes" 'BEGIN {
+    srand(3)
+    print "open SEQ.BIN -rw"
+    for (i = 0; i < n; i++) {
+        printf "lseek SEQ.BIN %d\n", int(rand() * (size - 64))
+        print "write SEQ.BIN \"0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\""
+    }
+    print "close SEQ.BIN"
+}' > "$BENCH_DIR/randw.txt"
+run random_write "$BENCH_RANDOM_OPS" "$((BENCH_RANDOM_OPS * 64))" "$empty" "$BENCH_DIR/randw.txt"
+
+# Reading files whose chains were allocated with BENCH_FRAGMENTATION% breaks
+frag_files=64
+frag_bytes=$((BENCH_IO_MB * 1048576 / frag_files))
+make_image -n "$frag_files" -z "$frag_bytes" -F "$BENCH_FRAGMENTATION" "$BENCH_DIR/frag.img"
+awk -v n="$frag_files" -v size="$frag_bytes" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        printf "open F%07d.DAT -r\n", i
+        printf "read F%07d.DAT %d /dev/null\n", i, size
+        printf "close F%07d.DAT\n", i
+    }
+}' > "$BENCH_DIR/frag.txt"
+run fragmented_read "$frag_files" "$((frag_files * frag_bytes))" "$BENCH_DIR/frag.img" "$BENCH_DIR/frag.txt"
+
+# Tree import and export of many empty files. Each one takes a segment of
+# its own in the transfer pipeline, so this crosses many chunk boundaries;
+# the export has to recreate every file.
+tree_files=$BENCH_TREE_FILES
+mkdir -p "$BENCH_DIR/tree/T"
+(cd "$BENCH_DIR/tree/T" && seq -f 'E%g' 1 "$tree_files" | xargs touch)
+make_image "$empty"
+printf 'import %s\n' "$BENCH_DIR/tree/T" > "$BENCH_DIR/treei.txt"
+run tree_import "$tree_files" 0 "$empty" "$BENCH_DIR/treei.txt"
+
+printf 'export T %s\n' "$BENCH_DIR/tree/out" > "$BENCH_DIR/treee.txt"
+run tree_export "$tree_files" 0 "$empty" "$BENCH_DIR/treee.txt"
+exported=$(find "$BENCH_DIR/tree/out" -type f | wc -l)
+if [ "$exported" -ne "$tree_files" ]; then
+    echo "tree_export: $exported of $tree_files files were exported" >&2
+    BENCH_KEEP=1
+    trap - EXIT
+fi
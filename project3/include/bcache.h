@@ -0,0 +1,56 @@
+#pragma once
+#include <stdint.h>
+#include "fat32.h"
+
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#define BCACHE_DEFAULT_CLUSTERS 1024
+#define BCACHE_NONE UINT32_MAX
+
+// One cached cluster. Writes only touch the copy here; the byte range
+// between dirty_start and dirty_end (rounded out to whole sectors) is
+// written back on eviction or flush.
+typedef struct {
+    uint32_t cluster;      // 0 when the slot is unused
+    uint32_t hash_next;    // next slot in the bucket, BCACHE_NONE at the end
+    uint32_t dirty_start;
+    uint32_t dirty_end;    // equal to dirty_start when clean
+    uint8_t referenced;    // CLOCK reference bit
+} BlockCacheSlot;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;   // write calls issued for dirty ranges
+    uint64_t bytes_written;
+} BlockCacheStats;
+
+// Fixed-size write-back cache of metadata clusters (directory contents)
+// with CLOCK eviction. File data does not go through it.
+typedef struct {
+    BlockCacheSlot *slots;
+    uint8_t *data;
+    uint32_t *buckets;
+    uint32_t capacity;     // slots
+    uint32_t num_buckets;  // power of two
+    uint32_t used;
+    uint32_t hand;         // CLOCK hand
+    uint32_t cluster_size;
+    uint32_t sector_size;
+    uint64_t data_start;   // image offset of cluster 2
+    uint64_t dirty_bytes;
+    BlockCacheStats stats;
+} BlockCache;
+
+extern BlockCache bcache;
+
+int bcache_init(FAT32BootSector *bs, uint32_t capacity);
+void bcache_free(void);
+void bcache_read(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, uint32_t offset, void *buffer, uint32_t length);
+void bcache_write(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, uint32_t offset, const void *data, uint32_t length);
+void bcache_discard(uint32_t cluster);
+int bcache_flush(BlockDevice *dev, FAT32BootSector *bs);
+
+#endif // BCACHE_H
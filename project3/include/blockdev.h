@@ -0,0 +1,57 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+typedef enum {
+    DEV_BACKEND_MMAP,
+    DEV_BACKEND_PREAD
+} DevBackend;
+
+typedef struct BlockDevice BlockDevice;
+struct IoEngine;
+struct Overlay;
+
+// One read or write of a batch handed to dev_submit
+typedef struct {
+    int write;
+    uint64_t offset;
+    void *buffer;
+    size_t length;
+    int result;      // 0 or -1 once the batch has completed
+} IoRequest;
+
+// Backend operations. Offsets and lengths are in bytes from the start
+// of the image; every call returns 0 on success and -1 on failure.
+typedef struct {
+    const char *name;
+    int (*read)(BlockDevice *dev, uint64_t offset, void *buffer, size_t length);
+    int (*write)(BlockDevice *dev, uint64_t offset, const void *buffer, size_t length);
+    int (*sync)(BlockDevice *dev);
+    void (*prefetch)(BlockDevice *dev, uint64_t offset, size_t length);
+    void (*close)(BlockDevice *dev);
+} BlockDeviceOps;
+
+struct BlockDevice {
+    const BlockDeviceOps *ops;
+    int fd;
+    int writable;
+    uint64_t size;
+    uint8_t *map;    // whole-image mapping, NULL for the pread backend
+    uint64_t last_end;  // end of the previous request, for seek accounting
+    struct IoEngine *engine;  // asynchronous submission, NULL to run batches inline
+    struct Overlay *overlay;  // copy-on-write delta over a read-only image, or NULL
+};
+
+int dev_open(BlockDevice *dev, const char *path, DevBackend backend);
+void dev_close(BlockDevice *dev);
+int dev_read(BlockDevice *dev, uint64_t offset, void *buffer, size_t length);
+int dev_write(BlockDevice *dev, uint64_t offset, const void *buffer, size_t length);
+int dev_submit(BlockDevice *dev, IoRequest *requests, size_t count);
+int dev_sync(BlockDevice *dev);
+void dev_prefetch(BlockDevice *dev, uint64_t offset, size_t length);
+const void *dev_view(BlockDevice *dev, uint64_t offset, size_t length);
+
+#endif // BLOCKDEV_H
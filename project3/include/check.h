@@ -0,0 +1,25 @@
+#pragma once
+#include <stdint.h>
+#include "fat32.h"
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#define CHECK_MAX_REPORTED 50
+
+typedef struct {
+    uint32_t directories;
+    uint32_t files;
+    uint32_t used_clusters;     // clusters reachable from the root
+    uint32_t size_mismatches;   // chain length disagrees with filesize
+    uint32_t broken_chains;     // chain runs into a free, bad or out-of-range entry
+    uint32_t cross_linked;      // clusters claimed by more than one chain
+    uint32_t lost_clusters;     // allocated in the FAT but unreachable
+    uint32_t fat_mismatches;    // sectors where a FAT copy differs from the first
+    uint32_t free_clusters;
+} CheckReport;
+
+int check_image(BlockDevice *dev, FAT32BootSector *bs, int num_threads, CheckReport *report);
+void handle_check_command(BlockDevice *dev, FAT32BootSector *bs, const char *threads);
+
+#endif // CHECK_H
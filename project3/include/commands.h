@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+#include "fat32.h"
+#include "lexer.h"
+#include "path.h"
+
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+// Consecutive metadata commands in batch mode share one FAT flush, but
+// never more than this many in a row
+#define BATCH_FLUSH_INTERVAL 4096
+
+// State of one shell session over a mounted image
+typedef struct {
+    BlockDevice *dev;
+    FAT32BootSector bs;
+    const char *image_path;
+    uint32_t current_cluster;
+    char current_path[MAX_PATH_LENGTH];  // path inside the image, "" at the root
+    int batch;                 // no prompts, grouped flushes
+    int session;               // a server client rather than the process's own shell
+    int running;
+    uint32_t pending_metadata; // metadata commands since the last flush
+} Shell;
+
+// Command flags
+#define CMD_METADATA 0x1       // changes the FAT or directories
+#define CMD_DIR_READ 0x2       // reads the current directory
+#define CMD_DIR_WRITE 0x4      // changes the current directory or a file open in it
+#define CMD_EXCLUSIVE 0x8      // walks or rewrites whole trees; runs alone
+
+typedef struct {
+    const char *name;
+    int min_tokens;            // including the command name
+    int max_tokens;            // -1 for no limit
+    int flags;
+    void (*run)(Shell *sh, tokenlist *tokens);
+} Command;
+
+void commands_init(void);
+const Command *find_command(const char *name);
+void run_command(Shell *sh, tokenlist *tokens);
+void end_batch(Shell *sh);
+void end_session(Shell *sh);
+
+void handle_info_command(FAT32BootSector *bs);
+void handle_df_command(const char *image_path, FAT32BootSector *bs);
+void handle_sync_command(BlockDevice *dev, FAT32BootSector *bs);
+void handle_stats_command(BlockDevice *dev);
+void handle_trace_command(const char *path);
+void handle_exit_command(BlockDevice *dev, FAT32BootSector *bs);
+
+#endif // COMMANDS_H
@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+#include "fat32.h"
+
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#define DEFRAG_COPY_BYTES (8 * 1024 * 1024)  // file data copied per batch
+
+// Fragmentation of every chain reachable from the root. The score is the
+// share of cluster-to-cluster links that are not physically adjacent:
+// 0% when every file and directory is one contiguous run.
+typedef struct {
+    uint32_t files;
+    uint32_t directories;
+    uint32_t extents;     // contiguous runs over all chains
+    uint64_t links;       // cluster-to-next-cluster steps
+    uint64_t breaks;      // steps that jump elsewhere on the volume
+    uint32_t fragmented;  // chains with at least one break
+} FragmentationReport;
+
+void handle_defrag_command(BlockDevice *dev, FAT32BootSector *bs);
+
+#endif // DEFRAG_H
@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+#include "dir_iter.h"
+
+#ifndef DIR_INDEX_H
+#define DIR_INDEX_H
+
+#define DIR_INDEX_USED 1
+#define DIR_INDEX_REMOVED 2
+#define DIR_INDEX_TOMBSTONE UINT32_MAX
+
+// One live short-name entry of an indexed directory
+typedef struct {
+    DirectoryEntry entry;
+    DirSlot slot;
+    DirSlot lfn_slot;     // first long name fragment, when lfn_count > 0
+    uint32_t lfn_count;
+    char *long_name;      // decoded once when indexed, NULL if none
+    uint8_t state;        // DIR_INDEX_USED or DIR_INDEX_REMOVED
+} DirIndexEntry;
+
+// Next "~N" tail to try for one 8.3 basis
+typedef struct {
+    uint8_t basis[11];
+    uint32_t next;        // 0 marks an unused slot
+} ShortNameHint;
+
+// In-memory index of one directory. Entries are kept in a dense array in
+// the order they were indexed (directory order, then creation order),
+// with two open-addressing hash tables over it: one on the raw 11-byte
+// 8.3 name and one on the case-folded long name. Built with a single
+// pass of DirIter the first time the directory is looked up, which also
+// decodes every long name once, and then kept current by dir_add_entry,
+// dir_create_entry and dir_remove_entry, so listings, lookups and
+// duplicate checks never touch the image. Deleted slots are remembered
+// too, and new entries fill them before the directory grows.
+typedef struct DirIndex {
+    uint32_t dir_cluster;
+    DirIndexEntry *entries;
+    uint32_t num_entries;  // including removed ones until the next rebuild
+    uint32_t entries_capacity;
+    uint32_t *short_table; // entry number + 1; 0 empty, DIR_INDEX_TOMBSTONE removed
+    uint32_t *long_table;
+    uint32_t capacity;     // of both tables, power of two
+    uint32_t used;
+    ShortNameHint *hints;  // per-basis tail counters for short name generation
+    uint32_t hint_capacity;
+    uint32_t hint_used;
+    DirSlot *free_slots;   // deleted (0xE5) slots available for reuse
+    uint32_t num_free;
+    uint32_t free_capacity;
+    int free_sorted;       // free_slots is in position order
+    DirSlot end;           // end-of-directory marker slot
+    int has_end;
+    uint32_t last_cluster; // last cluster of the directory chain
+    uint32_t next_position;
+    struct DirIndex *next; // hash chain in the directory cache
+} DirIndex;
+
+DirIndex *dir_index_get(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster);
+const DirIndexEntry *dir_index_lookup(DirIndex *index, const uint8_t *short_name);
+const DirIndexEntry *dir_index_find(DirIndex *index, const char *name);
+void dir_index_invalidate(uint32_t dir_cluster);
+void dir_index_clear(void);
+const char *dir_entry_display_name(const DirIndexEntry *found, char *buffer);
+
+int dir_find_entry(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const char *name, DirectoryEntry *entry, DirSlot *slot);
+int dir_add_entry(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const DirectoryEntry *entry, DirSlot *slot);
+int dir_create_entry(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const char *name, DirectoryEntry *entry, DirSlot *slot);
+int dir_remove_entry(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const uint8_t *short_name);
+int dir_update_entry(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const DirectoryEntry *entry);
+int dir_rename_entry(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const uint8_t *old_name, const uint8_t *new_name);
+
+// dir_create_entry results
+#define DIR_CREATE_OK 0
+#define DIR_CREATE_FULL -1     // the directory cannot grow
+#define DIR_CREATE_EXISTS -2
+#define DIR_CREATE_INVALID -3  // not a usable file name
+
+#endif // DIR_INDEX_H
@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+#include "fat32.h"
+#include "lfn.h"
+
+#ifndef DIR_ITER_H
+#define DIR_ITER_H
+
+#define DIR_ENTRY_END 0x00
+#define DIR_ENTRY_DELETED 0xE5
+#define ATTR_LONG_NAME 0x0F
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+#define NAME_BUFFER_SIZE 13  // "NAME.EXT" plus terminator
+
+// Location of a single 32-byte entry inside a directory's cluster chain
+typedef struct {
+    uint32_t cluster;
+    uint32_t index;       // entry index within that cluster
+    uint32_t position;    // entry index from the start of the directory
+} DirSlot;
+
+// Streaming iterator over every entry slot of a directory, following
+// its FAT chain. Buffers are sized from the volume's cluster size and
+// the next cluster in the chain is prefetched while the current one
+// is being scanned.
+typedef struct {
+    BlockDevice *dev;
+    FAT32BootSector *bs;
+    uint32_t cluster;
+    uint32_t entries_per_cluster;
+    uint32_t index;
+    uint32_t position;
+    const DirectoryEntry *entries;
+    DirectoryEntry *scratch;
+    DirSlot slot;         // location of the entry last returned
+    DirSlot end;          // location of the end marker, once reached
+    int found_end;
+    uint32_t last_cluster;
+    int direct;           // bypass the block cache
+
+    // Long name of the entry last returned by dir_iter_next, assembled
+    // from the fragments in front of it as they stream past
+    LfnState lfn;
+    DirSlot lfn_slot;     // first fragment of the pending name
+    uint32_t lfn_count;   // fragments in front of the entry, 0 if none
+    char long_name[LONG_NAME_BUFFER];  // "" when the entry has none
+} DirIter;
+
+void dir_iter_open(DirIter *it, BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster);
+void dir_iter_open_direct(DirIter *it, BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster);
+const DirectoryEntry *dir_iter_next_raw(DirIter *it);
+const DirectoryEntry *dir_iter_next(DirIter *it);
+int dir_iter_accept(DirIter *it, const DirectoryEntry *entry);
+void dir_iter_close(DirIter *it);
+
+void entry_name(const DirectoryEntry *entry, char *name);
+uint32_t entry_cluster(const DirectoryEntry *entry);
+int name_to_short(const char *name, uint8_t *short_name);
+void dir_write_entry(BlockDevice *dev, FAT32BootSector *bs, const DirSlot *slot, const DirectoryEntry *entry);
+
+#endif // DIR_ITER_H
@@ -0,0 +1,31 @@
+#pragma once
+#include <stdint.h>
+
+#ifndef EXTENT_H
+#define EXTENT_H
+
+// A run of physically contiguous clusters within a file
+typedef struct {
+    uint32_t file_index;   // cluster index within the file of the first cluster
+    uint32_t cluster;      // first physical cluster of the run
+    uint32_t length;       // number of clusters in the run
+} Extent;
+
+// Cluster-run map of a file's FAT chain, built lazily on first use so
+// offset-to-cluster translation is a binary search instead of a chain walk
+typedef struct {
+    uint32_t first_cluster;
+    Extent *runs;
+    uint32_t num_runs;
+    uint32_t capacity;
+    uint32_t total_clusters;
+    int valid;
+} ExtentMap;
+
+void extent_map_init(ExtentMap *map, uint32_t first_cluster);
+int extent_map_build(ExtentMap *map);
+int extent_map_lookup(ExtentMap *map, uint32_t file_index, uint32_t *cluster, uint32_t *run_remaining);
+void extent_map_invalidate(ExtentMap *map);
+void extent_map_free(ExtentMap *map);
+
+#endif // EXTENT_H
@@ -1,6 +1,8 @@
 #pragma once
 #include <stdint.h>
 #include <stdio.h>  // Include stdio.h for FILE type
+#include "blockdev.h"
+#include "extent.h"
 
 #ifndef FAT32_H
 #define FAT32_H
@@ -36,6 +38,17 @@ typedef struct {
     uint8_t fs_type[8];
 } __attribute__((packed)) FAT32BootSector;
 
+// Define FSInfo sector structure
+typedef struct {
+    uint32_t lead_sig;
+    uint8_t reserved1[480];
+    uint32_t struct_sig;
+    uint32_t free_count;
+    uint32_t next_free;
+    uint8_t reserved2[12];
+    uint32_t trail_sig;
+} __attribute__((packed)) FSInfo;
+
 // Define Directory Entry structure
 typedef struct {
     uint8_t name[11];
@@ -52,37 +65,72 @@ typedef struct {
     uint32_t filesize;
 } __attribute__((packed)) DirectoryEntry;
 
+// A long name of 255 UTF-16 units as UTF-8, plus the terminator
+#define LONG_NAME_BUFFER (255 * 3 + 1)
+
 typedef struct {
-    char filename[12];
+    int fd;
+    char filename[LONG_NAME_BUFFER];
     uint32_t cluster;
     char mode[3];
     uint32_t offset;
+    uint32_t size;
+    ExtentMap extents;    // built on first offset translation
+    uint32_t readahead;      // current read window in bytes
+    uint32_t last_read_end;  // offset where the previous read stopped
+
+    // Directory entry the file was opened from
+    uint32_t dir_cluster;
+    uint32_t entry_position;
+    uint8_t short_name[11];
+    char *path;              // shell path at open time, for lsof
+
+    // Per-handle I/O buffers, reused across reads
+    uint8_t *io_buffers[2];
+    uint32_t io_buffer_size;
+    uint8_t *cluster_cache;  // last cluster read by a small read
+    uint32_t cached_cluster;
+
+    // Delayed-allocation write buffer covering [write_start, write_start + write_length)
+    uint8_t *write_buffer;
+    uint32_t write_start;
+    uint32_t write_length;
+    uint32_t write_capacity;
 } OpenFile;
 
-#define MAX_OPEN_FILES 10
-extern OpenFile open_files[MAX_OPEN_FILES];
 
 
+// Where command output goes: stdout for the interactive shell, the
+// client's socket for a server session. Set once per thread.
+extern __thread FILE *shell_out;
+
 // Function declarations
-void handle_ls_command(FILE *image, FAT32BootSector *bs, uint32_t cluster);
+void handle_ls_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster);
 void print_boot_sector_info(FAT32BootSector *bs);
 uint32_t cluster_to_sector(FAT32BootSector *bs, uint32_t cluster);
-void read_cluster(FILE *image, FAT32BootSector *bs, uint32_t cluster, void *buffer);
-void write_cluster(FILE *image, FAT32BootSector *bs, uint32_t cluster, const void *buffer);
-uint32_t find_directory_cluster(FILE *image, FAT32BootSector *bs, uint32_t cluster, const char *dirname);
-void handle_cd_command(FILE *image, FAT32BootSector *bs, uint32_t *current_cluster, uint32_t *parent_cluster, char *current_path, const char *dirname);
-void handle_mkdir_command(FILE *image, FAT32BootSector *bs, uint32_t current_cluster, const char *dirname);
-uint32_t find_free_cluster(FILE *image, FAT32BootSector *bs);
-void write_fat_entry(FILE *image, FAT32BootSector *bs, uint32_t cluster, uint32_t value);
-void populate_dir(FILE *image, FAT32BootSector *bs, DirectoryEntry *entries, uint32_t cluster);
+uint64_t cluster_to_offset(FAT32BootSector *bs, uint32_t cluster);
+uint32_t cluster_size(FAT32BootSector *bs);
+void read_cluster(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, void *buffer);
+void write_cluster(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, const void *buffer);
+uint32_t find_directory_cluster(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, const char *dirname);
+void handle_cd_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t *current_cluster, char *current_path, const char *path);
+void handle_mkdir_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *dirname);
+uint32_t find_free_cluster(BlockDevice *dev, FAT32BootSector *bs);
+void write_fat_entry(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, uint32_t value);
+void populate_dir(BlockDevice *dev, FAT32BootSector *bs, DirectoryEntry *entries, uint32_t cluster);
 void create_directory_entry(DirectoryEntry *entry, const char *name, uint32_t cluster);
 void create_special_entries(DirectoryEntry *entries, uint32_t new_cluster, uint32_t parent_cluster);
 
 void read_directory_entry(FILE *fp, DirectoryEntry *entry);
 void write_directory_entry(FILE *fp);
-void handle_creat_command(FILE *image, FAT32BootSector *bs, uint32_t current_cluster, const char *filename);
-void handle_open_command(FILE *image, FAT32BootSector *bs, uint32_t current_cluster, const char *filename, const char *mode);
-void handle_close_command(const char *filename);
+int create_file(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const char *filename, DirectoryEntry *entry);
+void handle_creat_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *filename);
+void handle_open_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *current_path, const char *filename, const char *mode);
+void handle_close_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *filename);
+void handle_lseek_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *filename, const char *offset);
+void handle_lsof_command(void);
+OpenFile *find_open_file(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const char *filename);
+int open_file_locate(OpenFile *file, FAT32BootSector *bs, uint32_t offset, uint32_t *cluster, uint32_t *run_remaining);
 
 
 
@@ -0,0 +1,61 @@
+#pragma once
+#include <stdint.h>
+#include "fat32.h"
+
+#ifndef FAT_TABLE_H
+#define FAT_TABLE_H
+
+#define FAT_ENTRY_MASK 0x0FFFFFFF
+#define FAT_EOC 0x0FFFFFF8
+
+typedef struct {
+    uint32_t updates;        // write_fat_entry calls absorbed by the flush
+    uint32_t sectors;        // distinct FAT sectors written per copy
+    uint32_t copies;         // FAT copies written
+    uint32_t writes;         // I/O operations actually issued
+    uint32_t ops_saved;      // versus one 4-byte write per update per copy
+    uint32_t bytes_saved;    // redundant entry bytes never written
+} FatFlushStats;
+
+// Resident copy of the first FAT, loaded once at mount.
+// free_map has one bit per cluster number, set when the cluster is free,
+// so allocation scans 64 clusters per word instead of one FAT entry at a time.
+typedef struct {
+    uint32_t *entries;
+    uint64_t *free_map;
+    uint32_t num_entries;    // highest valid cluster number + 1
+    uint32_t next_free;      // allocation hint, seeded from FSInfo
+    uint32_t free_count;     // kept current by every allocation and free
+
+    // FSInfo sector as last read or written. Its counts are refreshed
+    // from the two fields above on sync and exit.
+    FSInfo fs_info;
+    int has_fs_info;
+
+    // Write-back state: entries are only changed in memory and the
+    // touched sectors are written to every FAT copy on flush
+    uint64_t *dirty_sectors;
+    uint64_t *dirty_entries;
+    uint32_t num_sectors;
+    uint32_t sector_size;
+    uint32_t pending_updates;
+    uint32_t pending_distinct;
+    FatFlushStats totals;    // accumulated over every flush since mount
+} FatTable;
+
+extern FatTable fat_table;
+
+int fat_table_load(BlockDevice *dev, FAT32BootSector *bs);
+void fat_table_free(void);
+void fat_table_lock(void);
+void fat_table_unlock(void);
+uint32_t fat_table_get(uint32_t cluster);
+void fat_table_set(uint32_t cluster, uint32_t value);
+uint32_t fat_table_free_chain(uint32_t first);
+uint32_t fat_table_find_free(void);
+uint32_t fat_table_find_run(uint32_t count, uint32_t goal, uint32_t *length);
+int fat_table_flush(BlockDevice *dev, FAT32BootSector *bs, FatFlushStats *stats);
+int fat_table_write_fs_info(BlockDevice *dev, FAT32BootSector *bs);
+uint32_t fat_data_clusters(FAT32BootSector *bs);
+
+#endif // FAT_TABLE_H
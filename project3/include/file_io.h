@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+#include "fat32.h"
+
+#ifndef FILE_IO_H
+#define FILE_IO_H
+
+#define READ_WINDOW_MIN (64 * 1024)
+#define READ_WINDOW_MAX (4 * 1024 * 1024)
+#define WRITE_BUFFER_MAX (8 * 1024 * 1024)
+
+int file_write(BlockDevice *dev, FAT32BootSector *bs, OpenFile *file, const void *data, uint32_t length);
+int file_flush(BlockDevice *dev, FAT32BootSector *bs, OpenFile *file);
+int file_preallocate(BlockDevice *dev, FAT32BootSector *bs, OpenFile *file, uint32_t size);
+void flush_open_files(BlockDevice *dev, FAT32BootSector *bs);
+
+void handle_read_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *filename, const char *size, const char *host_path);
+
+void handle_write_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *filename, const char *text);
+void handle_import_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *host_path);
+
+#endif // FILE_IO_H
@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+#include "fat32.h"
+
+#ifndef HANDLE_H
+#define HANDLE_H
+
+// Growable table of open files. Descriptors are small integers reused
+// through a free list, and a hash keyed by the file's directory entry
+// (directory cluster, entry position) finds an open file in O(1)
+// without comparing names. Each server session has its own table; the
+// entries open in any session are also kept in one shared registry, so
+// a file is open in at most one session at a time.
+typedef struct {
+    OpenFile **files;      // indexed by descriptor, NULL when free
+    int *next_free;        // free-list links, parallel to files
+    int capacity;
+    int free_head;
+    int count;
+
+    int *buckets;          // open addressing over descriptors, -1 when empty
+    int num_buckets;       // power of two
+} HandleTable;
+
+extern __thread HandleTable handle_table;
+
+OpenFile *handle_alloc(uint32_t dir_cluster, uint32_t entry_position);
+int handle_in_use(uint32_t dir_cluster, uint32_t entry_position);
+int handle_dir_in_use(uint32_t dir_cluster);
+OpenFile *handle_lookup(uint32_t dir_cluster, uint32_t entry_position);
+OpenFile *handle_get(int fd);
+void handle_release(OpenFile *file);
+void handle_table_free(void);
+
+#endif // HANDLE_H
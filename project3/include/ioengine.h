@@ -0,0 +1,28 @@
+#pragma once
+#include <stddef.h>
+#include "blockdev.h"
+
+#ifndef IOENGINE_H
+#define IOENGINE_H
+
+typedef enum {
+    IO_ENGINE_AUTO,     // io_uring if the kernel has it, else the thread pool
+    IO_ENGINE_URING,
+    IO_ENGINE_THREADS,
+    IO_ENGINE_SYNC      // no engine: batches run inline, one request at a time
+} IoEngineKind;
+
+#define IO_QUEUE_DEPTH 64        // requests kept in flight by io_uring
+#define IO_THREADS 8             // workers of the fallback pool
+#define IO_SPLIT_BYTES (256 * 1024)  // large transfers go out in pieces of this size
+
+typedef struct IoEngine IoEngine;
+
+IoEngine *io_engine_create(int fd, IoEngineKind kind);
+void io_engine_destroy(IoEngine *engine);
+const char *io_engine_name(const IoEngine *engine);
+unsigned io_engine_depth(const IoEngine *engine);
+int io_engine_submit(IoEngine *engine, IoRequest *requests, size_t count);
+int io_engine_parse(const char *name, IoEngineKind *kind);
+
+#endif // IOENGINE_H
@@ -0,0 +1,87 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include "blockdev.h"
+#include "fat32.h"
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_MAGIC 0x4C4E524A         // "JRNL", starts a transaction
+#define JOURNAL_COMMIT_MAGIC 0x54494D43  // "CMIT", ends one
+#define JOURNAL_CHECKPOINT_BYTES (16 * 1024 * 1024)  // journal size that forces a checkpoint
+#define JOURNAL_OPS_BYTES 48
+#define JOURNAL_REVOKE 0x80000000u       // record length flag, see JournalRecord
+
+// A transaction in the journal file is a header, its records, the data
+// of every record back to back, then a commit block. Only transactions
+// with an intact commit block are replayed.
+typedef struct {
+    uint32_t magic;
+    uint32_t num_records;
+    uint64_t sequence;
+    uint64_t length;                 // bytes of records and data that follow
+    char ops[JOURNAL_OPS_BYTES];     // commands covered, for the recovery report
+} __attribute__((packed)) JournalHeader;
+
+// A record with JOURNAL_REVOKE set in its length carries no data: the
+// range was freed, so writes to it in earlier transactions must not be
+// replayed over whatever has been written there directly since.
+typedef struct {
+    uint64_t offset;                 // image offset the data belongs at
+    uint32_t length;
+} __attribute__((packed)) JournalRecord;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t checksum;               // over the header, records and data
+    uint64_t sequence;
+} __attribute__((packed)) JournalCommit;
+
+typedef struct {
+    uint64_t transactions;
+    uint64_t records;
+    uint64_t bytes;                  // record data logged
+    uint64_t checkpoints;
+} JournalStats;
+
+// Write-ahead log of metadata writes. Directory write-backs and FAT
+// sector writes are staged here instead of going to the image; at the
+// end of a transaction they are appended to the journal file with one
+// fdatasync, and only then written in place. Every command runs as a
+// transaction and transactions nest, so a command's directory and FAT
+// writes commit together, and sessions that finish at the same time
+// share one sync. Until then reads of the image go through journal_read
+// to see the staged writes. Once the image itself has been synced the
+// journal is emptied (a checkpoint).
+typedef struct {
+    int fd;                          // -1 when journaling is off
+    char *path;
+    uint64_t size;                   // bytes in the journal file
+    uint64_t sequence;
+    uint32_t depth;                  // open journal_begin calls
+    JournalRecord *records;          // staged transaction
+    uint32_t num_records;
+    uint32_t record_capacity;
+    uint8_t *data;
+    uint64_t data_length;
+    uint64_t data_capacity;
+    char ops[JOURNAL_OPS_BYTES];
+    JournalStats stats;
+    pthread_mutex_t lock;
+} Journal;
+
+extern Journal journal;
+
+int journal_open(BlockDevice *dev, const char *path);
+void journal_close(BlockDevice *dev);
+void journal_begin(void);
+int journal_end(BlockDevice *dev);
+int journal_write(BlockDevice *dev, IoRequest *requests, size_t count);
+int journal_read(BlockDevice *dev, uint64_t offset, void *buffer, size_t length);
+void journal_discard(uint64_t offset, size_t length);
+int journal_flush(BlockDevice *dev, FAT32BootSector *bs);
+void journal_note(const char *op);
+int journal_checkpoint(BlockDevice *dev);
+
+#endif // JOURNAL_H
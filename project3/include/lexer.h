@@ -1,15 +1,42 @@
 #pragma once
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 
+// Bump allocator reset between commands. Blocks only grow, so once the
+// largest command has been seen tokenizing allocates nothing.
+typedef struct ArenaBlock {
+    struct ArenaBlock *prev;
+    size_t used;
+    size_t capacity;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *block;
+} Arena;
+
 typedef struct {
     char ** items;
     size_t size;
 } tokenlist;
 
-char * get_input(void);
-tokenlist * get_tokens(char *input);
-tokenlist * new_tokenlist(void);
-void add_token(tokenlist *tokens, char *item);
-void free_tokens(tokenlist *tokens);
+// Reusable line buffer plus the arena backing each line's token list.
+// Tokens are views into the line buffer, terminated in place.
+typedef struct {
+    char *line;
+    size_t line_capacity;
+    Arena arena;
+    tokenlist tokens;
+} Lexer;
+
+void arena_init(Arena *arena);
+void *arena_alloc(Arena *arena, size_t size);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+
+void lexer_init(Lexer *lexer);
+char * lexer_read_line(Lexer *lexer, FILE *in);
+tokenlist * lexer_tokenize(Lexer *lexer, char *input);
+void lexer_free(Lexer *lexer);
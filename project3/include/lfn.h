@@ -0,0 +1,37 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "fat32.h"
+
+#ifndef LFN_H
+#define LFN_H
+
+#define LFN_CHARS_PER_ENTRY 13
+#define LFN_MAX_UNITS 255      // UTF-16 code units in a long name
+#define LFN_MAX_ENTRIES 20     // ceil(255 / 13)
+#define LFN_LAST_ENTRY 0x40    // ordinal flag of the first physical entry
+#define LFN_ORDINAL_MASK 0x1F
+
+// Fragments of the long name being assembled while a directory is
+// scanned. Entries are stored last fragment first, so the first one
+// seen carries the fragment count and each following one must have
+// the next lower ordinal and the same checksum.
+typedef struct {
+    uint16_t units[LFN_MAX_ENTRIES * LFN_CHARS_PER_ENTRY];
+    uint8_t checksum;
+    uint8_t next_order;    // ordinal expected next, 0 once complete
+    uint8_t count;         // fragments in this name, 0 when none pending
+} LfnState;
+
+void lfn_reset(LfnState *state);
+int lfn_feed(LfnState *state, const DirectoryEntry *entry);
+int lfn_finish(LfnState *state, const DirectoryEntry *entry, char *name);
+
+uint8_t lfn_checksum(const uint8_t *short_name);
+int lfn_encode(const char *name, uint16_t *units);
+uint32_t lfn_entry_count(int length);
+void lfn_fill_entries(const uint16_t *units, int length, uint8_t checksum, DirectoryEntry *entries);
+void lfn_short_basis(const char *name, uint8_t *basis);
+void lfn_apply_tail(uint8_t *short_name, const uint8_t *basis, uint32_t n);
+
+#endif // LFN_H
@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+
+#ifndef LOCKS_H
+#define LOCKS_H
+
+#define DIR_LOCK_STRIPES 256  // power of two
+
+// Locking between server sessions. Every command runs under the image
+// lock: shared for commands that stay inside one directory, exclusive
+// for the ones that walk or rewrite whole trees (rm, du, check, defrag,
+// ...). Inside it, a command that reads or changes a directory holds
+// that directory's reader-writer lock; the locks are striped by
+// cluster, and a session never holds more than one at a time, so two
+// sessions can never wait on each other in a cycle. Cluster
+// allocation is serialized separately by the FAT allocator lock (see
+// fat_table_lock).
+void locks_init(void);
+void image_lock(int exclusive);
+void image_unlock(void);
+void dir_lock(uint32_t cluster, int exclusive);
+void dir_unlock(uint32_t cluster);
+
+#endif // LOCKS_H
@@ -0,0 +1,55 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include "fat32.h"
+
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#define OVERLAY_MAGIC "FATDELTA"
+#define OVERLAY_VERSION 1
+#define OVERLAY_HEADER_BYTES 512            // the bitmap starts here
+#define OVERLAY_COPY_BYTES (1024 * 1024)    // copied per read/write pair
+
+// On-disk header of a delta file. The image is cut into cluster-sized
+// blocks on a grid aligned to the data region, so block numbers in the
+// data region differ from cluster numbers by a constant. A bitmap of the
+// blocks present follows the header, and block data lives at
+// data_offset + block * block_size: the delta file is the image shifted
+// by a constant, sparse wherever the base is still current.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t shift;          // bytes of block 0 that lie before the image
+    uint32_t num_blocks;
+    uint64_t base_size;
+    int64_t base_mtime_sec;  // the base as the delta was made against it
+    int64_t base_mtime_nsec;
+    uint64_t data_offset;
+    uint32_t committing;     // a commit into the base was under way
+} __attribute__((packed)) OverlayHeader;
+
+// Copy-on-write state of a device mounted with a delta file. The base
+// image is opened read-only; every write lands in the delta, copying in
+// the rest of a block from the base first when only part of it is
+// written.
+typedef struct Overlay {
+    int delta_fd;
+    char *image_path;
+    char *delta_path;
+    OverlayHeader header;
+    uint8_t *present;        // one bit per block held in the delta
+    uint32_t stored;         // blocks held in the delta
+    int bitmap_dirty;        // bitmap changed since it was last written
+    uint64_t fat_start;      // image offsets of the FAT and data regions
+    uint64_t data_start;
+    pthread_rwlock_t lock;   // shared for reads, exclusive for writes
+} Overlay;
+
+int overlay_open(BlockDevice *dev, const char *image_path, const char *delta_path);
+void handle_snapshot_command(BlockDevice *dev, FAT32BootSector *bs, const char *path);
+void handle_diff_command(BlockDevice *dev, FAT32BootSector *bs);
+void handle_commit_command(BlockDevice *dev, FAT32BootSector *bs);
+
+#endif // OVERLAY_H
@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+#include "fat32.h"
+
+#ifndef PATH_H
+#define PATH_H
+
+#define MAX_PATH_LENGTH 4096
+#define DCACHE_CAPACITY 4096
+
+// LRU cache mapping (parent cluster, raw 8.3 name) to (cluster, attr)
+// so repeated path walks resolve without touching the image
+typedef struct Dentry {
+    uint32_t parent;
+    uint8_t name[11];
+    uint32_t cluster;
+    uint8_t attr;
+    struct Dentry *hash_next;
+    struct Dentry *lru_prev;
+    struct Dentry *lru_next;
+} Dentry;
+
+typedef struct {
+    Dentry *buckets[DCACHE_CAPACITY];
+    Dentry *lru_head;      // most recently used
+    Dentry *lru_tail;      // least recently used
+    uint32_t count;
+    uint64_t hits;
+    uint64_t misses;
+} DentryCache;
+
+extern DentryCache dcache;
+
+int dcache_lookup(BlockDevice *dev, FAT32BootSector *bs, uint32_t parent, const uint8_t *short_name, uint32_t *cluster, uint8_t *attr);
+void dcache_invalidate(uint32_t parent, const uint8_t *short_name);
+void dcache_clear(void);
+
+int path_resolve(BlockDevice *dev, FAT32BootSector *bs, uint32_t cwd_cluster, const char *path, uint32_t *cluster, uint8_t *attr);
+int path_resolve_parent(BlockDevice *dev, FAT32BootSector *bs, uint32_t cwd_cluster, const char *path, uint32_t *parent, char *leaf, size_t leaf_size);
+int path_join(char *current_path, size_t size, const char *path);
+
+#endif // PATH_H
@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+#include "commands.h"
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#define SERVER_BACKLOG 64
+
+// One client connection. Each session runs on its own thread with its
+// own Shell (current directory), descriptor table and output stream.
+typedef struct Session {
+    Shell shell;
+    int fd;
+    FILE *in;
+    FILE *out;
+    struct Session *next;
+} Session;
+
+int server_run(Shell *shell, const char *socket_path);
+int server_cwd_in_use(uint32_t cluster);
+
+#endif // SERVER_H
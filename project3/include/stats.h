@@ -0,0 +1,75 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef STATS_H
+#define STATS_H
+
+// Instrumentation is compiled in with -DFS_STATS (make STATS=1, the
+// default). Without it every hook below expands to nothing.
+
+#define STATS_HIST_SUB 8                         // sub-buckets per power of two
+#define STATS_HIST_BUCKETS (62 * STATS_HIST_SUB)
+
+// I/O done on behalf of one command
+typedef struct {
+    uint64_t clusters_read;
+    uint64_t clusters_written;
+    uint64_t fat_entries;     // FAT entries changed
+    uint64_t seeks;           // device requests not contiguous with the previous one
+    uint64_t bytes_read;      // at the device
+    uint64_t bytes_written;
+} IoCounters;
+
+typedef struct {
+    const char *name;
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    IoCounters io;
+    uint32_t histogram[STATS_HIST_BUCKETS];  // log-linear latency buckets
+} CommandStats;
+
+#ifdef FS_STATS
+
+// Counted per thread, so each server session charges only its own I/O
+// to the command it is running
+extern __thread IoCounters stats_io;
+
+#define STAT_ADD(field, n) (stats_io.field += (n))
+
+// Counts a device request and whether the head had to move for it
+#define STAT_DEV_IO(dev, offset, length, field)        \
+    do {                                               \
+        if ((offset) != (dev)->last_end) {             \
+            stats_io.seeks++;                          \
+        }                                              \
+        (dev)->last_end = (offset) + (length);         \
+        stats_io.field += (length);                    \
+    } while (0)
+
+void stats_init(size_t num_commands);
+void stats_free(void);
+uint64_t stats_begin(void);
+void stats_end(size_t command, const char *name, uint64_t start);
+void stats_report(FILE *out);
+int stats_trace_open(const char *path);
+void stats_trace_close(void);
+
+#else
+
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_DEV_IO(dev, offset, length, field) ((void)0)
+
+static inline void stats_init(size_t num_commands) { (void)num_commands; }
+static inline void stats_free(void) {}
+static inline uint64_t stats_begin(void) { return 0; }
+static inline void stats_end(size_t command, const char *name, uint64_t start) { (void)command; (void)name; (void)start; }
+static inline void stats_report(FILE *out) { fprintf(out, "Per-command statistics are disabled (built with STATS=0).\n"); }
+static inline int stats_trace_open(const char *path) { (void)path; return -1; }
+static inline void stats_trace_close(void) {}
+
+#endif // FS_STATS
+
+#endif // STATS_H
@@ -0,0 +1,44 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include "fat32.h"
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#define TRANSFER_CHUNK_BYTES (1024 * 1024)  // data handed between threads at once
+#define TRANSFER_SLOTS 8                    // chunks in flight
+#define TRANSFER_SEGMENTS 256               // file pieces per chunk
+
+// A piece of one file inside a chunk. Small files share a chunk, so a
+// tree of many small files still moves in large batches.
+typedef struct {
+    uint32_t item;         // file number within the transfer
+    uint32_t offset;       // within the file
+    uint32_t length;
+    uint32_t position;     // within the chunk
+} TransferSegment;
+
+typedef struct {
+    uint8_t *buffer;
+    TransferSegment segments[TRANSFER_SEGMENTS];
+    uint32_t num_segments;
+    uint32_t used;         // bytes of the buffer filled
+    int full;
+} TransferSlot;
+
+// Ring of chunks between a producer and a consumer thread. Host I/O runs
+// on a helper thread and image I/O on the command's own thread, so host
+// reads or writes overlap with device transfers.
+typedef struct {
+    TransferSlot slots[TRANSFER_SLOTS];
+    int done;              // producer finished
+    int failed;            // either side gave up
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} TransferPipe;
+
+void handle_import_tree_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *host_path);
+void handle_export_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *path, const char *host_dir);
+
+#endif // TRANSFER_H
@@ -0,0 +1,14 @@
+#pragma once
+#include <stdint.h>
+#include "fat32.h"
+
+#ifndef TREE_H
+#define TREE_H
+
+void handle_rm_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *path, int recursive);
+void handle_rmdir_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *path);
+void handle_rename_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *path, const char *new_name);
+void handle_du_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *current_path, const char *path);
+void handle_find_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *current_path, const char *path, const char *pattern);
+
+#endif // TREE_H
@@ -0,0 +1,36 @@
+#pragma once
+#include <stdint.h>
+#include "dir_iter.h"
+
+#ifndef WALK_H
+#define WALK_H
+
+#define WALK_BATCH_BYTES (4 * 1024 * 1024)
+
+// Visitor return values
+#define WALK_CONTINUE 0
+#define WALK_SKIP 1     // do not descend into this directory
+#define WALK_STOP 2     // abandon the walk
+
+// One directory reached by the walk. Directories are numbered in the
+// order they are discovered, so a parent's id is always below its
+// children's and per-directory totals can be rolled up in reverse.
+typedef struct {
+    uint32_t cluster;   // first cluster of the directory
+    uint32_t id;
+    uint32_t parent_id; // equal to id for the starting directory
+    uint32_t depth;
+    char *path;         // "" for the root, otherwise "/A/B"
+} WalkDir;
+
+typedef int (*WalkVisitor)(const WalkDir *dir, const DirectoryEntry *entry, const DirSlot *slot, const char *name, void *arg);
+
+typedef struct {
+    uint32_t directories;
+    uint32_t clusters;   // directory clusters read
+    uint32_t reads;      // read calls issued for them
+} WalkStats;
+
+int tree_walk(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, const char *path, WalkVisitor visit, void *arg, WalkStats *stats);
+
+#endif // WALK_H
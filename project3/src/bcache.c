@@ -0,0 +1,242 @@
+#include "bcache.h"
+#include "journal.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+BlockCache bcache;
+
+// Server sessions share the cache. Every entry point below holds this
+// for its whole duration, so slot contents are only ever handed out as
+// copies.
+static pthread_mutex_t bcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t bucket_of(uint32_t cluster) {
+    return (cluster * 2654435761u) & (bcache.num_buckets - 1);
+}
+
+static uint8_t *slot_data(uint32_t slot) {
+    return bcache.data + (size_t)slot * bcache.cluster_size;
+}
+
+int bcache_init(FAT32BootSector *bs, uint32_t capacity) {
+    memset(&bcache, 0, sizeof(bcache));
+    if (capacity == 0) {
+        capacity = 1;
+    }
+    bcache.capacity = capacity;
+    bcache.cluster_size = cluster_size(bs);
+    bcache.sector_size = bs->bytes_per_sector;
+    bcache.data_start = cluster_to_offset(bs, 2);
+    bcache.num_buckets = 1;
+    while (bcache.num_buckets < capacity * 2) {
+        bcache.num_buckets <<= 1;
+    }
+
+    bcache.slots = calloc(capacity, sizeof(BlockCacheSlot));
+    bcache.data = malloc((size_t)capacity * bcache.cluster_size);
+    bcache.buckets = malloc(bcache.num_buckets * sizeof(uint32_t));
+    if (bcache.slots == NULL || bcache.data == NULL || bcache.buckets == NULL) {
+        bcache_free();
+        return -1;
+    }
+    memset(bcache.buckets, 0xFF, bcache.num_buckets * sizeof(uint32_t));
+    return 0;
+}
+
+void bcache_free(void) {
+    free(bcache.slots);
+    free(bcache.data);
+    free(bcache.buckets);
+    memset(&bcache, 0, sizeof(bcache));
+}
+
+static uint32_t find_slot(uint32_t cluster) {
+    if (bcache.buckets == NULL) {
+        return BCACHE_NONE;
+    }
+    uint32_t slot = bcache.buckets[bucket_of(cluster)];
+    while (slot != BCACHE_NONE && bcache.slots[slot].cluster != cluster) {
+        slot = bcache.slots[slot].hash_next;
+    }
+    return slot;
+}
+
+static void unhash_slot(uint32_t slot) {
+    uint32_t *link = &bcache.buckets[bucket_of(bcache.slots[slot].cluster)];
+    while (*link != slot) {
+        link = &bcache.slots[*link].hash_next;
+    }
+    *link = bcache.slots[slot].hash_next;
+    bcache.slots[slot].cluster = 0;
+    bcache.used--;
+}
+
+// Describes the write-back of a slot's dirty range, widened to whole
+// sectors so the device only ever sees sector-aligned writes, and marks
+// the slot clean
+static IoRequest prepare_write_back(FAT32BootSector *bs, uint32_t slot) {
+    BlockCacheSlot *s = &bcache.slots[slot];
+    uint32_t start = s->dirty_start / bcache.sector_size * bcache.sector_size;
+    uint32_t end = (s->dirty_end + bcache.sector_size - 1) / bcache.sector_size * bcache.sector_size;
+    IoRequest request = { 1, cluster_to_offset(bs, s->cluster) + start, slot_data(slot) + start, end - start, 0 };
+
+    bcache.dirty_bytes -= s->dirty_end - s->dirty_start;
+    bcache.stats.writebacks++;
+    bcache.stats.bytes_written += end - start;
+    s->dirty_start = s->dirty_end = 0;
+    return request;
+}
+
+static int write_back(BlockDevice *dev, FAT32BootSector *bs, uint32_t slot) {
+    if (bcache.slots[slot].dirty_end == bcache.slots[slot].dirty_start) {
+        return 0;
+    }
+    IoRequest request = prepare_write_back(bs, slot);
+    return journal_write(dev, &request, 1);
+}
+
+// Picks a slot for a new cluster: a free one while the cache fills, then
+// the first slot the CLOCK hand finds without its reference bit
+static uint32_t claim_slot(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster) {
+    uint32_t slot;
+
+    if (bcache.used < bcache.capacity) {
+        slot = bcache.hand;
+        while (bcache.slots[slot].cluster != 0) {
+            slot = (slot + 1) % bcache.capacity;
+        }
+    } else {
+        while (bcache.slots[bcache.hand].referenced) {
+            bcache.slots[bcache.hand].referenced = 0;
+            bcache.hand = (bcache.hand + 1) % bcache.capacity;
+        }
+        slot = bcache.hand;
+        write_back(dev, bs, slot);
+        unhash_slot(slot);
+        bcache.stats.evictions++;
+    }
+    bcache.hand = (slot + 1) % bcache.capacity;
+
+    BlockCacheSlot *s = &bcache.slots[slot];
+    uint32_t bucket = bucket_of(cluster);
+    s->cluster = cluster;
+    s->dirty_start = s->dirty_end = 0;
+    s->referenced = 1;
+    s->hash_next = bcache.buckets[bucket];
+    bcache.buckets[bucket] = slot;
+    bcache.used++;
+    return slot;
+}
+
+static uint32_t load_slot(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster) {
+    uint32_t slot = find_slot(cluster);
+    if (slot != BCACHE_NONE) {
+        bcache.slots[slot].referenced = 1;
+        bcache.stats.hits++;
+        return slot;
+    }
+
+    bcache.stats.misses++;
+    slot = claim_slot(dev, bs, cluster);
+    if (journal_read(dev, cluster_to_offset(bs, cluster), slot_data(slot), bcache.cluster_size) != 0) {
+        memset(slot_data(slot), 0, bcache.cluster_size);
+    }
+    return slot;
+}
+
+// Copies LENGTH bytes at OFFSET within CLUSTER into BUFFER, reading the
+// cluster on a miss
+void bcache_read(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, uint32_t offset, void *buffer, uint32_t length) {
+    pthread_mutex_lock(&bcache_lock);
+    memcpy(buffer, slot_data(load_slot(dev, bs, cluster)) + offset, length);
+    pthread_mutex_unlock(&bcache_lock);
+}
+
+// Copies LENGTH bytes into CLUSTER at OFFSET and marks them dirty. A
+// write covering the whole cluster does not need to read it first.
+void bcache_write(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, uint32_t offset, const void *data, uint32_t length) {
+    uint32_t slot;
+    pthread_mutex_lock(&bcache_lock);
+    if (offset == 0 && length == bcache.cluster_size) {
+        slot = find_slot(cluster);
+        if (slot == BCACHE_NONE) {
+            bcache.stats.misses++;
+            slot = claim_slot(dev, bs, cluster);
+        } else {
+            bcache.slots[slot].referenced = 1;
+            bcache.stats.hits++;
+        }
+    } else {
+        slot = load_slot(dev, bs, cluster);
+    }
+    memcpy(slot_data(slot) + offset, data, length);
+
+    BlockCacheSlot *s = &bcache.slots[slot];
+    bcache.dirty_bytes -= s->dirty_end - s->dirty_start;
+    if (s->dirty_end == s->dirty_start) {
+        s->dirty_start = offset;
+        s->dirty_end = offset + length;
+    } else {
+        if (offset < s->dirty_start) {
+            s->dirty_start = offset;
+        }
+        if (offset + length > s->dirty_end) {
+            s->dirty_end = offset + length;
+        }
+    }
+    bcache.dirty_bytes += s->dirty_end - s->dirty_start;
+    pthread_mutex_unlock(&bcache_lock);
+}
+
+// Drops CLUSTER without writing it back, along with any write-back of it
+// still staged in the journal. Called when the cluster is freed, so
+// stale directory contents can never land on top of data the cluster
+// holds after being reallocated.
+void bcache_discard(uint32_t cluster) {
+    pthread_mutex_lock(&bcache_lock);
+    uint32_t slot = find_slot(cluster);
+    if (slot != BCACHE_NONE) {
+        BlockCacheSlot *s = &bcache.slots[slot];
+        bcache.dirty_bytes -= s->dirty_end - s->dirty_start;
+        s->dirty_start = s->dirty_end = 0;
+        unhash_slot(slot);
+    }
+    journal_discard(bcache.data_start + (uint64_t)(cluster - 2) * bcache.cluster_size, bcache.cluster_size);
+    pthread_mutex_unlock(&bcache_lock);
+}
+
+static int compare_slots(const void *a, const void *b) {
+    uint32_t x = bcache.slots[*(const uint32_t *)a].cluster;
+    uint32_t y = bcache.slots[*(const uint32_t *)b].cluster;
+    return (x > y) - (x < y);
+}
+
+// Writes every dirty slot back in cluster order. Slots stay cached.
+int bcache_flush(BlockDevice *dev, FAT32BootSector *bs) {
+    pthread_mutex_lock(&bcache_lock);
+    if (bcache.dirty_bytes == 0) {
+        pthread_mutex_unlock(&bcache_lock);
+        return 0;
+    }
+
+    uint32_t *dirty = malloc(bcache.capacity * sizeof(uint32_t));
+    uint32_t count = 0;
+    for (uint32_t slot = 0; slot < bcache.capacity; slot++) {
+        if (bcache.slots[slot].cluster != 0 && bcache.slots[slot].dirty_end != bcache.slots[slot].dirty_start) {
+            dirty[count++] = slot;
+        }
+    }
+    qsort(dirty, count, sizeof(uint32_t), compare_slots);
+
+    // All write-backs go to the device (or the journal) as one batch
+    IoRequest *requests = malloc(count * sizeof(IoRequest));
+    for (uint32_t i = 0; i < count; i++) {
+        requests[i] = prepare_write_back(bs, dirty[i]);
+    }
+    int result = journal_write(dev, requests, count);
+    pthread_mutex_unlock(&bcache_lock);
+    free(requests);
+    free(dirty);
+    return result;
+}
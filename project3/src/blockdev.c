@@ -0,0 +1,228 @@
+#include "blockdev.h"
+#include "ioengine.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int in_bounds(BlockDevice *dev, uint64_t offset, size_t length) {
+    return offset <= dev->size && length <= dev->size - offset;
+}
+
+// pread/pwrite backend: one positioned syscall per request, no stdio copy
+
+static int pread_read(BlockDevice *dev, uint64_t offset, void *buffer, size_t length) {
+    uint8_t *out = buffer;
+    while (length > 0) {
+        ssize_t n = pread(dev->fd, out, length, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        out += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int pread_write(BlockDevice *dev, uint64_t offset, const void *buffer, size_t length) {
+    const uint8_t *in = buffer;
+    while (length > 0) {
+        ssize_t n = pwrite(dev->fd, in, length, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        in += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int pread_sync(BlockDevice *dev) {
+    return fsync(dev->fd);
+}
+
+static void pread_prefetch(BlockDevice *dev, uint64_t offset, size_t length) {
+    posix_fadvise(dev->fd, (off_t)offset, (off_t)length, POSIX_FADV_WILLNEED);
+}
+
+static void pread_close(BlockDevice *dev) {
+    (void)dev;
+}
+
+static const BlockDeviceOps pread_ops = {
+    "pread", pread_read, pread_write, pread_sync, pread_prefetch, pread_close
+};
+
+// mmap backend: the image is mapped shared, reads and writes are plain
+// memory copies and dev_view hands out pointers straight into the mapping
+
+static int mmap_read(BlockDevice *dev, uint64_t offset, void *buffer, size_t length) {
+    memcpy(buffer, dev->map + offset, length);
+    return 0;
+}
+
+static int mmap_write(BlockDevice *dev, uint64_t offset, const void *buffer, size_t length) {
+    memcpy(dev->map + offset, buffer, length);
+    return 0;
+}
+
+static int mmap_sync(BlockDevice *dev) {
+    return msync(dev->map, dev->size, MS_SYNC);
+}
+
+static void mmap_prefetch(BlockDevice *dev, uint64_t offset, size_t length) {
+    // madvise needs a page-aligned start
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = offset & ~(page - 1);
+    madvise(dev->map + start, length + (offset - start), MADV_WILLNEED);
+}
+
+static void mmap_close(BlockDevice *dev) {
+    munmap(dev->map, dev->size);
+    dev->map = NULL;
+}
+
+static const BlockDeviceOps mmap_ops = {
+    "mmap", mmap_read, mmap_write, mmap_sync, mmap_prefetch, mmap_close
+};
+
+int dev_open(BlockDevice *dev, const char *path, DevBackend backend) {
+    memset(dev, 0, sizeof(*dev));
+
+    dev->writable = 1;
+    dev->fd = open(path, O_RDWR);
+    if (dev->fd < 0 && (errno == EACCES || errno == EROFS)) {
+        dev->writable = 0;
+        dev->fd = open(path, O_RDONLY);
+    }
+    if (dev->fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(dev->fd, &st) != 0) {
+        close(dev->fd);
+        return -1;
+    }
+    dev->size = (uint64_t)st.st_size;
+    dev->ops = &pread_ops;
+
+    if (backend == DEV_BACKEND_MMAP && dev->size > 0) {
+        int prot = PROT_READ | (dev->writable ? PROT_WRITE : 0);
+        void *map = mmap(NULL, dev->size, prot, MAP_SHARED, dev->fd, 0);
+        if (map != MAP_FAILED) {
+            dev->map = map;
+            dev->ops = &mmap_ops;
+        }
+        // Otherwise fall back to pread/pwrite silently
+    }
+    return 0;
+}
+
+void dev_close(BlockDevice *dev) {
+    if (dev->ops == NULL) {
+        return;
+    }
+    io_engine_destroy(dev->engine);
+    dev->engine = NULL;
+    dev->ops->close(dev);
+    close(dev->fd);
+    dev->ops = NULL;
+    dev->fd = -1;
+}
+
+int dev_read(BlockDevice *dev, uint64_t offset, void *buffer, size_t length) {
+    if (!in_bounds(dev, offset, length)) {
+        return -1;
+    }
+    STAT_DEV_IO(dev, offset, length, bytes_read);
+    return dev->ops->read(dev, offset, buffer, length);
+}
+
+int dev_write(BlockDevice *dev, uint64_t offset, const void *buffer, size_t length) {
+    if (!dev->writable || !in_bounds(dev, offset, length)) {
+        return -1;
+    }
+    STAT_DEV_IO(dev, offset, length, bytes_written);
+    return dev->ops->write(dev, offset, buffer, length);
+}
+
+// Runs a batch of reads and writes and waits for all of them. With an
+// engine attached every request is in flight at once; otherwise the
+// whole batch is prefetched and then run in order. Each request gets
+// its own result; returns -1 if any of them failed.
+int dev_submit(BlockDevice *dev, IoRequest *requests, size_t count) {
+    int valid = 1;
+    for (size_t i = 0; i < count; i++) {
+        IoRequest *request = &requests[i];
+        request->result = -1;
+        if ((request->write && !dev->writable) || !in_bounds(dev, request->offset, request->length)) {
+            valid = 0;
+            continue;
+        }
+        if (request->write) {
+            STAT_DEV_IO(dev, request->offset, request->length, bytes_written);
+        } else {
+            STAT_DEV_IO(dev, request->offset, request->length, bytes_read);
+            if (dev->engine == NULL) {
+                // Let the device start on every read before the first is copied
+                dev->ops->prefetch(dev, request->offset, request->length);
+            }
+        }
+    }
+    if (dev->engine != NULL && valid) {
+        return io_engine_submit(dev->engine, requests, count);
+    }
+
+    // Inline, skipping the requests that failed the checks
+    int result = valid ? 0 : -1;
+    for (size_t i = 0; i < count; i++) {
+        IoRequest *request = &requests[i];
+        if ((request->write && !dev->writable) || !in_bounds(dev, request->offset, request->length)) {
+            continue;
+        }
+        request->result = request->write ? dev->ops->write(dev, request->offset, request->buffer, request->length)
+                                         : dev->ops->read(dev, request->offset, request->buffer, request->length);
+        if (request->result != 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+int dev_sync(BlockDevice *dev) {
+    if (!dev->writable) {
+        return 0;
+    }
+    return dev->ops->sync(dev);
+}
+
+// Advisory hint that the range will be read soon
+void dev_prefetch(BlockDevice *dev, uint64_t offset, size_t length) {
+    if (!in_bounds(dev, offset, length)) {
+        return;
+    }
+    dev->ops->prefetch(dev, offset, length);
+}
+
+// Zero-copy access: a pointer into the mapping, or NULL when the backend
+// has no mapping and the caller has to dev_read into its own buffer
+const void *dev_view(BlockDevice *dev, uint64_t offset, size_t length) {
+    if (dev->map == NULL || !in_bounds(dev, offset, length)) {
+        return NULL;
+    }
+    STAT_DEV_IO(dev, offset, length, bytes_read);
+    return dev->map + offset;
+}
@@ -0,0 +1,353 @@
+#include "check.h"
+#include "bcache.h"
+#include "dir_iter.h"
+#include "fat_table.h"
+#include "journal.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FAT_BAD_CLUSTER 0x0FFFFFF7
+#define MAX_CHECK_THREADS 64
+
+// One directory waiting to be scanned
+typedef struct {
+    uint32_t cluster;
+    char *path;
+} CheckTask;
+
+// Per-worker deque. The owner pushes and pops at the top; idle workers
+// steal from the bottom, which holds the oldest (usually largest) subtrees.
+typedef struct {
+    CheckTask *tasks;
+    size_t bottom;
+    size_t top;
+    size_t capacity;
+    pthread_mutex_t lock;
+} TaskDeque;
+
+typedef struct {
+    BlockDevice *dev;
+    FAT32BootSector *bs;
+    int num_threads;
+    TaskDeque *deques;
+    atomic_uint pending;          // tasks queued or being scanned
+    _Atomic uint32_t *owner;      // first cluster of the chain owning each cluster
+    CheckReport *report;
+    FILE *out;                    // the session that asked for the check
+    pthread_mutex_t report_lock;
+    uint32_t reported;
+} CheckContext;
+
+typedef struct {
+    CheckContext *ctx;
+    int id;
+} CheckWorker;
+
+static void report_problem(CheckContext *ctx, const char *format, const char *path, uint32_t a, uint32_t b) {
+    pthread_mutex_lock(&ctx->report_lock);
+    if (ctx->reported++ < CHECK_MAX_REPORTED) {
+        fprintf(ctx->out, "  %s: ", path[0] ? path : "/");
+        fprintf(ctx->out, format, a, b);
+        fprintf(ctx->out, "\n");
+    }
+    pthread_mutex_unlock(&ctx->report_lock);
+}
+
+// Report counters are shared by all workers
+static void count_event(uint32_t *counter) {
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void deque_push(TaskDeque *deque, CheckTask task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->top == deque->capacity) {
+        // Compact before growing
+        size_t count = deque->top - deque->bottom;
+        memmove(deque->tasks, deque->tasks + deque->bottom, count * sizeof(CheckTask));
+        deque->bottom = 0;
+        deque->top = count;
+        if (deque->top == deque->capacity) {
+            deque->capacity = deque->capacity ? deque->capacity * 2 : 64;
+            deque->tasks = realloc(deque->tasks, deque->capacity * sizeof(CheckTask));
+        }
+    }
+    deque->tasks[deque->top++] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static int deque_pop(TaskDeque *deque, CheckTask *task) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->top > deque->bottom) {
+        *task = deque->tasks[--deque->top];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int deque_steal(TaskDeque *deque, CheckTask *task) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->top > deque->bottom) {
+        *task = deque->tasks[deque->bottom++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Claims every cluster of the chain starting at FIRST for that chain and
+// returns its length. Clusters already owned by another chain are
+// cross-linked; a chain that reaches itself again has a loop. The length
+// is 0 when FIRST itself is invalid or already claimed.
+static uint32_t walk_chain(CheckContext *ctx, const char *path, uint32_t first) {
+    uint32_t cluster = first;
+    uint32_t length = 0;
+
+    while (1) {
+        if (cluster < 2 || cluster >= fat_table.num_entries) {
+            count_event(&ctx->report->broken_chains);
+            report_problem(ctx, "chain points to invalid cluster %u after %u clusters", path, cluster, length);
+            return length;
+        }
+
+        uint32_t expected = 0;
+        if (!atomic_compare_exchange_strong(&ctx->owner[cluster], &expected, first)) {
+            if (expected == first) {
+                report_problem(ctx, "chain loops back to cluster %u after %u clusters", path, cluster, length);
+                count_event(&ctx->report->broken_chains);
+            } else {
+                report_problem(ctx, "cluster %u is cross-linked with the chain starting at %u", path, cluster, expected);
+                count_event(&ctx->report->cross_linked);
+            }
+            return length;
+        }
+        length++;
+
+        uint32_t next = fat_table_get(cluster);
+        if (next >= FAT_EOC) {
+            return length;
+        }
+        if (next == 0 || next == FAT_BAD_CLUSTER) {
+            count_event(&ctx->report->broken_chains);
+            report_problem(ctx, "chain runs into a free or bad entry at cluster %u after %u clusters", path, cluster, length);
+            return length;
+        }
+        cluster = next;
+    }
+}
+
+static char *join_path(const char *parent, const char *name) {
+    size_t length = strlen(parent) + strlen(name) + 2;
+    char *path = malloc(length);
+    snprintf(path, length, "%s/%s", parent, name);
+    return path;
+}
+
+static void scan_directory(CheckContext *ctx, int id, CheckTask *task) {
+    uint32_t csize = cluster_size(ctx->bs);
+    DirIter it;
+    const DirectoryEntry *entry;
+    char name[NAME_BUFFER_SIZE];
+
+    // A directory whose first cluster is already claimed was reached
+    // before, possibly as its own ancestor; descending again could cycle
+    // forever
+    if (walk_chain(ctx, task->path, task->cluster) == 0) {
+        report_problem(ctx, "directory at cluster %u was already reached; its contents are skipped", task->path, task->cluster, 0);
+        return;
+    }
+
+    dir_iter_open_direct(&it, ctx->dev, ctx->bs, task->cluster);
+    while ((entry = dir_iter_next(&it)) != NULL) {
+        if (entry->attr & 0x08) {
+            // Volume label
+            continue;
+        }
+        entry_name(entry, name);
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+
+        uint32_t first = entry_cluster(entry);
+        char *path = join_path(task->path, it.lfn_count > 0 ? it.long_name : name);
+
+        if (entry->attr & ATTR_DIRECTORY) {
+            count_event(&ctx->report->directories);
+            if (first == 0) {
+                report_problem(ctx, "directory has no clusters", path, 0, 0);
+                free(path);
+                continue;
+            }
+            atomic_fetch_add(&ctx->pending, 1);
+            CheckTask child = { first, path };
+            deque_push(&ctx->deques[id], child);
+            continue;
+        }
+
+        count_event(&ctx->report->files);
+        uint32_t expected = (uint32_t)(((uint64_t)entry->filesize + csize - 1) / csize);
+        uint32_t length = first ? walk_chain(ctx, path, first) : 0;
+        if (length != expected) {
+            count_event(&ctx->report->size_mismatches);
+            report_problem(ctx, "chain has %u clusters but the file size needs %u", path, length, expected);
+        }
+        free(path);
+    }
+    dir_iter_close(&it);
+}
+
+static void *check_worker(void *arg) {
+    CheckWorker *worker = arg;
+    CheckContext *ctx = worker->ctx;
+    CheckTask task;
+
+    while (atomic_load(&ctx->pending) > 0) {
+        int found = deque_pop(&ctx->deques[worker->id], &task);
+        for (int i = 1; !found && i < ctx->num_threads; i++) {
+            found = deque_steal(&ctx->deques[(worker->id + i) % ctx->num_threads], &task);
+        }
+        if (!found) {
+            sched_yield();
+            continue;
+        }
+
+        scan_directory(ctx, worker->id, &task);
+        free(task.path);
+        atomic_fetch_sub(&ctx->pending, 1);
+    }
+    return NULL;
+}
+
+// Compares every FAT copy with the first one, sector range by range
+static uint32_t compare_fat_copies(BlockDevice *dev, FAT32BootSector *bs) {
+    uint32_t sector_size = bs->bytes_per_sector;
+    uint32_t chunk_sectors = (1024 * 1024) / sector_size;
+    uint8_t *first = malloc((size_t)chunk_sectors * sector_size);
+    uint8_t *other = malloc((size_t)chunk_sectors * sector_size);
+    uint32_t mismatches = 0;
+
+    for (uint32_t copy = 1; copy < bs->num_fats; copy++) {
+        for (uint32_t sector = 0; sector < bs->fat_size_32; sector += chunk_sectors) {
+            uint32_t count = bs->fat_size_32 - sector < chunk_sectors ? bs->fat_size_32 - sector : chunk_sectors;
+            uint64_t base = (uint64_t)(bs->reserved_sector_count + sector) * sector_size;
+            uint64_t copy_offset = (uint64_t)copy * bs->fat_size_32 * sector_size;
+            // Both ranges are read as one batch
+            IoRequest reads[2] = {
+                { 0, base, first, (size_t)count * sector_size, 0 },
+                { 0, base + copy_offset, other, (size_t)count * sector_size, 0 },
+            };
+            if (dev_submit(dev, reads, 2) != 0) {
+                mismatches += count;
+                continue;
+            }
+            for (uint32_t i = 0; i < count; i++) {
+                if (memcmp(first + (size_t)i * sector_size, other + (size_t)i * sector_size, sector_size) != 0) {
+                    mismatches++;
+                }
+            }
+        }
+    }
+
+    free(first);
+    free(other);
+    return mismatches;
+}
+
+// Walks the whole tree with NUM_THREADS workers and cross-checks it
+// against the FAT. Returns the number of problems found.
+int check_image(BlockDevice *dev, FAT32BootSector *bs, int num_threads, CheckReport *report) {
+    CheckContext ctx;
+    pthread_t threads[MAX_CHECK_THREADS];
+    CheckWorker workers[MAX_CHECK_THREADS];
+
+    memset(report, 0, sizeof(*report));
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.dev = dev;
+    ctx.bs = bs;
+    ctx.num_threads = num_threads;
+    ctx.report = report;
+    ctx.out = shell_out;
+    ctx.owner = calloc(fat_table.num_entries, sizeof(*ctx.owner));
+    ctx.deques = calloc(num_threads, sizeof(TaskDeque));
+    pthread_mutex_init(&ctx.report_lock, NULL);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&ctx.deques[i].lock, NULL);
+    }
+
+    CheckTask root = { bs->root_cluster, strdup("") };
+    atomic_store(&ctx.pending, 1);
+    deque_push(&ctx.deques[0], root);
+
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].ctx = &ctx;
+        workers[i].id = i;
+        pthread_create(&threads[i], NULL, check_worker, &workers[i]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Anything allocated in the FAT that no chain claimed is lost
+    for (uint32_t cluster = 2; cluster < fat_table.num_entries; cluster++) {
+        uint32_t value = fat_table_get(cluster);
+        if (ctx.owner[cluster] != 0) {
+            report->used_clusters++;
+        } else if (value == 0) {
+            report->free_clusters++;
+        } else if (value != FAT_BAD_CLUSTER) {
+            report->lost_clusters++;
+        }
+    }
+    report->fat_mismatches = compare_fat_copies(dev, bs);
+
+    for (int i = 0; i < num_threads; i++) {
+        free(ctx.deques[i].tasks);
+        pthread_mutex_destroy(&ctx.deques[i].lock);
+    }
+    free(ctx.deques);
+    free(ctx.owner);
+    pthread_mutex_destroy(&ctx.report_lock);
+
+    return report->size_mismatches + report->broken_chains + report->cross_linked +
+           report->lost_clusters + report->fat_mismatches;
+}
+
+void handle_check_command(BlockDevice *dev, FAT32BootSector *bs, const char *threads) {
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads != NULL) {
+        num_threads = strtol(threads, NULL, 10);
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if (num_threads > MAX_CHECK_THREADS) {
+        num_threads = MAX_CHECK_THREADS;
+    }
+
+    // Workers read the image directly and the on-disk FAT copies are
+    // compared, so write back everything pending first
+    journal_flush(dev, bs);
+
+    CheckReport report;
+    fprintf(shell_out, "Checking image with %ld threads...\n", num_threads);
+    int problems = check_image(dev, bs, (int)num_threads, &report);
+
+    fprintf(shell_out, "Directories: %u, files: %u, clusters in use: %u, free: %u\n",
+           report.directories, report.files, report.used_clusters, report.free_clusters);
+    fprintf(shell_out, "Size mismatches: %u\n", report.size_mismatches);
+    fprintf(shell_out, "Broken chains: %u\n", report.broken_chains);
+    fprintf(shell_out, "Cross-linked clusters: %u\n", report.cross_linked);
+    fprintf(shell_out, "Lost clusters: %u\n", report.lost_clusters);
+    fprintf(shell_out, "FAT copy mismatches (sectors): %u\n", report.fat_mismatches);
+    if (problems == 0) {
+        fprintf(shell_out, "Image is consistent.\n");
+    } else {
+        fprintf(shell_out, "Found %d problems.\n", problems);
+    }
+}
@@ -0,0 +1,428 @@
+#include "commands.h"
+#include "bcache.h"
+#include "check.h"
+#include "defrag.h"
+#include "dir_index.h"
+#include "fat_table.h"
+#include "file_io.h"
+#include "handle.h"
+#include "ioengine.h"
+#include "journal.h"
+#include "locks.h"
+#include "overlay.h"
+#include "stats.h"
+#include "transfer.h"
+#include "tree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Writes back cached directory clusters, then the FAT sectors, as one
+// journal transaction
+static int flush_metadata(BlockDevice *dev, FAT32BootSector *bs) {
+    journal_begin();
+    int result = bcache_flush(dev, bs);
+    if (fat_table_flush(dev, bs, NULL) != 0) {
+        result = -1;
+    }
+    if (journal_end(dev) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+// Implement command functions
+void handle_info_command(FAT32BootSector *bs) {
+    print_boot_sector_info(bs);
+    fprintf(shell_out, "Free clusters: %u\n", fat_table.free_count);
+}
+
+// Free space comes from the counts the allocator keeps current, so this
+// never touches the FAT
+void handle_df_command(const char *image_path, FAT32BootSector *bs) {
+    fat_table_lock();
+    uint32_t total = fat_table.num_entries - 2;
+    uint32_t free_clusters = fat_table.free_count;
+    uint32_t next_free = fat_table.next_free;
+    fat_table_unlock();
+
+    uint64_t csize = cluster_size(bs);
+    uint32_t used = total - free_clusters;
+    fprintf(shell_out, "Image: %s\n", image_path);
+    fprintf(shell_out, "Size: %llu bytes in %u clusters of %llu bytes\n", (unsigned long long)(total * csize), total,
+            (unsigned long long)csize);
+    fprintf(shell_out, "Used: %llu bytes in %u clusters (%.1f%%)\n", (unsigned long long)(used * csize), used,
+            total ? 100.0 * used / total : 0.0);
+    fprintf(shell_out, "Free: %llu bytes in %u clusters\n", (unsigned long long)(free_clusters * csize), free_clusters);
+    fprintf(shell_out, "Next free cluster: %u\n", next_free);
+}
+
+void handle_sync_command(BlockDevice *dev, FAT32BootSector *bs) {
+    flush_open_files(dev, bs);
+    if (flush_metadata(dev, bs) != 0 || fat_table_write_fs_info(dev, bs) != 0 || journal_checkpoint(dev) != 0) {
+        fprintf(shell_out, "Error: Failed to write back to the image.\n");
+        return;
+    }
+
+    // FAT writes are flushed at every command boundary, so report the
+    // totals since mount rather than just this (usually empty) flush
+    FatFlushStats stats = fat_table.totals;
+    fprintf(shell_out, "Synced %u FAT updates as %u sectors in %u writes across %u FAT copies.\n",
+           stats.updates, stats.sectors, stats.writes, stats.copies);
+    fprintf(shell_out, "Saved %u I/O operations and %u bytes of redundant entry writes.\n",
+           stats.ops_saved, stats.bytes_saved);
+}
+
+void handle_exit_command(BlockDevice *dev, FAT32BootSector *bs) {
+    flush_open_files(dev, bs);
+    handle_table_free();
+    flush_metadata(dev, bs);
+    fat_table_write_fs_info(dev, bs);
+    journal_close(dev);
+    dev_close(dev);
+    bcache_free();
+    fat_table_free();
+    dir_index_clear();
+    dcache_clear();
+    fprintf(shell_out, "Exiting...\n");
+}
+
+void handle_stats_command(BlockDevice *dev) {
+    BlockCacheStats stats = bcache.stats;
+    uint64_t lookups = stats.hits + stats.misses;
+    uint64_t dentry_lookups = dcache.hits + dcache.misses;
+
+    fprintf(shell_out, "Block cache: %u of %u clusters in use (%u bytes each)\n", bcache.used, bcache.capacity, bcache.cluster_size);
+    fprintf(shell_out, "  hits %llu, misses %llu, hit rate %.1f%%\n", (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+           lookups ? 100.0 * stats.hits / lookups : 0.0);
+    fprintf(shell_out, "  evictions %llu, write-backs %llu (%llu bytes), dirty bytes %llu\n", (unsigned long long)stats.evictions,
+           (unsigned long long)stats.writebacks, (unsigned long long)stats.bytes_written, (unsigned long long)bcache.dirty_bytes);
+    fprintf(shell_out, "Dentry cache: %u entries, hits %llu, misses %llu, hit rate %.1f%%\n", dcache.count,
+           (unsigned long long)dcache.hits, (unsigned long long)dcache.misses,
+           dentry_lookups ? 100.0 * dcache.hits / dentry_lookups : 0.0);
+    fprintf(shell_out, "I/O engine: %s, up to %u requests in flight\n", io_engine_name(dev->engine), io_engine_depth(dev->engine));
+    if (journal.fd >= 0) {
+        fprintf(shell_out, "Journal: %llu transactions, %llu records, %llu bytes logged, %llu checkpoints\n",
+               (unsigned long long)journal.stats.transactions, (unsigned long long)journal.stats.records,
+               (unsigned long long)journal.stats.bytes, (unsigned long long)journal.stats.checkpoints);
+    }
+    stats_report(shell_out);
+}
+
+void handle_trace_command(const char *path) {
+    if (strcmp(path, "off") == 0) {
+        stats_trace_close();
+        fprintf(shell_out, "Tracing stopped.\n");
+        return;
+    }
+    if (stats_trace_open(path) != 0) {
+        fprintf(shell_out, "Error: Unable to open trace file '%s'.\n", path);
+        return;
+    }
+    fprintf(shell_out, "Tracing commands to '%s'.\n", path);
+}
+
+static void cmd_info(Shell *sh, tokenlist *tokens) {
+    (void)tokens;
+    handle_info_command(&sh->bs);
+}
+
+static void cmd_ls(Shell *sh, tokenlist *tokens) {
+    (void)tokens;
+    handle_ls_command(sh->dev, &sh->bs, sh->current_cluster);
+}
+
+static void cmd_cd(Shell *sh, tokenlist *tokens) {
+    handle_cd_command(sh->dev, &sh->bs, &sh->current_cluster, sh->current_path, tokens->items[1]);
+}
+
+static void cmd_mkdir(Shell *sh, tokenlist *tokens) {
+    handle_mkdir_command(sh->dev, &sh->bs, sh->current_cluster, tokens->items[1]);
+}
+
+static void cmd_creat(Shell *sh, tokenlist *tokens) {
+    handle_creat_command(sh->dev, &sh->bs, sh->current_cluster, tokens->items[1]);
+}
+
+static void cmd_open(Shell *sh, tokenlist *tokens) {
+    handle_open_command(sh->dev, &sh->bs, sh->current_cluster, sh->current_path, tokens->items[1], tokens->items[2]);
+}
+
+static void cmd_close(Shell *sh, tokenlist *tokens) {
+    handle_close_command(sh->dev, &sh->bs, sh->current_cluster, tokens->items[1]);
+}
+
+static void cmd_lsof(Shell *sh, tokenlist *tokens) {
+    (void)sh;
+    (void)tokens;
+    handle_lsof_command();
+}
+
+static void cmd_lseek(Shell *sh, tokenlist *tokens) {
+    handle_lseek_command(sh->dev, &sh->bs, sh->current_cluster, tokens->items[1], tokens->items[2]);
+}
+
+static void cmd_read(Shell *sh, tokenlist *tokens) {
+    handle_read_command(sh->dev, &sh->bs, sh->current_cluster, tokens->items[1], tokens->items[2], tokens->size == 4 ? tokens->items[3] : NULL);
+}
+
+static void cmd_write(Shell *sh, tokenlist *tokens) {
+    handle_write_command(sh->dev, &sh->bs, sh->current_cluster, tokens->items[1], tokens->items[2]);
+}
+
+static void cmd_import(Shell *sh, tokenlist *tokens) {
+    struct stat st;
+    if (stat(tokens->items[1], &st) == 0 && S_ISDIR(st.st_mode)) {
+        handle_import_tree_command(sh->dev, &sh->bs, sh->current_cluster, tokens->items[1]);
+        return;
+    }
+    handle_import_command(sh->dev, &sh->bs, sh->current_cluster, tokens->items[1]);
+}
+
+static void cmd_export(Shell *sh, tokenlist *tokens) {
+    // Buffered writes must reach the image before files are copied out
+    flush_open_files(sh->dev, &sh->bs);
+    handle_export_command(sh->dev, &sh->bs, sh->current_cluster, tokens->items[1], tokens->items[2]);
+}
+
+static void cmd_rm(Shell *sh, tokenlist *tokens) {
+    int recursive = tokens->size == 3 && strcmp(tokens->items[1], "-r") == 0;
+    if (tokens->size == 3 && !recursive) {
+        fprintf(shell_out, "Error: Unknown option '%s'.\n", tokens->items[1]);
+        return;
+    }
+    handle_rm_command(sh->dev, &sh->bs, sh->current_cluster, tokens->items[tokens->size - 1], recursive);
+}
+
+static void cmd_rmdir(Shell *sh, tokenlist *tokens) {
+    handle_rmdir_command(sh->dev, &sh->bs, sh->current_cluster, tokens->items[1]);
+}
+
+static void cmd_rename(Shell *sh, tokenlist *tokens) {
+    handle_rename_command(sh->dev, &sh->bs, sh->current_cluster, tokens->items[1], tokens->items[2]);
+}
+
+static void cmd_du(Shell *sh, tokenlist *tokens) {
+    handle_du_command(sh->dev, &sh->bs, sh->current_cluster, sh->current_path, tokens->size == 2 ? tokens->items[1] : ".");
+}
+
+static void cmd_find(Shell *sh, tokenlist *tokens) {
+    handle_find_command(sh->dev, &sh->bs, sh->current_cluster, sh->current_path,
+                        tokens->size >= 2 ? tokens->items[1] : ".", tokens->size == 3 ? tokens->items[2] : NULL);
+}
+
+static void cmd_sync(Shell *sh, tokenlist *tokens) {
+    (void)tokens;
+    handle_sync_command(sh->dev, &sh->bs);
+}
+
+static void cmd_check(Shell *sh, tokenlist *tokens) {
+    // Buffered writes must reach the image before it is scanned
+    flush_open_files(sh->dev, &sh->bs);
+    handle_check_command(sh->dev, &sh->bs, tokens->size == 2 ? tokens->items[1] : NULL);
+}
+
+static void cmd_defrag(Shell *sh, tokenlist *tokens) {
+    (void)tokens;
+    // Buffered writes must reach the image before chains are moved
+    flush_open_files(sh->dev, &sh->bs);
+    handle_defrag_command(sh->dev, &sh->bs);
+}
+
+static void cmd_snapshot(Shell *sh, tokenlist *tokens) {
+    // Buffered writes must reach the delta before it is copied
+    flush_open_files(sh->dev, &sh->bs);
+    handle_snapshot_command(sh->dev, &sh->bs, tokens->items[1]);
+}
+
+static void cmd_diff(Shell *sh, tokenlist *tokens) {
+    (void)tokens;
+    flush_open_files(sh->dev, &sh->bs);
+    handle_diff_command(sh->dev, &sh->bs);
+}
+
+static void cmd_commit(Shell *sh, tokenlist *tokens) {
+    (void)tokens;
+    flush_open_files(sh->dev, &sh->bs);
+    handle_commit_command(sh->dev, &sh->bs);
+}
+
+static void cmd_df(Shell *sh, tokenlist *tokens) {
+    (void)tokens;
+    handle_df_command(sh->image_path, &sh->bs);
+}
+
+static void cmd_stats(Shell *sh, tokenlist *tokens) {
+    (void)tokens;
+    handle_stats_command(sh->dev);
+}
+
+static void cmd_trace(Shell *sh, tokenlist *tokens) {
+    (void)sh;
+    handle_trace_command(tokens->items[1]);
+}
+
+static void cmd_exit(Shell *sh, tokenlist *tokens) {
+    (void)tokens;
+    sh->running = 0;
+    if (sh->session) {
+        // Only the client goes away; the server keeps the image mounted
+        fprintf(shell_out, "Exiting...\n");
+        return;
+    }
+    handle_exit_command(sh->dev, &sh->bs);
+}
+
+static const Command commands[] = {
+    { "info",   1, 1,  0,                              cmd_info },
+    { "df",     1, 1,  0,                              cmd_df },
+    { "ls",     1, 1,  CMD_DIR_READ,                   cmd_ls },
+    { "cd",     2, 2,  0,                              cmd_cd },
+    { "mkdir",  2, 2,  CMD_METADATA | CMD_DIR_WRITE,   cmd_mkdir },
+    { "creat",  2, 2,  CMD_METADATA | CMD_DIR_WRITE,   cmd_creat },
+    { "open",   3, 3,  CMD_DIR_READ,                   cmd_open },
+    { "close",  2, 2,  CMD_METADATA | CMD_DIR_WRITE,   cmd_close },
+    { "lsof",   1, 1,  0,                              cmd_lsof },
+    { "lseek",  3, 3,  CMD_DIR_READ,                   cmd_lseek },
+    { "read",   3, 4,  CMD_METADATA | CMD_DIR_WRITE,   cmd_read },
+    { "write",  3, 3,  CMD_METADATA | CMD_DIR_WRITE,   cmd_write },
+    { "import", 2, 2,  CMD_METADATA | CMD_DIR_WRITE,   cmd_import },
+    { "export", 3, 3,  CMD_EXCLUSIVE,                  cmd_export },
+    { "rm",     2, 3,  CMD_METADATA | CMD_EXCLUSIVE,   cmd_rm },
+    { "rmdir",  2, 2,  CMD_METADATA | CMD_EXCLUSIVE,   cmd_rmdir },
+    { "rename", 3, 3,  CMD_METADATA | CMD_EXCLUSIVE,   cmd_rename },
+    { "du",     1, 2,  CMD_EXCLUSIVE,                  cmd_du },
+    { "find",   1, 3,  CMD_EXCLUSIVE,                  cmd_find },
+    { "sync",   1, 1,  CMD_EXCLUSIVE,                  cmd_sync },
+    { "check",  1, 2,  CMD_EXCLUSIVE,                  cmd_check },
+    { "defrag", 1, 1,  CMD_EXCLUSIVE,                  cmd_defrag },
+    { "snapshot", 2, 2, CMD_EXCLUSIVE,                 cmd_snapshot },
+    { "diff",   1, 1,  CMD_EXCLUSIVE,                  cmd_diff },
+    { "commit", 1, 1,  CMD_EXCLUSIVE,                  cmd_commit },
+    { "stats",  1, 1,  0,                              cmd_stats },
+    { "trace",  2, 2,  0,                              cmd_trace },
+    { "exit",   1, 1,  CMD_EXCLUSIVE,                  cmd_exit },
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+#define COMMAND_SLOTS 64  // power of two, well above NUM_COMMANDS
+
+// Hash table over the command names, filled once at startup so dispatch
+// is one hash and one string compare instead of a strcmp chain
+static const Command *command_slots[COMMAND_SLOTS];
+
+static uint32_t hash_command(const char *name) {
+    uint32_t hash = 5381;
+    while (*name != '\0') {
+        hash = hash * 33 + (unsigned char)*name++;
+    }
+    return hash;
+}
+
+void commands_init(void) {
+    memset(command_slots, 0, sizeof(command_slots));
+    for (size_t i = 0; i < NUM_COMMANDS; i++) {
+        uint32_t slot = hash_command(commands[i].name) & (COMMAND_SLOTS - 1);
+        while (command_slots[slot] != NULL) {
+            slot = (slot + 1) & (COMMAND_SLOTS - 1);
+        }
+        command_slots[slot] = &commands[i];
+    }
+    stats_init(NUM_COMMANDS);
+}
+
+const Command *find_command(const char *name) {
+    uint32_t slot = hash_command(name) & (COMMAND_SLOTS - 1);
+    while (command_slots[slot] != NULL) {
+        if (strcmp(command_slots[slot]->name, name) == 0) {
+            return command_slots[slot];
+        }
+        slot = (slot + 1) & (COMMAND_SLOTS - 1);
+    }
+    return NULL;
+}
+
+// Flushes the FAT updates deferred by a run of batched metadata commands
+void end_batch(Shell *sh) {
+    if (sh->pending_metadata > 0) {
+        flush_metadata(sh->dev, &sh->bs);
+        sh->pending_metadata = 0;
+        journal_end(sh->dev);
+    }
+}
+
+void run_command(Shell *sh, tokenlist *tokens) {
+    if (tokens->size == 0) {
+        return;
+    }
+
+    const Command *command = find_command(tokens->items[0]);
+    if (command == NULL) {
+        fprintf(shell_out, "Unknown command\n");
+        return;
+    }
+    if ((int)tokens->size < command->min_tokens || (command->max_tokens != -1 && (int)tokens->size > command->max_tokens)) {
+        fprintf(shell_out, "Error: Incorrect number of arguments for '%s' command.\n", command->name);
+        return;
+    }
+
+    // In batch mode consecutive metadata commands share a single FAT flush
+    // at the end of the run; interactively every command is flushed at once
+    if (sh->batch && !(command->flags & CMD_METADATA)) {
+        end_batch(sh);
+    }
+
+    // Other sessions may be running commands at the same time. The lock
+    // on the current directory is taken before the command runs, so a cd
+    // in it cannot move the lock out from under the command.
+    uint32_t dir = sh->current_cluster;
+    int dir_flags = command->flags & (CMD_DIR_READ | CMD_DIR_WRITE);
+    image_lock((command->flags & CMD_EXCLUSIVE) != 0);
+    if (dir_flags) {
+        dir_lock(dir, (command->flags & CMD_DIR_WRITE) != 0);
+    }
+
+    // The command is one journal transaction: nothing it stages, not
+    // even a directory cluster evicted half way, reaches the image before
+    // the whole command has
+    journal_begin();
+    uint64_t start = stats_begin();
+    command->run(sh, tokens);
+    stats_end((size_t)(command - commands), command->name, start);
+    if (command->flags & CMD_METADATA) {
+        journal_note(command->name);
+    }
+
+    if (dir_flags) {
+        dir_unlock(dir);
+    }
+    if (sh->running) {
+        if (sh->batch && (command->flags & CMD_METADATA)) {
+            // The run of commands shares one transaction as well, ended by
+            // end_batch, since their FAT updates wait for it
+            if (sh->pending_metadata++ == 0) {
+                journal_begin();
+            }
+            if (sh->pending_metadata >= BATCH_FLUSH_INTERVAL) {
+                end_batch(sh);
+            }
+        } else {
+            // Command boundary: write back any directory clusters and FAT
+            // sectors the command dirtied
+            flush_metadata(sh->dev, &sh->bs);
+        }
+    }
+    journal_end(sh->dev);
+    image_unlock();
+}
+
+// Ends a server session: its buffered writes reach the image and its
+// descriptors are closed. The image stays mounted.
+void end_session(Shell *sh) {
+    image_lock(1);
+    flush_open_files(sh->dev, &sh->bs);
+    handle_table_free();
+    flush_metadata(sh->dev, &sh->bs);
+    image_unlock();
+}
@@ -0,0 +1,394 @@
+#include "defrag.h"
+#include "bcache.h"
+#include "dir_index.h"
+#include "fat_table.h"
+#include "handle.h"
+#include "journal.h"
+#include "path.h"
+#include "walk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A file with data, as found by the survey
+typedef struct {
+    uint32_t dir_cluster;
+    uint32_t position;     // of its entry, to recognise open files
+    uint8_t short_name[11];
+    uint32_t first;
+    uint32_t clusters;
+    uint32_t breaks;
+} DefragFile;
+
+typedef struct {
+    uint32_t *dirs;
+    size_t num_dirs;
+    size_t dir_capacity;
+    DefragFile *files;
+    size_t num_files;
+    size_t file_capacity;
+} DefragSurvey;
+
+static int is_chain_cluster(uint32_t cluster) {
+    return cluster >= 2 && cluster < FAT_EOC && cluster < fat_table.num_entries;
+}
+
+// Returns the length of the chain at FIRST and counts its links that
+// do not lead to the physically next cluster
+static uint32_t chain_shape(uint32_t first, uint32_t *breaks) {
+    uint32_t length = 0;
+    uint32_t cluster = first;
+
+    *breaks = 0;
+    while (is_chain_cluster(cluster) && length < fat_table.num_entries) {
+        length++;
+        uint32_t next = fat_table_get(cluster);
+        if (is_chain_cluster(next) && next != cluster + 1) {
+            (*breaks)++;
+        }
+        cluster = next;
+    }
+    return length;
+}
+
+static int survey_visit(const WalkDir *dir, const DirectoryEntry *entry, const DirSlot *slot, const char *name, void *arg) {
+    DefragSurvey *survey = arg;
+    (void)name;
+
+    if (entry == NULL) {
+        if (survey->num_dirs == survey->dir_capacity) {
+            survey->dir_capacity = survey->dir_capacity ? survey->dir_capacity * 2 : 64;
+            survey->dirs = realloc(survey->dirs, survey->dir_capacity * sizeof(uint32_t));
+        }
+        survey->dirs[survey->num_dirs++] = dir->cluster;
+        return WALK_CONTINUE;
+    }
+    // Subdirectories are recorded when the walk enters them
+    if ((entry->attr & ATTR_DIRECTORY) || entry_cluster(entry) == 0) {
+        return WALK_CONTINUE;
+    }
+
+    if (survey->num_files == survey->file_capacity) {
+        survey->file_capacity = survey->file_capacity ? survey->file_capacity * 2 : 256;
+        survey->files = realloc(survey->files, survey->file_capacity * sizeof(DefragFile));
+    }
+    DefragFile *file = &survey->files[survey->num_files++];
+    file->dir_cluster = dir->cluster;
+    file->position = slot->position;
+    memcpy(file->short_name, entry->name, 11);
+    file->first = entry_cluster(entry);
+    file->clusters = 0;
+    file->breaks = 0;
+    return WALK_CONTINUE;
+}
+
+static void survey_tree(BlockDevice *dev, FAT32BootSector *bs, DefragSurvey *survey) {
+    WalkStats stats;
+    survey->num_dirs = 0;
+    survey->num_files = 0;
+    tree_walk(dev, bs, bs->root_cluster, "", survey_visit, survey, &stats);
+}
+
+static void add_chain(FragmentationReport *report, uint32_t length, uint32_t breaks) {
+    if (length == 0) {
+        return;
+    }
+    report->extents += breaks + 1;
+    report->links += length - 1;
+    report->breaks += breaks;
+    if (breaks > 0) {
+        report->fragmented++;
+    }
+}
+
+// Measures every surveyed chain, recording each file's shape as well
+static void measure(DefragSurvey *survey, FragmentationReport *report) {
+    memset(report, 0, sizeof(*report));
+    for (size_t i = 0; i < survey->num_dirs; i++) {
+        uint32_t breaks;
+        uint32_t length = chain_shape(survey->dirs[i], &breaks);
+        add_chain(report, length, breaks);
+        report->directories++;
+    }
+    for (size_t i = 0; i < survey->num_files; i++) {
+        DefragFile *file = &survey->files[i];
+        file->clusters = chain_shape(file->first, &file->breaks);
+        add_chain(report, file->clusters, file->breaks);
+        report->files++;
+    }
+}
+
+static void print_report(const char *label, const FragmentationReport *report) {
+    fprintf(shell_out, "%s: %.1f%% fragmented (%llu of %llu cluster links discontiguous; %u files and %u directories in %u extents, %u fragmented)\n",
+           label, report->links ? 100.0 * report->breaks / report->links : 0.0,
+           (unsigned long long)report->breaks, (unsigned long long)report->links,
+           report->files, report->directories, report->extents, report->fragmented);
+}
+
+static int compare_entry_positions(const void *a, const void *b) {
+    const DirIndexEntry *x = *(const DirIndexEntry *const *)a;
+    const DirIndexEntry *y = *(const DirIndexEntry *const *)b;
+    return (x->slot.position > y->slot.position) - (x->slot.position < y->slot.position);
+}
+
+// Rewrites a directory with its live entries, and their long name
+// fragments, packed from the first slot in their current order, then
+// releases the clusters left empty at the end of its chain. Entries only
+// ever move towards the front and the new contents reach the image
+// before any cluster is freed, so an interrupted compaction can leave an
+// entry listed twice but never loses one. Returns the slots reclaimed.
+static uint32_t compact_directory(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, uint32_t *freed_clusters) {
+    DirIndex *index = dir_index_get(dev, bs, cluster);
+    uint32_t csize = cluster_size(bs);
+    uint32_t per_cluster = csize / sizeof(DirectoryEntry);
+
+    uint32_t length = 0;
+    uint32_t capacity = 8;
+    uint32_t *chain = malloc(capacity * sizeof(uint32_t));
+    for (uint32_t c = cluster; is_chain_cluster(c) && length < fat_table.num_entries; c = fat_table_get(c)) {
+        if (length == capacity) {
+            capacity *= 2;
+            chain = realloc(chain, capacity * sizeof(uint32_t));
+        }
+        chain[length++] = c;
+    }
+
+    const DirIndexEntry **live = malloc((index->num_entries + 1) * sizeof(DirIndexEntry *));
+    uint32_t num_live = 0;
+    uint32_t live_slots = 0;
+    for (uint32_t i = 0; i < index->num_entries; i++) {
+        if (index->entries[i].state == DIR_INDEX_USED) {
+            live[num_live++] = &index->entries[i];
+            live_slots += 1 + index->entries[i].lfn_count;
+        }
+    }
+    uint32_t old_slots = index->has_end ? index->end.position : index->next_position;
+    uint32_t needed = (live_slots + per_cluster - 1) / per_cluster;
+    if (needed == 0) {
+        needed = 1;
+    }
+    if (length == 0 || (live_slots == old_slots && needed >= length)) {
+        free(live);
+        free(chain);
+        return 0;
+    }
+
+    uint8_t *old_data = malloc((size_t)length * csize);
+    uint8_t *new_data = calloc(length, csize);
+    for (uint32_t k = 0; k < length; k++) {
+        read_cluster(dev, bs, chain[k], old_data + (size_t)k * csize);
+    }
+
+    qsort(live, num_live, sizeof(DirIndexEntry *), compare_entry_positions);
+    DirectoryEntry *from = (DirectoryEntry *)old_data;
+    DirectoryEntry *to = (DirectoryEntry *)new_data;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < num_live; i++) {
+        if (live[i]->lfn_count > 0) {
+            memcpy(&to[n], &from[live[i]->lfn_slot.position], live[i]->lfn_count * sizeof(DirectoryEntry));
+            n += live[i]->lfn_count;
+        }
+        to[n++] = from[live[i]->slot.position];
+    }
+
+    for (uint32_t k = 0; k < needed; k++) {
+        write_cluster(dev, bs, chain[k], new_data + (size_t)k * csize);
+    }
+    journal_flush(dev, bs);
+    dev_sync(dev);
+
+    *freed_clusters = 0;
+    if (needed < length) {
+        fat_table_set(chain[needed - 1], 0x0FFFFFFF);
+        *freed_clusters = fat_table_free_chain(chain[needed]);
+    }
+    dir_index_invalidate(cluster);
+
+    free(new_data);
+    free(old_data);
+    free(live);
+    free(chain);
+    return old_slots - live_slots;
+}
+
+// Copies the COUNT clusters of the chain at FROM to the contiguous run
+// at TO, DEFRAG_COPY_BYTES at a time: one read per contiguous piece of
+// the old chain, submitted together, then one write
+static int copy_chain(BlockDevice *dev, FAT32BootSector *bs, uint32_t from, uint32_t to, uint32_t count, uint8_t *buffer) {
+    uint32_t csize = cluster_size(bs);
+    uint32_t per_batch = DEFRAG_COPY_BYTES / csize ? DEFRAG_COPY_BYTES / csize : 1;
+    IoRequest *requests = malloc(per_batch * sizeof(IoRequest));
+    uint32_t cluster = from;
+    uint32_t done = 0;
+    int result = 0;
+
+    while (done < count && result == 0) {
+        uint32_t n = count - done < per_batch ? count - done : per_batch;
+        uint32_t runs = 0;
+        for (uint32_t i = 0; i < n;) {
+            uint32_t run_start = cluster;
+            uint32_t run = 1;
+            cluster = fat_table_get(cluster);
+            while (i + run < n && cluster == run_start + run) {
+                run++;
+                cluster = fat_table_get(cluster);
+            }
+            requests[runs++] = (IoRequest){ 0, cluster_to_offset(bs, run_start), buffer + (size_t)i * csize, (size_t)run * csize, 0 };
+            i += run;
+        }
+        IoRequest write = { 1, cluster_to_offset(bs, to + done), buffer, (size_t)n * csize, 0 };
+        if (dev_submit(dev, requests, runs) != 0 || dev_submit(dev, &write, 1) != 0) {
+            result = -1;
+        }
+        done += n;
+    }
+    free(requests);
+    return result;
+}
+
+// Moves fragmented files into contiguous runs, in rounds: each round
+// copies as many files as the current free space allows, and the chains
+// it frees make room for the next. Within a round the image is updated
+// in an order that is safe to interrupt at any point:
+//   1. the data is copied into clusters that are still free on disk
+//   2. the new chains are written to the FAT
+//   3. the directory entries are switched to the new chains
+//   4. the old chains are freed
+// with each step committed from the journal and the image synced before
+// the next one starts. A crash before step 3 leaves the new chains as
+// lost clusters; after it, the old ones.
+static uint32_t relocate_files(BlockDevice *dev, FAT32BootSector *bs, DefragSurvey *survey, uint32_t *moved_clusters, uint32_t *left) {
+    uint32_t csize = cluster_size(bs);
+    uint8_t *buffer = malloc(DEFRAG_COPY_BYTES > csize ? DEFRAG_COPY_BYTES : csize);
+    size_t *moves = malloc((survey->num_files + 1) * sizeof(size_t));
+    uint32_t *old_first = malloc((survey->num_files + 1) * sizeof(uint32_t));
+    uint32_t moved = 0;
+
+    *moved_clusters = 0;
+    while (1) {
+        size_t num_moves = 0;
+        for (size_t i = 0; i < survey->num_files; i++) {
+            DefragFile *file = &survey->files[i];
+            if (file->breaks == 0 || handle_in_use(file->dir_cluster, file->position)) {
+                continue;
+            }
+            uint32_t length;
+            uint32_t start = fat_table_find_run(file->clusters, 0, &length);
+            if (start == 0 || length < file->clusters) {
+                continue;
+            }
+
+            // Claimed in memory only, so no later file in this round gets
+            // the same run; the FAT reaches the image after the copy
+            for (uint32_t k = 0; k < file->clusters; k++) {
+                fat_table_set(start + k, k + 1 < file->clusters ? start + k + 1 : 0x0FFFFFFF);
+            }
+            if (copy_chain(dev, bs, file->first, start, file->clusters, buffer) != 0) {
+                for (uint32_t k = 0; k < file->clusters; k++) {
+                    fat_table_set(start + k, 0);
+                }
+                continue;
+            }
+            old_first[num_moves] = file->first;
+            file->first = start;
+            file->breaks = 0;
+            moves[num_moves++] = i;
+        }
+        if (num_moves == 0) {
+            break;
+        }
+
+        dev_sync(dev);
+        journal_flush(dev, bs);
+        dev_sync(dev);
+
+        for (size_t m = 0; m < num_moves; m++) {
+            DefragFile *file = &survey->files[moves[m]];
+            const DirIndexEntry *found = dir_index_lookup(dir_index_get(dev, bs, file->dir_cluster), file->short_name);
+            if (found == NULL) {
+                continue;
+            }
+            DirectoryEntry entry = found->entry;
+            entry.firstclusthi = (file->first >> 16) & 0xFFFF;
+            entry.firstclustlo = file->first & 0xFFFF;
+            dir_update_entry(dev, bs, file->dir_cluster, &entry);
+            dcache_invalidate(file->dir_cluster, file->short_name);
+        }
+        journal_flush(dev, bs);
+        dev_sync(dev);
+
+        for (size_t m = 0; m < num_moves; m++) {
+            fat_table_free_chain(old_first[m]);
+            *moved_clusters += survey->files[moves[m]].clusters;
+        }
+        journal_flush(dev, bs);
+        dev_sync(dev);
+        moved += (uint32_t)num_moves;
+    }
+
+    *left = 0;
+    for (size_t i = 0; i < survey->num_files; i++) {
+        if (survey->files[i].breaks > 0) {
+            (*left)++;
+        }
+    }
+    free(old_first);
+    free(moves);
+    free(buffer);
+    return moved;
+}
+
+// Compacts every directory and moves fragmented files into contiguous
+// runs, reporting the fragmentation score before and after. Directories
+// holding open files are not compacted (their entry positions identify
+// the open handles) and open files are not moved. Directory chains keep
+// their clusters; compaction only trims them.
+void handle_defrag_command(BlockDevice *dev, FAT32BootSector *bs) {
+    DefragSurvey survey;
+    FragmentationReport before;
+    FragmentationReport after;
+
+    if (!dev->writable) {
+        fprintf(shell_out, "Error: The image is read-only.\n");
+        return;
+    }
+    journal_flush(dev, bs);
+
+    memset(&survey, 0, sizeof(survey));
+    survey_tree(dev, bs, &survey);
+    measure(&survey, &before);
+    print_report("Before", &before);
+
+    uint32_t compacted = 0;
+    uint32_t slots = 0;
+    uint32_t dir_clusters = 0;
+    for (size_t i = 0; i < survey.num_dirs; i++) {
+        if (handle_dir_in_use(survey.dirs[i])) {
+            continue;
+        }
+        uint32_t freed = 0;
+        uint32_t reclaimed = compact_directory(dev, bs, survey.dirs[i], &freed);
+        if (reclaimed > 0 || freed > 0) {
+            compacted++;
+            slots += reclaimed;
+            dir_clusters += freed;
+        }
+    }
+    journal_flush(dev, bs);
+    dev_sync(dev);
+    fprintf(shell_out, "Compacted %u directories: %u slots and %u clusters reclaimed.\n", compacted, slots, dir_clusters);
+
+    // Entry positions have changed, so the files are surveyed again
+    survey_tree(dev, bs, &survey);
+    measure(&survey, &before);
+    uint32_t moved_clusters;
+    uint32_t left;
+    uint32_t moved = relocate_files(dev, bs, &survey, &moved_clusters, &left);
+    fprintf(shell_out, "Relocated %u files (%u clusters); %u fragmented files left in place.\n", moved, moved_clusters, left);
+
+    measure(&survey, &after);
+    print_report("After", &after);
+
+    free(survey.dirs);
+    free(survey.files);
+}
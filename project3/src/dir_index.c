@@ -0,0 +1,599 @@
+#include "dir_index.h"
+#include "fat_table.h"
+#include "bcache.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define DIR_CACHE_BUCKETS 256
+
+static DirIndex *dir_cache[DIR_CACHE_BUCKETS];
+
+// Guards the cache's hash chains. An index itself is only read or
+// changed by a session holding its directory's lock.
+static pthread_mutex_t dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_name(const uint8_t *name) {
+    // FNV-1a over the raw 11-byte name
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 11; i++) {
+        hash ^= name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t hash_long_name(const char *name) {
+    // FNV-1a over the name with ASCII letters folded, matching strcasecmp
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++) {
+        hash ^= (uint32_t)tolower(*p);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void table_insert(uint32_t *table, uint32_t mask, uint32_t hash, uint32_t number) {
+    uint32_t i = hash & mask;
+    while (table[i] != 0 && table[i] != DIR_INDEX_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    table[i] = number + 1;
+}
+
+// Rebuilds both hash tables, dropping removed entries from the dense
+// array, with room for at least MIN_ENTRIES live entries at half load
+static void index_rebuild(DirIndex *index, uint32_t min_entries) {
+    uint32_t live = 0;
+    for (uint32_t i = 0; i < index->num_entries; i++) {
+        if (index->entries[i].state == DIR_INDEX_USED) {
+            index->entries[live++] = index->entries[i];
+        }
+    }
+    index->num_entries = live;
+
+    uint32_t capacity = 64;
+    while (capacity < min_entries * 2) {
+        capacity *= 2;
+    }
+    free(index->short_table);
+    free(index->long_table);
+    index->capacity = capacity;
+    index->short_table = calloc(capacity, sizeof(uint32_t));
+    index->long_table = calloc(capacity, sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < live; i++) {
+        table_insert(index->short_table, capacity - 1, hash_name(index->entries[i].entry.name), i);
+        if (index->entries[i].long_name != NULL) {
+            table_insert(index->long_table, capacity - 1, hash_long_name(index->entries[i].long_name), i);
+        }
+    }
+}
+
+static DirIndexEntry *index_put(DirIndex *index, const DirectoryEntry *entry, const DirSlot *slot,
+                                const DirSlot *lfn_slot, uint32_t lfn_count, const char *long_name) {
+    // Removed entries keep their tombstones until the next rebuild, so
+    // they count towards the load
+    if ((index->num_entries + 1) * 10 > index->capacity * 7) {
+        index_rebuild(index, index->used + 1);
+    }
+    if (index->num_entries == index->entries_capacity) {
+        index->entries_capacity = index->entries_capacity ? index->entries_capacity * 2 : 64;
+        index->entries = realloc(index->entries, index->entries_capacity * sizeof(DirIndexEntry));
+    }
+
+    uint32_t number = index->num_entries++;
+    DirIndexEntry *put = &index->entries[number];
+    memset(put, 0, sizeof(*put));
+    put->entry = *entry;
+    put->slot = *slot;
+    put->state = DIR_INDEX_USED;
+    if (lfn_count > 0) {
+        put->lfn_slot = *lfn_slot;
+        put->lfn_count = lfn_count;
+        put->long_name = strdup(long_name);
+        table_insert(index->long_table, index->capacity - 1, hash_long_name(long_name), number);
+    }
+    table_insert(index->short_table, index->capacity - 1, hash_name(entry->name), number);
+    index->used++;
+    return put;
+}
+
+// Returns the table cell holding the live entry with SHORT_NAME, or NULL
+static uint32_t *short_cell(DirIndex *index, const uint8_t *short_name) {
+    if (index->capacity == 0) {
+        return NULL;
+    }
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = hash_name(short_name) & mask;
+    while (index->short_table[i] != 0) {
+        uint32_t number = index->short_table[i];
+        if (number != DIR_INDEX_TOMBSTONE && memcmp(index->entries[number - 1].entry.name, short_name, 11) == 0) {
+            return &index->short_table[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+static uint32_t *long_cell(DirIndex *index, const char *name) {
+    if (index->capacity == 0) {
+        return NULL;
+    }
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = hash_long_name(name) & mask;
+    while (index->long_table[i] != 0) {
+        uint32_t number = index->long_table[i];
+        if (number != DIR_INDEX_TOMBSTONE && strcasecmp(index->entries[number - 1].long_name, name) == 0) {
+            return &index->long_table[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+static DirIndexEntry *index_find(DirIndex *index, const uint8_t *short_name) {
+    uint32_t *cell = short_cell(index, short_name);
+    return cell ? &index->entries[*cell - 1] : NULL;
+}
+
+static void index_remove(DirIndex *index, DirIndexEntry *found) {
+    *short_cell(index, found->entry.name) = DIR_INDEX_TOMBSTONE;
+    if (found->long_name != NULL) {
+        *long_cell(index, found->long_name) = DIR_INDEX_TOMBSTONE;
+        free(found->long_name);
+        found->long_name = NULL;
+    }
+    found->state = DIR_INDEX_REMOVED;
+    index->used--;
+}
+
+static void free_slot_push(DirIndex *index, const DirSlot *slot) {
+    if (index->num_free == index->free_capacity) {
+        index->free_capacity = index->free_capacity ? index->free_capacity * 2 : 16;
+        index->free_slots = realloc(index->free_slots, index->free_capacity * sizeof(DirSlot));
+    }
+    if (index->num_free > 0 && index->free_slots[index->num_free - 1].position > slot->position) {
+        index->free_sorted = 0;
+    }
+    index->free_slots[index->num_free++] = *slot;
+}
+
+static int compare_slots(const void *a, const void *b) {
+    const DirSlot *x = a;
+    const DirSlot *y = b;
+    return (x->position > y->position) - (x->position < y->position);
+}
+
+// Takes COUNT free slots with consecutive positions, lowest first, for
+// an entry and its long name fragments. Returns -1 if there is no such run.
+static int free_slots_take(DirIndex *index, uint32_t count, DirSlot *slots) {
+    if (index->num_free < count) {
+        return -1;
+    }
+    if (!index->free_sorted) {
+        qsort(index->free_slots, index->num_free, sizeof(DirSlot), compare_slots);
+        index->free_sorted = 1;
+    }
+
+    uint32_t run = 1;
+    for (uint32_t i = 0; i < index->num_free; i++) {
+        if (i > 0 && index->free_slots[i].position == index->free_slots[i - 1].position + 1) {
+            run++;
+        } else {
+            run = 1;
+        }
+        if (run == count) {
+            uint32_t start = i + 1 - count;
+            memcpy(slots, &index->free_slots[start], count * sizeof(DirSlot));
+            memmove(&index->free_slots[start], &index->free_slots[i + 1], (index->num_free - i - 1) * sizeof(DirSlot));
+            index->num_free -= count;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void free_index(DirIndex *index) {
+    for (uint32_t i = 0; i < index->num_entries; i++) {
+        free(index->entries[i].long_name);
+    }
+    free(index->entries);
+    free(index->short_table);
+    free(index->long_table);
+    free(index->hints);
+    free(index->free_slots);
+    free(index);
+}
+
+static DirIndex *build_index(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster) {
+    DirIndex *index = calloc(1, sizeof(DirIndex));
+    DirIter it;
+    const DirectoryEntry *entry;
+
+    index->dir_cluster = dir_cluster;
+    index->free_sorted = 1;
+    index_rebuild(index, 0);
+
+    dir_iter_open(&it, dev, bs, dir_cluster);
+    while ((entry = dir_iter_next_raw(&it)) != NULL) {
+        if (entry->name[0] == DIR_ENTRY_DELETED) {
+            free_slot_push(index, &it.slot);
+        }
+        if (dir_iter_accept(&it, entry)) {
+            index_put(index, entry, &it.slot, &it.lfn_slot, it.lfn_count, it.long_name);
+        }
+    }
+    dir_iter_close(&it);
+
+    index->end = it.end;
+    index->has_end = it.found_end;
+    index->last_cluster = it.last_cluster;
+    index->next_position = it.position;
+    return index;
+}
+
+static DirIndex *cache_find(uint32_t dir_cluster) {
+    for (DirIndex *index = dir_cache[dir_cluster % DIR_CACHE_BUCKETS]; index != NULL; index = index->next) {
+        if (index->dir_cluster == dir_cluster) {
+            return index;
+        }
+    }
+    return NULL;
+}
+
+// The directory is read with the cache unlocked, so one slow build never
+// stalls lookups of other directories. Two readers of the same directory
+// may both build it; the first to insert wins and the other copy is freed.
+DirIndex *dir_index_get(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster) {
+    pthread_mutex_lock(&dir_cache_lock);
+    DirIndex *index = cache_find(dir_cluster);
+    pthread_mutex_unlock(&dir_cache_lock);
+    if (index != NULL) {
+        return index;
+    }
+
+    DirIndex *built = build_index(dev, bs, dir_cluster);
+    pthread_mutex_lock(&dir_cache_lock);
+    index = cache_find(dir_cluster);
+    if (index == NULL) {
+        uint32_t bucket = dir_cluster % DIR_CACHE_BUCKETS;
+        built->next = dir_cache[bucket];
+        dir_cache[bucket] = built;
+        index = built;
+        built = NULL;
+    }
+    pthread_mutex_unlock(&dir_cache_lock);
+    if (built != NULL) {
+        free_index(built);
+    }
+    return index;
+}
+
+const DirIndexEntry *dir_index_lookup(DirIndex *index, const uint8_t *short_name) {
+    return index_find(index, short_name);
+}
+
+// Looks NAME up the way a user types it: as an 8.3 name (any case) first,
+// then as a long name, compared without regard to ASCII case
+const DirIndexEntry *dir_index_find(DirIndex *index, const char *name) {
+    uint8_t short_name[11];
+    if (name_to_short(name, short_name) == 0) {
+        const DirIndexEntry *found = index_find(index, short_name);
+        if (found != NULL) {
+            return found;
+        }
+    }
+    uint32_t *cell = long_cell(index, name);
+    return cell ? &index->entries[*cell - 1] : NULL;
+}
+
+// The name to show for an entry: its long name if it has one, otherwise
+// the 8.3 name formatted into BUFFER (NAME_BUFFER_SIZE bytes)
+const char *dir_entry_display_name(const DirIndexEntry *found, char *buffer) {
+    if (found->long_name != NULL) {
+        return found->long_name;
+    }
+    entry_name(&found->entry, buffer);
+    return buffer;
+}
+
+static void drop_index(uint32_t dir_cluster) {
+    DirIndex **link = &dir_cache[dir_cluster % DIR_CACHE_BUCKETS];
+    while (*link != NULL) {
+        if ((*link)->dir_cluster == dir_cluster) {
+            DirIndex *index = *link;
+            *link = index->next;
+            free_index(index);
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+void dir_index_invalidate(uint32_t dir_cluster) {
+    pthread_mutex_lock(&dir_cache_lock);
+    drop_index(dir_cluster);
+    pthread_mutex_unlock(&dir_cache_lock);
+}
+
+void dir_index_clear(void) {
+    pthread_mutex_lock(&dir_cache_lock);
+    for (int i = 0; i < DIR_CACHE_BUCKETS; i++) {
+        while (dir_cache[i] != NULL) {
+            drop_index(dir_cache[i]->dir_cluster);
+        }
+    }
+    pthread_mutex_unlock(&dir_cache_lock);
+}
+
+// Looks up NAME in the directory, returning 1 and filling in the entry
+// and its location when found
+int dir_find_entry(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const char *name, DirectoryEntry *entry, DirSlot *slot) {
+    const DirIndexEntry *found = dir_index_find(dir_index_get(dev, bs, dir_cluster), name);
+    if (found == NULL) {
+        return 0;
+    }
+    if (entry != NULL) {
+        *entry = found->entry;
+    }
+    if (slot != NULL) {
+        *slot = found->slot;
+    }
+    return 1;
+}
+
+// Reserves the end-of-directory slot, growing the directory by one
+// zeroed cluster when its chain is full
+static int reserve_end_slot(BlockDevice *dev, FAT32BootSector *bs, DirIndex *index, DirSlot *slot) {
+    if (index->has_end) {
+        *slot = index->end;
+    } else {
+        if (index->last_cluster == 0) {
+            return -1;
+        }
+        fat_table_lock();
+        uint32_t new_cluster = find_free_cluster(dev, bs);
+        if (new_cluster != 0) {
+            write_fat_entry(dev, bs, new_cluster, 0xFFFFFFFF);
+            write_fat_entry(dev, bs, index->last_cluster, new_cluster);
+        }
+        fat_table_unlock();
+        if (new_cluster == 0) {
+            return -1;
+        }
+
+        uint8_t *zero = calloc(1, cluster_size(bs));
+        write_cluster(dev, bs, new_cluster, zero);
+        free(zero);
+
+        index->last_cluster = new_cluster;
+        slot->cluster = new_cluster;
+        slot->index = 0;
+        slot->position = index->next_position;
+    }
+
+    // The slot after this one becomes the new end marker
+    uint32_t entries_per_cluster = cluster_size(bs) / sizeof(DirectoryEntry);
+    index->next_position = slot->position + 1;
+    index->has_end = slot->index + 1 < entries_per_cluster;
+    if (index->has_end) {
+        index->end.cluster = slot->cluster;
+        index->end.index = slot->index + 1;
+        index->end.position = slot->position + 1;
+    }
+    return 0;
+}
+
+// Appends ENTRY to the directory and records it in the index.
+// Returns 0 on success and -1 when the directory cannot grow.
+int dir_add_entry(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const DirectoryEntry *entry, DirSlot *slot) {
+    DirIndex *index = dir_index_get(dev, bs, dir_cluster);
+    DirSlot new_slot;
+
+    if (free_slots_take(index, 1, &new_slot) != 0 && reserve_end_slot(dev, bs, index, &new_slot) != 0) {
+        return -1;
+    }
+    dir_write_entry(dev, bs, &new_slot, entry);
+    index_put(index, entry, &new_slot, NULL, 0, NULL);
+    if (slot != NULL) {
+        *slot = new_slot;
+    }
+    return 0;
+}
+
+static ShortNameHint *find_hint(DirIndex *index, const uint8_t *basis) {
+    if ((index->hint_used + 1) * 10 > index->hint_capacity * 7) {
+        ShortNameHint *old = index->hints;
+        uint32_t old_capacity = index->hint_capacity;
+        index->hint_capacity = old_capacity ? old_capacity * 2 : 16;
+        index->hints = calloc(index->hint_capacity, sizeof(ShortNameHint));
+        for (uint32_t i = 0; i < old_capacity; i++) {
+            if (old[i].next != 0) {
+                uint32_t j = hash_name(old[i].basis) & (index->hint_capacity - 1);
+                while (index->hints[j].next != 0) {
+                    j = (j + 1) & (index->hint_capacity - 1);
+                }
+                index->hints[j] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    uint32_t mask = index->hint_capacity - 1;
+    uint32_t i = hash_name(basis) & mask;
+    while (index->hints[i].next != 0) {
+        if (memcmp(index->hints[i].basis, basis, 11) == 0) {
+            return &index->hints[i];
+        }
+        i = (i + 1) & mask;
+    }
+    memcpy(index->hints[i].basis, basis, 11);
+    index->hints[i].next = 1;
+    index->hint_used++;
+    return &index->hints[i];
+}
+
+// Picks a free "BASIS~N" alias for a long name. Each basis remembers the
+// next tail to try, so a directory of many similar names costs one probe
+// per new name instead of rescanning every tail from ~1 each time.
+static int generate_short_name(DirIndex *index, const char *name, uint8_t *short_name) {
+    uint8_t basis[11];
+    lfn_short_basis(name, basis);
+
+    ShortNameHint *hint = find_hint(index, basis);
+    uint32_t n = hint->next;
+    do {
+        if (n > 999999) {
+            return -1;
+        }
+        lfn_apply_tail(short_name, basis, n++);
+    } while (index_find(index, short_name) != NULL);
+    hint->next = n;
+    return 0;
+}
+
+// Adds an entry called NAME. ENTRY supplies everything but the name and
+// receives the short name used. Names that fit 8.3 are stored as a plain
+// short entry; anything else gets a generated "~N" alias preceded by its
+// long name fragments in consecutive slots.
+int dir_create_entry(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const char *name, DirectoryEntry *entry, DirSlot *slot) {
+    DirIndex *index = dir_index_get(dev, bs, dir_cluster);
+    uint8_t short_name[11];
+
+    if (name_to_short(name, short_name) == 0) {
+        if (dir_index_find(index, name) != NULL) {
+            return DIR_CREATE_EXISTS;
+        }
+        memcpy(entry->name, short_name, 11);
+        return dir_add_entry(dev, bs, dir_cluster, entry, slot) == 0 ? DIR_CREATE_OK : DIR_CREATE_FULL;
+    }
+
+    uint16_t units[LFN_MAX_UNITS];
+    int length = lfn_encode(name, units);
+    if (length < 0) {
+        return DIR_CREATE_INVALID;
+    }
+    if (long_cell(index, name) != NULL) {
+        return DIR_CREATE_EXISTS;
+    }
+    if (generate_short_name(index, name, entry->name) != 0) {
+        return DIR_CREATE_INVALID;
+    }
+
+    DirectoryEntry fragments[LFN_MAX_ENTRIES];
+    uint32_t count = lfn_entry_count(length);
+    lfn_fill_entries(units, length, lfn_checksum(entry->name), fragments);
+
+    // The fragments and the entry need consecutive slots: a run of
+    // deleted ones if there is one, otherwise slots at the end. Every
+    // slot is reserved before any is written, so a directory that cannot
+    // grow is left exactly as it was: clusters the chain gained on the
+    // way are unlinked and freed again.
+    DirSlot slots[LFN_MAX_ENTRIES + 1];
+    if (free_slots_take(index, count + 1, slots) != 0) {
+        DirSlot saved_end = index->end;
+        int saved_has_end = index->has_end;
+        uint32_t saved_position = index->next_position;
+        uint32_t saved_last = index->last_cluster;
+        for (uint32_t i = 0; i <= count; i++) {
+            if (reserve_end_slot(dev, bs, index, &slots[i]) != 0) {
+                if (index->last_cluster != saved_last) {
+                    fat_table_lock();
+                    uint32_t grown = fat_table_get(saved_last);
+                    write_fat_entry(dev, bs, saved_last, 0xFFFFFFFF);
+                    fat_table_unlock();
+                    fat_table_free_chain(grown);
+                }
+                index->end = saved_end;
+                index->has_end = saved_has_end;
+                index->next_position = saved_position;
+                index->last_cluster = saved_last;
+                return DIR_CREATE_FULL;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        dir_write_entry(dev, bs, &slots[i], &fragments[i]);
+    }
+    dir_write_entry(dev, bs, &slots[count], entry);
+    index_put(index, entry, &slots[count], &slots[0], count, name);
+    if (slot != NULL) {
+        *slot = slots[count];
+    }
+    return DIR_CREATE_OK;
+}
+
+// Marks the long name fragments in front of an entry deleted and makes
+// their slots available again
+static void delete_fragments(BlockDevice *dev, FAT32BootSector *bs, DirIndex *index, const DirIndexEntry *found) {
+    uint32_t entries_per_cluster = cluster_size(bs) / sizeof(DirectoryEntry);
+    DirSlot slot = found->lfn_slot;
+
+    for (uint32_t i = 0; i < found->lfn_count; i++) {
+        DirectoryEntry deleted;
+        bcache_read(dev, bs, slot.cluster, slot.index * sizeof(DirectoryEntry), &deleted, sizeof(deleted));
+        deleted.name[0] = DIR_ENTRY_DELETED;
+        dir_write_entry(dev, bs, &slot, &deleted);
+        free_slot_push(index, &slot);
+
+        slot.position++;
+        if (++slot.index == entries_per_cluster) {
+            slot.cluster = fat_table_get(slot.cluster);
+            slot.index = 0;
+        }
+    }
+}
+
+// Marks the entry and its long name deleted on disk and drops it from the index
+int dir_remove_entry(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const uint8_t *short_name) {
+    DirIndex *index = dir_index_get(dev, bs, dir_cluster);
+    DirIndexEntry *found = index_find(index, short_name);
+    if (found == NULL) {
+        return -1;
+    }
+
+    DirectoryEntry deleted = found->entry;
+    deleted.name[0] = DIR_ENTRY_DELETED;
+    dir_write_entry(dev, bs, &found->slot, &deleted);
+    free_slot_push(index, &found->slot);
+    delete_fragments(dev, bs, index, found);
+
+    index_remove(index, found);
+    return 0;
+}
+
+// Renames an entry in place to a new short name, keeping its slot. A
+// long name the entry had no longer matches and is deleted with it.
+int dir_rename_entry(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const uint8_t *old_name, const uint8_t *new_name) {
+    DirIndex *index = dir_index_get(dev, bs, dir_cluster);
+    DirIndexEntry *found = index_find(index, old_name);
+    if (found == NULL || index_find(index, new_name) != NULL) {
+        return -1;
+    }
+
+    DirectoryEntry renamed = found->entry;
+    DirSlot slot = found->slot;
+    memcpy(renamed.name, new_name, 11);
+    dir_write_entry(dev, bs, &slot, &renamed);
+    delete_fragments(dev, bs, index, found);
+
+    index_remove(index, found);
+    index_put(index, &renamed, &slot, NULL, 0, NULL);
+    return 0;
+}
+
+// Rewrites an existing entry (matched by its short name) in place, for
+// size and first-cluster updates
+int dir_update_entry(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const DirectoryEntry *entry) {
+    DirIndexEntry *found = index_find(dir_index_get(dev, bs, dir_cluster), entry->name);
+    if (found == NULL) {
+        return -1;
+    }
+    found->entry = *entry;
+    dir_write_entry(dev, bs, &found->slot, entry);
+    return 0;
+}
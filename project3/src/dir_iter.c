@@ -0,0 +1,211 @@
+#include "dir_iter.h"
+#include "fat_table.h"
+#include "bcache.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int is_chain_end(uint32_t cluster) {
+    return cluster < 2 || cluster >= FAT_EOC || cluster >= fat_table.num_entries;
+}
+
+static void load_cluster(DirIter *it) {
+    uint32_t next = fat_table_get(it->cluster);
+    if (!is_chain_end(next)) {
+        // Let the device start fetching the next cluster while we scan this one
+        dev_prefetch(it->dev, cluster_to_offset(it->bs, next), cluster_size(it->bs));
+    }
+
+    if (!it->direct) {
+        // A copy, since another session may evict the cached cluster
+        // while this one is still scanning it
+        if (it->scratch == NULL) {
+            it->scratch = malloc(cluster_size(it->bs));
+        }
+        read_cluster(it->dev, it->bs, it->cluster, it->scratch);
+        it->entries = it->scratch;
+    } else {
+        // Straight from the image mapping, or into the iterator's own buffer
+        uint64_t offset = cluster_to_offset(it->bs, it->cluster);
+        it->entries = dev_view(it->dev, offset, cluster_size(it->bs));
+        if (it->entries == NULL) {
+            if (it->scratch == NULL) {
+                it->scratch = malloc(cluster_size(it->bs));
+            }
+            if (dev_read(it->dev, offset, it->scratch, cluster_size(it->bs)) != 0) {
+                memset(it->scratch, 0, cluster_size(it->bs));
+            }
+            it->entries = it->scratch;
+        }
+    }
+    it->index = 0;
+    it->last_cluster = it->cluster;
+}
+
+static void iter_open(DirIter *it, BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, int direct) {
+    memset(it, 0, sizeof(*it));
+    it->direct = direct;
+    it->dev = dev;
+    it->bs = bs;
+    it->cluster = cluster;
+    it->entries_per_cluster = cluster_size(bs) / sizeof(DirectoryEntry);
+
+    if (is_chain_end(cluster)) {
+        it->cluster = 0;
+        return;
+    }
+    load_cluster(it);
+}
+
+void dir_iter_open(DirIter *it, BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster) {
+    iter_open(it, dev, bs, cluster, 0);
+}
+
+// Opens an iterator that reads the image directly instead of through the
+// block cache, for walkers running on several threads at once. The cache
+// must have been flushed first.
+void dir_iter_open_direct(DirIter *it, BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster) {
+    iter_open(it, dev, bs, cluster, 1);
+}
+
+// Returns the next slot in the directory, including deleted and long
+// name entries, or NULL once the end marker or end of chain is reached
+const DirectoryEntry *dir_iter_next_raw(DirIter *it) {
+    if (it->cluster == 0) {
+        return NULL;
+    }
+    if (it->index == it->entries_per_cluster) {
+        uint32_t next = fat_table_get(it->cluster);
+        if (is_chain_end(next)) {
+            it->cluster = 0;
+            return NULL;
+        }
+        it->cluster = next;
+        load_cluster(it);
+    }
+
+    const DirectoryEntry *entry = &it->entries[it->index];
+    if (entry->name[0] == DIR_ENTRY_END) {
+        it->end.cluster = it->cluster;
+        it->end.index = it->index;
+        it->end.position = it->position;
+        it->found_end = 1;
+        it->cluster = 0;
+        return NULL;
+    }
+
+    it->slot.cluster = it->cluster;
+    it->slot.index = it->index;
+    it->slot.position = it->position;
+    it->index++;
+    it->position++;
+    return entry;
+}
+
+// Feeds one entry returned by dir_iter_next_raw through the long name
+// assembly. Returns 1 when it is a live short-name entry, with lfn_count
+// and long_name describing its long name, and 0 for deleted and long
+// name entries.
+int dir_iter_accept(DirIter *it, const DirectoryEntry *entry) {
+    if (entry->name[0] == DIR_ENTRY_DELETED) {
+        lfn_reset(&it->lfn);
+        return 0;
+    }
+    if ((entry->attr & ATTR_LONG_NAME) == ATTR_LONG_NAME) {
+        if (lfn_feed(&it->lfn, entry)) {
+            it->lfn_slot = it->slot;
+        }
+        return 0;
+    }
+
+    uint32_t fragments = it->lfn.count;
+    it->lfn_count = lfn_finish(&it->lfn, entry, it->long_name) ? fragments : 0;
+    return 1;
+}
+
+// Returns the next live short-name entry, skipping deleted and long name
+// entries. Long name fragments are collected on the way, so afterwards
+// it->long_name holds the entry's verified long name, if it has one.
+const DirectoryEntry *dir_iter_next(DirIter *it) {
+    const DirectoryEntry *entry;
+    while ((entry = dir_iter_next_raw(it)) != NULL) {
+        if (dir_iter_accept(it, entry)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void dir_iter_close(DirIter *it) {
+    free(it->scratch);
+    it->scratch = NULL;
+    it->entries = NULL;
+    it->cluster = 0;
+}
+
+// Formats the 8.3 name of ENTRY as "NAME.EXT" into NAME (13 bytes)
+void entry_name(const DirectoryEntry *entry, char *name) {
+    int length = 0;
+
+    for (int i = 0; i < 8 && entry->name[i] != ' '; i++) {
+        name[length++] = entry->name[i];
+    }
+    if (length > 0 && (uint8_t)name[0] == 0x05) {
+        // 0x05 stands in for a leading 0xE5 byte
+        name[0] = (char)DIR_ENTRY_DELETED;
+    }
+    if (entry->name[8] != ' ') {
+        name[length++] = '.';
+        for (int i = 8; i < 11 && entry->name[i] != ' '; i++) {
+            name[length++] = entry->name[i];
+        }
+    }
+    name[length] = '\0';
+}
+
+// Converts NAME to its raw space-padded, upper-case 8.3 form.
+// Returns 0 on success and -1 when NAME is not a valid short name.
+int name_to_short(const char *name, uint8_t *short_name) {
+    memset(short_name, ' ', 11);
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        memcpy(short_name, name, strlen(name));
+        return 0;
+    }
+
+    const char *dot = strrchr(name, '.');
+    size_t base_length = dot ? (size_t)(dot - name) : strlen(name);
+    size_t ext_length = dot ? strlen(dot + 1) : 0;
+    if (base_length == 0 || base_length > 8 || ext_length > 3 || (dot && ext_length == 0)) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < base_length + (dot ? ext_length + 1 : 0); i++) {
+        unsigned char c = (unsigned char)name[i];
+        if (i == base_length) {
+            continue;
+        }
+        if (c < 0x20 || strchr("\"*+,./:;<=>?[\\]|", c) != NULL) {
+            return -1;
+        }
+        c = (unsigned char)toupper(c);
+        if (i < base_length) {
+            short_name[i] = c;
+        } else {
+            short_name[8 + (i - base_length - 1)] = c;
+        }
+    }
+
+    if (short_name[0] == DIR_ENTRY_DELETED) {
+        short_name[0] = 0x05;
+    }
+    return 0;
+}
+
+uint32_t entry_cluster(const DirectoryEntry *entry) {
+    return ((uint32_t)entry->firstclusthi << 16) | entry->firstclustlo;
+}
+
+void dir_write_entry(BlockDevice *dev, FAT32BootSector *bs, const DirSlot *slot, const DirectoryEntry *entry) {
+    bcache_write(dev, bs, slot->cluster, slot->index * sizeof(DirectoryEntry), entry, sizeof(DirectoryEntry));
+}
@@ -0,0 +1,96 @@
+#include "extent.h"
+#include "fat_table.h"
+#include <stdlib.h>
+#include <string.h>
+
+void extent_map_init(ExtentMap *map, uint32_t first_cluster) {
+    memset(map, 0, sizeof(*map));
+    map->first_cluster = first_cluster;
+}
+
+static int append_run(ExtentMap *map, uint32_t file_index, uint32_t cluster) {
+    if (map->num_runs == map->capacity) {
+        uint32_t capacity = map->capacity ? map->capacity * 2 : 8;
+        Extent *runs = realloc(map->runs, capacity * sizeof(Extent));
+        if (runs == NULL) {
+            return -1;
+        }
+        map->runs = runs;
+        map->capacity = capacity;
+    }
+    map->runs[map->num_runs].file_index = file_index;
+    map->runs[map->num_runs].cluster = cluster;
+    map->runs[map->num_runs].length = 1;
+    map->num_runs++;
+    return 0;
+}
+
+// Walks the FAT chain once, merging consecutive cluster numbers into runs
+int extent_map_build(ExtentMap *map) {
+    uint32_t cluster = map->first_cluster;
+    uint32_t file_index = 0;
+
+    map->num_runs = 0;
+    map->total_clusters = 0;
+    while (cluster >= 2 && cluster < FAT_EOC && cluster < fat_table.num_entries) {
+        Extent *last = map->num_runs ? &map->runs[map->num_runs - 1] : NULL;
+        if (last != NULL && last->cluster + last->length == cluster) {
+            last->length++;
+        } else if (append_run(map, file_index, cluster) != 0) {
+            return -1;
+        }
+
+        file_index++;
+        if (file_index > fat_table.num_entries) {
+            // A chain longer than the FAT itself must contain a loop
+            return -1;
+        }
+        cluster = fat_table_get(cluster);
+    }
+    map->total_clusters = file_index;
+    map->valid = 1;
+    return 0;
+}
+
+// Translates a cluster index within the file to its physical cluster and
+// the number of contiguous clusters that follow it in the same run
+// (including itself). Returns 0 on success, -1 past the end of the file.
+int extent_map_lookup(ExtentMap *map, uint32_t file_index, uint32_t *cluster, uint32_t *run_remaining) {
+    if (!map->valid && extent_map_build(map) != 0) {
+        return -1;
+    }
+    if (file_index >= map->total_clusters) {
+        return -1;
+    }
+
+    uint32_t low = 0;
+    uint32_t high = map->num_runs;
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if (map->runs[mid].file_index <= file_index) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    const Extent *run = &map->runs[low];
+    uint32_t delta = file_index - run->file_index;
+    *cluster = run->cluster + delta;
+    if (run_remaining != NULL) {
+        *run_remaining = run->length - delta;
+    }
+    return 0;
+}
+
+void extent_map_invalidate(ExtentMap *map) {
+    map->valid = 0;
+}
+
+void extent_map_free(ExtentMap *map) {
+    free(map->runs);
+    map->runs = NULL;
+    map->num_runs = 0;
+    map->capacity = 0;
+    map->valid = 0;
+}
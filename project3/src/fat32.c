@@ -1,282 +1,184 @@
 #include "fat32.h"
+#include "fat_table.h"
+#include "bcache.h"
+#include "stats.h"
+#include "dir_index.h"
+#include "path.h"
+#include "file_io.h"
+#include "handle.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define MAX_DIR_ENTRIES 16
-OpenFile open_files[MAX_OPEN_FILES];
+__thread FILE *shell_out;
 
 uint32_t cluster_to_sector(FAT32BootSector *bs, uint32_t cluster) {
     uint32_t first_data_sector = bs->reserved_sector_count + (bs->num_fats * bs->fat_size_32);
     return ((cluster - 2) * bs->sectors_per_cluster) + first_data_sector;
 }
 
-void read_cluster(FILE *image, FAT32BootSector *bs, uint32_t cluster, void *buffer) {
-    uint32_t sector = cluster_to_sector(bs, cluster);
-    fseek(image, sector * bs->bytes_per_sector, SEEK_SET);
-    fread(buffer, bs->bytes_per_sector, bs->sectors_per_cluster, image);
+uint64_t cluster_to_offset(FAT32BootSector *bs, uint32_t cluster) {
+    return (uint64_t)cluster_to_sector(bs, cluster) * bs->bytes_per_sector;
 }
 
-void write_cluster(FILE *image, FAT32BootSector *bs, uint32_t cluster, const void *buffer) {
-    uint32_t sector = cluster_to_sector(bs, cluster);
-    fseek(image, sector * bs->bytes_per_sector, SEEK_SET);
-    fwrite(buffer, bs->bytes_per_sector, bs->sectors_per_cluster, image);
+uint32_t cluster_size(FAT32BootSector *bs) {
+    return (uint32_t)bs->bytes_per_sector * bs->sectors_per_cluster;
+}
+
+// Metadata clusters are read and written through the block cache, so
+// a cluster that was just written or listed is served from memory
+void read_cluster(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, void *buffer) {
+    STAT_ADD(clusters_read, 1);
+    bcache_read(dev, bs, cluster, 0, buffer, cluster_size(bs));
+}
+
+void write_cluster(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, const void *buffer) {
+    STAT_ADD(clusters_written, 1);
+    bcache_write(dev, bs, cluster, 0, buffer, cluster_size(bs));
 }
 
 void print_boot_sector_info(FAT32BootSector *bs) {
     uint32_t total_data_clusters = (bs->total_sectors_32 - bs->reserved_sector_count - (bs->num_fats * bs->fat_size_32)) / bs->sectors_per_cluster;
 
-    printf("Position of root cluster (in cluster #): %u\n", bs->root_cluster);
-    printf("Bytes per sector: %u\n", bs->bytes_per_sector);
-    printf("Sectors per cluster: %u\n", bs->sectors_per_cluster);
-    printf("Total number of clusters in data region: %u\n", total_data_clusters);
-    printf("Number of entries in one FAT: %u\n", bs->fat_size_32 * bs->bytes_per_sector / 4);
-    printf("Size of image (in bytes): %u\n", bs->total_sectors_32 * bs->bytes_per_sector);
+    fprintf(shell_out, "Position of root cluster (in cluster #): %u\n", bs->root_cluster);
+    fprintf(shell_out, "Bytes per sector: %u\n", bs->bytes_per_sector);
+    fprintf(shell_out, "Sectors per cluster: %u\n", bs->sectors_per_cluster);
+    fprintf(shell_out, "Total number of clusters in data region: %u\n", total_data_clusters);
+    fprintf(shell_out, "Number of entries in one FAT: %u\n", bs->fat_size_32 * bs->bytes_per_sector / 4);
+    fprintf(shell_out, "Size of image (in bytes): %llu\n", (unsigned long long)bs->total_sectors_32 * bs->bytes_per_sector);
 }
 
-void handle_ls_command(FILE *image, FAT32BootSector *bs, uint32_t cluster) {
-    DirectoryEntry entries[MAX_DIR_ENTRIES];
-    read_cluster(image, bs, cluster, entries);
+void handle_ls_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster) {
+    // The index holds the entries in directory order with their long
+    // names already decoded, so listing never rescans the image
+    DirIndex *index = dir_index_get(dev, bs, cluster);
+    char buffer[NAME_BUFFER_SIZE];
 
-    printf("Listing directory contents:\n");
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (entries[i].name[0] == 0x00) {
-            // No more entries
-            break;
-        }
-        if ((entries[i].attr & 0x0F) == 0x0F) {
-            // Long file name entry, skip it
-            continue;
-        }
-        if (entries[i].name[0] == 0xE5) {
-            // Deleted entry, skip it
+    fprintf(shell_out, "Listing directory contents:\n");
+    for (uint32_t i = 0; i < index->num_entries; i++) {
+        const DirIndexEntry *found = &index->entries[i];
+        if (found->state != DIR_INDEX_USED) {
             continue;
         }
-
-        char name[12];
-        memcpy(name, entries[i].name, 11);
-        name[11] = '\0';
-
-        // Remove trailing spaces from the name
-        for (int j = 10; j >= 0; j--) {
-            if (name[j] != ' ') {
-                name[j + 1] = '\0';
-                break;
-            }
-        }
-
-        if ((entries[i].attr & 0x10) == 0x10) {
-            printf("[DIR] %s\n", name);
+        const char *name = dir_entry_display_name(found, buffer);
+        if ((found->entry.attr & ATTR_DIRECTORY) == ATTR_DIRECTORY) {
+            fprintf(shell_out, "[DIR] %s\n", name);
         } else {
-            printf("[FILE] %s\n", name);
+            fprintf(shell_out, "[FILE] %s\n", name);
         }
     }
 }
 
-uint32_t find_directory_cluster(FILE *image, FAT32BootSector *bs, uint32_t cluster, const char *dirname) {
-    DirectoryEntry entries[MAX_DIR_ENTRIES];
-    read_cluster(image, bs, cluster, entries);
-
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (entries[i].name[0] == 0x00) {
-            // No more entries
-            break;
-        }
-        if ((entries[i].attr & 0x0F) == 0x0F || entries[i].name[0] == 0xE5) {
-            // Long file name entry or deleted entry, skip it
-            continue;
-        }
-
-        char name[12];
-        memcpy(name, entries[i].name, 11);
-        name[11] = '\0';
-
-        // Remove trailing spaces from the name
-        for (int j = 10; j >= 0; j--) {
-            if (name[j] != ' ') {
-                name[j + 1] = '\0';
-                break;
-            }
-        }
+uint32_t find_directory_cluster(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, const char *dirname) {
+    DirectoryEntry entry;
 
-        if (strcmp(name, dirname) == 0) {
-            if ((entries[i].attr & 0x10) == 0x10) {
-                // Directory found, return its cluster number
-                return (entries[i].firstclusthi << 16) | entries[i].firstclustlo;
-            } else {
-                // Found entry with matching name but it is not a directory
-                return 0;
-            }
-        }
+    if (!dir_find_entry(dev, bs, cluster, dirname, &entry, NULL)) {
+        // Directory not found
+        return 0;
     }
-
-    // Directory not found
-    return 0;
+    if ((entry.attr & ATTR_DIRECTORY) != ATTR_DIRECTORY) {
+        // Found entry with matching name but it is not a directory
+        return 0;
+    }
+    return entry_cluster(&entry);
 }
 
-void handle_cd_command(FILE *image, FAT32BootSector *bs, uint32_t *current_cluster, uint32_t *parent_cluster, char *current_path, const char *dirname) {
-    if (strcmp(dirname, ".") == 0) {
-        // Stay in the current directory
-        return;
-    } else if (strcmp(dirname, "..") == 0) {
-        if (*current_cluster != bs->root_cluster) {
-            // Move to the parent directory
-            *current_cluster = *parent_cluster;
-
-            // Update current path
-            char *last_slash = strrchr(current_path, '/');
-            if (last_slash != NULL) {
-                *last_slash = '\0';
-            }
-        } else {
-            printf("Error: Already at the root directory.\n");
-        }
+void handle_cd_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t *current_cluster, char *current_path, const char *path) {
+    if (strcmp(path, "..") == 0 && *current_cluster == bs->root_cluster) {
+        fprintf(shell_out, "Error: Already at the root directory.\n");
         return;
     }
 
-    uint32_t new_cluster = find_directory_cluster(image, bs, *current_cluster, dirname);
-    if (new_cluster != 0) {
-        // Update parent cluster before changing current directory
-        *parent_cluster = *current_cluster;
-        *current_cluster = new_cluster;
+    uint32_t new_cluster;
+    uint8_t attr;
+    if (path_resolve(dev, bs, *current_cluster, path, &new_cluster, &attr) != 0 || (attr & ATTR_DIRECTORY) == 0) {
+        fprintf(shell_out, "Error: Directory '%s' not found or is not a directory.\n", path);
+        return;
+    }
 
-        // Update current path
-        strcat(current_path, "/");
-        strcat(current_path, dirname);
-    } else {
-        printf("Error: Directory '%s' not found or is not a directory.\n", dirname);
+    // Update current path
+    if (path_join(current_path, MAX_PATH_LENGTH, path) != 0) {
+        fprintf(shell_out, "Error: Path '%s' is too long.\n", path);
+        return;
     }
+    *current_cluster = new_cluster;
 }
 
-uint32_t find_free_cluster(FILE *image, FAT32BootSector *bs) {
-    uint32_t fat_start = bs->reserved_sector_count * bs->bytes_per_sector;
-    uint32_t total_clusters = (bs->total_sectors_32 - fat_start / bs->bytes_per_sector) / bs->sectors_per_cluster;
-    uint32_t *fat = (uint32_t *)malloc(total_clusters * sizeof(uint32_t));
-
-    fseek(image, fat_start, SEEK_SET);
-    fread(fat, sizeof(uint32_t), total_clusters, image);
+uint32_t find_free_cluster(BlockDevice *dev, FAT32BootSector *bs) {
+    (void)dev;
+    (void)bs;
+    return fat_table_find_free();
+}
 
-    for (uint32_t i = 2; i < total_clusters; i++) {
-        if (fat[i] == 0) {
-            free(fat);
-            return i;
-        }
+// Prints why dir_create_entry could not add NAME
+static void report_create_error(int result, const char *name) {
+    if (result == DIR_CREATE_EXISTS) {
+        fprintf(shell_out, "Error: Directory or file with the name '%s' already exists.\n", name);
+    } else if (result == DIR_CREATE_INVALID) {
+        fprintf(shell_out, "Error: '%s' is not a valid file name.\n", name);
+    } else {
+        fprintf(shell_out, "Error: No free cluster available.\n");
     }
-
-    free(fat);
-    return 0;  // No free cluster found
 }
 
-void handle_mkdir_command(FILE *image, FAT32BootSector *bs, uint32_t current_cluster, const char *dirname) {
-    DirectoryEntry entries[MAX_DIR_ENTRIES];
-    read_cluster(image, bs, current_cluster, entries);
-
-    // Check if DIRNAME already exists
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (entries[i].name[0] == 0x00) {
-            break;
-        }
-        char name[12];
-        memcpy(name, entries[i].name, 11);
-        name[11] = '\0';
-
-        // Remove trailing spaces from the name
-        for (int j = 10; j >= 0; j--) {
-            if (name[j] != ' ') {
-                name[j + 1] = '\0';
-                break;
-            }
-        }
-
-        if (strcmp(name, dirname) == 0) {
-            printf("Error: Directory or file with the name '%s' already exists.\n", dirname);
-            return;
-        }
+void handle_mkdir_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *dirname) {
+    // Check if DIRNAME already exists before allocating anything
+    if (dir_find_entry(dev, bs, current_cluster, dirname, NULL, NULL)) {
+        report_create_error(DIR_CREATE_EXISTS, dirname);
+        return;
     }
 
-    // Find a free cluster for the new directory
-    uint32_t new_cluster = find_free_cluster(image, bs);
+    // Find a free cluster for the new directory and mark it allocated
+    // before another session can pick the same one
+    fat_table_lock();
+    uint32_t new_cluster = find_free_cluster(dev, bs);
+    if (new_cluster != 0) {
+        write_fat_entry(dev, bs, new_cluster, 0xFFFFFFFF);
+    }
+    fat_table_unlock();
     if (new_cluster == 0) {
-        printf("Error: No free cluster available.\n");
+        fprintf(shell_out, "Error: No free cluster available.\n");
         return;
     }
 
-    // Mark the new cluster as allocated in the FAT
-    uint32_t fat_start = bs->reserved_sector_count * bs->bytes_per_sector;
-    fseek(image, fat_start + new_cluster * sizeof(uint32_t), SEEK_SET);
-    uint32_t end_of_chain = 0xFFFFFFFF;
-    fwrite(&end_of_chain, sizeof(uint32_t), 1, image);
-
-    // Create the new directory entry in the current directory
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (entries[i].name[0] == 0x00) {
-            memset(entries[i].name, ' ', 11);
-            strncpy((char *)entries[i].name, dirname, strlen(dirname));  // Cast to char *
-            entries[i].attr = 0x10;  // Directory attribute
-            entries[i].firstclusthi = (new_cluster >> 16) & 0xFFFF;
-            entries[i].firstclustlo = new_cluster & 0xFFFF;
-            entries[i].filesize = 0;
-            break;
-        }
+    // Create the new directory entry in the current directory, growing it if needed
+    DirectoryEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    create_directory_entry(&entry, dirname, new_cluster);
+    int result = dir_create_entry(dev, bs, current_cluster, dirname, &entry, NULL);
+    if (result != DIR_CREATE_OK) {
+        write_fat_entry(dev, bs, new_cluster, 0);
+        report_create_error(result, dirname);
+        return;
     }
 
-    // Write updated directory entries back to the current cluster
-    write_cluster(image, bs, current_cluster, entries);
-
     // Initialize the new directory cluster
-    DirectoryEntry new_entries[MAX_DIR_ENTRIES] = {0};
-    memset(new_entries, 0, sizeof(new_entries));
-
-    // Create '.' entry
-    memset(new_entries[0].name, ' ', 11);
-    new_entries[0].name[0] = '.';
-    new_entries[0].attr = 0x10;
-    new_entries[0].firstclusthi = (new_cluster >> 16) & 0xFFFF;
-    new_entries[0].firstclustlo = new_cluster & 0xFFFF;
-    new_entries[0].filesize = 0;
-
-    // Create '..' entry
-    memset(new_entries[1].name, ' ', 11);
-    new_entries[1].name[0] = '.';
-    new_entries[1].name[1] = '.';
-    new_entries[1].attr = 0x10;
-    new_entries[1].firstclusthi = (current_cluster >> 16) & 0xFFFF;
-    new_entries[1].firstclustlo = current_cluster & 0xFFFF;
-    new_entries[1].filesize = 0;
+    DirectoryEntry *new_entries = calloc(1, cluster_size(bs));
+    // A '..' entry refers to the root directory as cluster 0
+    create_special_entries(new_entries, new_cluster, current_cluster == bs->root_cluster ? 0 : current_cluster);
 
     // Write the new directory entries to the new cluster
-    write_cluster(image, bs, new_cluster, new_entries);
+    write_cluster(dev, bs, new_cluster, new_entries);
+    free(new_entries);
 
-    printf("Directory '%s' created successfully.\n", dirname);
+    fprintf(shell_out, "Directory '%s' created successfully.\n", dirname);
 
     // Verify by reading back the new cluster
-    populate_dir(image, bs, new_entries, new_cluster);
-    printf("Verifying new directory contents:\n");
-    for (int j = 0; j < MAX_DIR_ENTRIES; j++) {
-        if (new_entries[j].name[0] == 0x00) {
-            break;
-        }
-        char name[12];
-        memcpy(name, new_entries[j].name, 11);
-        name[11] = '\0';
-        // Remove trailing spaces from the name
-        for (int k = 10; k >= 0; k--) {
-            if (name[k] != ' ') {
-                name[k + 1] = '\0';
-                break;
-            }
-        }
-        printf("Entry %d: %s\n", j, name);
+    DirIter it;
+    const DirectoryEntry *new_entry;
+    char name[NAME_BUFFER_SIZE];
+    fprintf(shell_out, "Verifying new directory contents:\n");
+    dir_iter_open(&it, dev, bs, new_cluster);
+    while ((new_entry = dir_iter_next_raw(&it)) != NULL) {
+        entry_name(new_entry, name);
+        fprintf(shell_out, "Entry %u: %s\n", it.slot.position, name);
     }
+    dir_iter_close(&it);
 }
 
 // Add any missing helper functions
 void create_directory_entry(DirectoryEntry *entry, const char *name, uint32_t cluster) {
-    memset(entry->name, ' ', 11);
-    strncpy((char *)entry->name, name, strlen(name));  // Cast to char *
-    for (int i = strlen(name); i < 11; i++) {
-        entry->name[i] = ' ';
-    }
+    name_to_short(name, entry->name);
     entry->attr = 0x10;  // Directory attribute
     entry->firstclusthi = (cluster >> 16) & 0xFFFF;
     entry->firstclustlo = cluster & 0xFFFF;
@@ -300,153 +202,160 @@ void create_special_entries(DirectoryEntry *entries, uint32_t new_cluster, uint3
     entries[1].filesize = 0;
 }
 
-void write_fat_entry(FILE *image, FAT32BootSector *bs, uint32_t cluster, uint32_t value) {
-    uint32_t fat_start = bs->reserved_sector_count * bs->bytes_per_sector;
-    fseek(image, fat_start + cluster * sizeof(uint32_t), SEEK_SET);
-    fwrite(&value, sizeof(uint32_t), 1, image);
+// FAT updates only touch the in-memory table; fat_table_flush writes
+// the dirty sectors to every FAT copy at the next command boundary.
+void write_fat_entry(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, uint32_t value) {
+    (void)dev;
+    (void)bs;
+    fat_table_set(cluster, value);
 }
 
-void populate_dir(FILE *image, FAT32BootSector *bs, DirectoryEntry *entries, uint32_t cluster) {
-    read_cluster(image, bs, cluster, entries);
+void populate_dir(BlockDevice *dev, FAT32BootSector *bs, DirectoryEntry *entries, uint32_t cluster) {
+    read_cluster(dev, bs, cluster, entries);
 }
 
 
-void handle_creat_command(FILE *image, FAT32BootSector *bs, uint32_t current_cluster, const char *filename) {
-    DirectoryEntry entries[MAX_DIR_ENTRIES];
-    read_cluster(image, bs, current_cluster, entries);
-
-    // Check if FILENAME already exists
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (entries[i].name[0] == 0x00) {
-            break;
-        }
-        char name[12];
-        memcpy(name, entries[i].name, 11);
-        name[11] = '\0';
-
-        // Remove trailing spaces from the name
-        for (int j = 10; j >= 0; j--) {
-            if (name[j] != ' ') {
-                name[j + 1] = '\0';
-                break;
-            }
-        }
+// Adds an empty regular file to the directory. Empty files own no
+// clusters; they are allocated when data is first flushed to the file.
+// Returns 0 on success, otherwise prints the reason and returns -1.
+int create_file(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const char *filename, DirectoryEntry *entry) {
+    // Create the new file entry in the directory, growing it if needed
+    memset(entry, 0, sizeof(*entry));
+    create_directory_entry(entry, filename, 0);
+    entry->attr = ATTR_ARCHIVE;  // Archive attribute (regular file)
+    int result = dir_create_entry(dev, bs, dir_cluster, filename, entry, NULL);
+    if (result != DIR_CREATE_OK) {
+        report_create_error(result, filename);
+        return -1;
+    }
+    return 0;
+}
 
-        if (strcmp(name, filename) == 0) {
-            printf("Error: Directory or file with the name '%s' already exists.\n", filename);
-            return;
-        }
+void handle_creat_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *filename) {
+    DirectoryEntry entry;
+    if (create_file(dev, bs, current_cluster, filename, &entry) == 0) {
+        fprintf(shell_out, "File '%s' created successfully.\n", filename);
     }
+}
 
-    // Find a free cluster for the new file
-    uint32_t new_cluster = find_free_cluster(image, bs);
-    if (new_cluster == 0) {
-        printf("Error: No free cluster available.\n");
+
+void handle_open_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *current_path, const char *filename, const char *mode) {
+    // Check if the file exists and get its cluster number
+    DirectoryEntry entry;
+    DirSlot slot;
+    if (!dir_find_entry(dev, bs, current_cluster, filename, &entry, &slot)) {
+        fprintf(shell_out, "Error: File '%s' not found.\n", filename);
+        return;
+    }
+    if ((entry.attr & ATTR_DIRECTORY) == ATTR_DIRECTORY) {
+        fprintf(shell_out, "Error: '%s' is a directory.\n", filename);
         return;
     }
 
-    // Mark the new cluster as allocated in the FAT
-    write_fat_entry(image, bs, new_cluster, 0xFFFFFFFF);
-
-    // Create the new file entry in the current directory
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (entries[i].name[0] == 0x00) {
-            memset(entries[i].name, ' ', 11);
-            strncpy((char *)entries[i].name, filename, strlen(filename));  // Cast to char *
-            entries[i].attr = 0x20;  // Archive attribute (regular file)
-            entries[i].firstclusthi = (new_cluster >> 16) & 0xFFFF;
-            entries[i].firstclustlo = new_cluster & 0xFFFF;
-            entries[i].filesize = 0;
-            break;
-        }
+    // Check if the file is already open, here or in another session
+    if (handle_lookup(current_cluster, slot.position) != NULL) {
+        fprintf(shell_out, "Error: File '%s' is already open.\n", filename);
+        return;
+    }
+    if (handle_in_use(current_cluster, slot.position)) {
+        fprintf(shell_out, "Error: File '%s' is open in another session.\n", filename);
+        return;
     }
 
-    // Write updated directory entries back to the current cluster
-    write_cluster(image, bs, current_cluster, entries);
+    // Check if the mode is valid
+    if (strcmp(mode, "-r") != 0 && strcmp(mode, "-w") != 0 && strcmp(mode, "-rw") != 0 && strcmp(mode, "-wr") != 0) {
+        fprintf(shell_out, "Error: Invalid mode '%s'.\n", mode);
+        return;
+    }
 
-    printf("File '%s' created successfully.\n", filename);
+    uint32_t file_cluster = entry_cluster(&entry);
+    OpenFile *file = handle_alloc(current_cluster, slot.position);
+    if (file == NULL) {
+        fprintf(shell_out, "Error: File '%s' is open in another session.\n", filename);
+        return;
+    }
+    char buffer[NAME_BUFFER_SIZE];
+    const DirIndexEntry *found = dir_index_find(dir_index_get(dev, bs, current_cluster), filename);
+    snprintf(file->filename, sizeof(file->filename), "%s", dir_entry_display_name(found, buffer));
+    file->cluster = file_cluster;
+    file->size = entry.filesize;
+    extent_map_init(&file->extents, file_cluster);
+    memcpy(file->short_name, entry.name, 11);
+    strncpy(file->mode, mode + 1, 2); // Skip the '-' character
+    file->mode[2] = '\0'; // Ensure null termination
+    file->offset = 0;
+
+    size_t path_length = strlen(current_path) + strlen(file->filename) + 2;
+    file->path = malloc(path_length);
+    snprintf(file->path, path_length, "%s/%s", current_path, file->filename);
+
+    fprintf(shell_out, "File '%s' opened in mode '%s' as descriptor %d.\n", filename, mode, file->fd);
 }
 
+// Finds the open file behind FILENAME in the given directory
+OpenFile *find_open_file(BlockDevice *dev, FAT32BootSector *bs, uint32_t dir_cluster, const char *filename) {
+    DirSlot slot;
+    if (handle_table.count == 0 || !dir_find_entry(dev, bs, dir_cluster, filename, NULL, &slot)) {
+        return NULL;
+    }
+    return handle_lookup(dir_cluster, slot.position);
+}
 
-void handle_open_command(FILE *image, FAT32BootSector *bs, uint32_t current_cluster, const char *filename, const char *mode) {
-    DirectoryEntry entries[MAX_DIR_ENTRIES];
-    read_cluster(image, bs, current_cluster, entries);
+// Translates a byte offset in an open file to the cluster holding it and
+// the number of physically contiguous clusters from there on.
+// Returns 0 on success and -1 when the offset lies past the cluster chain.
+int open_file_locate(OpenFile *file, FAT32BootSector *bs, uint32_t offset, uint32_t *cluster, uint32_t *run_remaining) {
+    return extent_map_lookup(&file->extents, offset / cluster_size(bs), cluster, run_remaining);
+}
 
-    // Check if the file is already open
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (strcmp(open_files[i].filename, filename) == 0) {
-            printf("Error: File '%s' is already open.\n", filename);
-            return;
+void handle_close_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *filename) {
+    // Check if the file is open
+    OpenFile *file = find_open_file(dev, bs, current_cluster, filename);
+    if (file != NULL) {
+        // Write out anything still buffered, then release the descriptor
+        if (file_flush(dev, bs, file) != 0) {
+            fprintf(shell_out, "Error: Failed to write buffered data for '%s'.\n", filename);
         }
+        handle_release(file);
+        fprintf(shell_out, "File '%s' closed successfully.\n", filename);
+        return;
     }
 
-    // Check if the file exists and get its cluster number
-    uint32_t file_cluster = 0;
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (entries[i].name[0] == 0x00) {
-            break;
-        }
-        char name[12];
-        memcpy(name, entries[i].name, 11);
-        name[11] = '\0';
-
-        // Remove trailing spaces from the name
-        for (int j = 10; j >= 0; j--) {
-            if (name[j] != ' ') {
-                name[j + 1] = '\0';
-                break;
-            }
-        }
+    // If the file was not found in the handle table, print an error
+    fprintf(shell_out, "Error: File '%s' is not open or does not exist.\n", filename);
+}
 
-        if (strcmp(name, filename) == 0) {
-            if ((entries[i].attr & 0x10) == 0x10) {
-                printf("Error: '%s' is a directory.\n", filename);
-                return;
-            }
-            file_cluster = (entries[i].firstclusthi << 16) | entries[i].firstclustlo;
-            break;
-        }
+void handle_lseek_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *filename, const char *offset) {
+    OpenFile *file = find_open_file(dev, bs, current_cluster, filename);
+    if (file == NULL) {
+        fprintf(shell_out, "Error: File '%s' is not open or does not exist.\n", filename);
+        return;
     }
 
-    if (file_cluster == 0) {
-        printf("Error: File '%s' not found.\n", filename);
+    char *end;
+    unsigned long new_offset = strtoul(offset, &end, 10);
+    if (*offset == '\0' || *end != '\0' || offset[0] == '-') {
+        fprintf(shell_out, "Error: Invalid offset '%s'.\n", offset);
         return;
     }
-
-    // Check if the mode is valid
-    if (strcmp(mode, "-r") != 0 && strcmp(mode, "-w") != 0 && strcmp(mode, "-rw") != 0 && strcmp(mode, "-wr") != 0) {
-        printf("Error: Invalid mode '%s'.\n", mode);
+    if (new_offset > file->size) {
+        fprintf(shell_out, "Error: Offset %lu is larger than the size of '%s' (%u bytes).\n", new_offset, filename, file->size);
         return;
     }
+    file->offset = (uint32_t)new_offset;
+}
 
-    // Find a free slot in the open files array
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (open_files[i].filename[0] == 0) {
-            strncpy(open_files[i].filename, filename, 11);
-            open_files[i].filename[11] = '\0'; // Ensure null termination
-            open_files[i].cluster = file_cluster;
-            strncpy(open_files[i].mode, mode + 1, 2); // Skip the '-' character
-            open_files[i].mode[2] = '\0'; // Ensure null termination
-            open_files[i].offset = 0;
-            printf("File '%s' opened in mode '%s'.\n", filename, mode);
-            return;
-        }
+void handle_lsof_command(void) {
+    if (handle_table.count == 0) {
+        fprintf(shell_out, "No files are currently open.\n");
+        return;
     }
 
-    printf("Error: Maximum number of open files reached.\n");
-}
-
-void handle_close_command(const char *filename) {
-    // Check if the file is open
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (strcmp(open_files[i].filename, filename) == 0) {
-            // Close the file by resetting its entry
-            memset(&open_files[i], 0, sizeof(OpenFile));
-            printf("File '%s' closed successfully.\n", filename);
-            return;
+    fprintf(shell_out, "%-6s %-12s %-4s %-10s %s\n", "INDEX", "NAME", "MODE", "OFFSET", "PATH");
+    for (int fd = 0; fd < handle_table.capacity; fd++) {
+        OpenFile *file = handle_get(fd);
+        if (file != NULL) {
+            fprintf(shell_out, "%-6d %-12s %-4s %-10u %s\n", fd, file->filename, file->mode, file->offset, file->path);
         }
     }
-
-    // If the file was not found in the open files array, print an error
-    printf("Error: File '%s' is not open or does not exist.\n", filename);
 }
@@ -0,0 +1,435 @@
+#include "fat_table.h"
+#include "bcache.h"
+#include "journal.h"
+#include "stats.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FSINFO_LEAD_SIG 0x41615252
+#define FSINFO_STRUCT_SIG 0x61417272
+#define FSINFO_UNKNOWN 0xFFFFFFFF
+
+FatTable fat_table;
+
+// Allocator lock. Every call that changes the table or its dirty state
+// takes it, and callers that pick clusters and then claim them hold it
+// across both steps (fat_table_lock) so two sessions never claim the
+// same free cluster. Recursive so those callers can still use the calls
+// below. Lookups with fat_table_get stay lock-free: a session only
+// follows chains it owns through its directory lock.
+static pthread_mutex_t fat_lock;
+static pthread_once_t fat_lock_once = PTHREAD_ONCE_INIT;
+
+static void init_fat_lock(void) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&fat_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void fat_table_lock(void) {
+    pthread_mutex_lock(&fat_lock);
+}
+
+void fat_table_unlock(void) {
+    pthread_mutex_unlock(&fat_lock);
+}
+
+static int test_and_set(uint64_t *map, uint32_t bit) {
+    uint64_t mask = 1ULL << (bit & 63);
+    int was_set = (map[bit >> 6] & mask) != 0;
+    map[bit >> 6] |= mask;
+    return was_set;
+}
+
+static void mark_free(uint32_t cluster, int is_free) {
+    uint64_t bit = 1ULL << (cluster & 63);
+    if (is_free) {
+        fat_table.free_map[cluster >> 6] |= bit;
+    } else {
+        fat_table.free_map[cluster >> 6] &= ~bit;
+    }
+}
+
+uint32_t fat_data_clusters(FAT32BootSector *bs) {
+    uint32_t data_sectors = bs->total_sectors_32 - bs->reserved_sector_count - (bs->num_fats * bs->fat_size_32);
+    return data_sectors / bs->sectors_per_cluster;
+}
+
+static uint64_t fs_info_offset(FAT32BootSector *bs) {
+    return (uint64_t)bs->fs_info * bs->bytes_per_sector;
+}
+
+// Seeds the allocation hint from the FSInfo sector. Its free count is
+// kept only for comparison: the count from the mount-time FAT scan is
+// exact, and a stale sector is corrected on the next sync or exit.
+static void load_fs_info(BlockDevice *dev, FAT32BootSector *bs) {
+    FSInfo *info = &fat_table.fs_info;
+    fat_table.next_free = 2;
+
+    if (bs->fs_info == 0 || bs->fs_info == 0xFFFF) {
+        return;
+    }
+    if (dev_read(dev, fs_info_offset(bs), info, sizeof(FSInfo)) != 0) {
+        return;
+    }
+    if (info->lead_sig != FSINFO_LEAD_SIG || info->struct_sig != FSINFO_STRUCT_SIG) {
+        return;
+    }
+    fat_table.has_fs_info = 1;
+    if (info->next_free != FSINFO_UNKNOWN && info->next_free >= 2 && info->next_free < fat_table.num_entries) {
+        fat_table.next_free = info->next_free;
+    }
+}
+
+// Writes the current free count and allocation hint to the FSInfo
+// sector, if the volume has one and either has changed since mount or
+// the last write
+int fat_table_write_fs_info(BlockDevice *dev, FAT32BootSector *bs) {
+    fat_table_lock();
+    FSInfo *info = &fat_table.fs_info;
+    if (!fat_table.has_fs_info || !dev->writable ||
+        (info->free_count == fat_table.free_count && info->next_free == fat_table.next_free)) {
+        fat_table_unlock();
+        return 0;
+    }
+    info->free_count = fat_table.free_count;
+    info->next_free = fat_table.next_free;
+    IoRequest request = { 1, fs_info_offset(bs), info, sizeof(FSInfo), 0 };
+    int result = journal_write(dev, &request, 1);
+    fat_table_unlock();
+    return result;
+}
+
+int fat_table_load(BlockDevice *dev, FAT32BootSector *bs) {
+    uint64_t fat_start = (uint64_t)bs->reserved_sector_count * bs->bytes_per_sector;
+    uint32_t fat_capacity = bs->fat_size_32 * bs->bytes_per_sector / sizeof(uint32_t);
+
+    pthread_once(&fat_lock_once, init_fat_lock);
+    fat_table_free();
+    fat_table.num_entries = fat_data_clusters(bs) + 2;
+    if (fat_table.num_entries > fat_capacity) {
+        fat_table.num_entries = fat_capacity;
+    }
+
+    size_t map_words = (fat_table.num_entries + 63) / 64;
+    fat_table.sector_size = bs->bytes_per_sector;
+    fat_table.num_sectors = (fat_table.num_entries * sizeof(uint32_t) + bs->bytes_per_sector - 1) / bs->bytes_per_sector;
+    fat_table.entries = malloc(fat_table.num_sectors * bs->bytes_per_sector);
+    fat_table.free_map = calloc(map_words, sizeof(uint64_t));
+    fat_table.dirty_entries = calloc(map_words, sizeof(uint64_t));
+    fat_table.dirty_sectors = calloc((fat_table.num_sectors + 63) / 64, sizeof(uint64_t));
+    if (fat_table.entries == NULL || fat_table.free_map == NULL || fat_table.dirty_entries == NULL || fat_table.dirty_sectors == NULL) {
+        fat_table_free();
+        return -1;
+    }
+
+    // Read whole sectors so a flush can write back the tail sector verbatim
+    if (dev_read(dev, fat_start, fat_table.entries, (size_t)fat_table.num_sectors * bs->bytes_per_sector) != 0) {
+        fat_table_free();
+        return -1;
+    }
+
+    fat_table.free_count = 0;
+    for (uint32_t i = 2; i < fat_table.num_entries; i++) {
+        if ((fat_table.entries[i] & FAT_ENTRY_MASK) == 0) {
+            mark_free(i, 1);
+            fat_table.free_count++;
+        }
+    }
+
+    fat_table.totals.copies = (bs->ext_flags & 0x80) ? 1 : bs->num_fats;
+    load_fs_info(dev, bs);
+    return 0;
+}
+
+void fat_table_free(void) {
+    free(fat_table.entries);
+    free(fat_table.free_map);
+    free(fat_table.dirty_entries);
+    free(fat_table.dirty_sectors);
+    memset(&fat_table, 0, sizeof(fat_table));
+}
+
+uint32_t fat_table_get(uint32_t cluster) {
+    if (cluster >= fat_table.num_entries) {
+        return FAT_EOC;
+    }
+    return fat_table.entries[cluster] & FAT_ENTRY_MASK;
+}
+
+static void set_entry(uint32_t cluster, uint32_t value) {
+    if (cluster < 2 || cluster >= fat_table.num_entries) {
+        return;
+    }
+    int was_free = (fat_table.entries[cluster] & FAT_ENTRY_MASK) == 0;
+    int now_free = (value & FAT_ENTRY_MASK) == 0;
+
+    // The top four bits are reserved and must be preserved on write
+    fat_table.entries[cluster] = (fat_table.entries[cluster] & ~FAT_ENTRY_MASK) | (value & FAT_ENTRY_MASK);
+
+    fat_table.pending_updates++;
+    STAT_ADD(fat_entries, 1);
+    if (!test_and_set(fat_table.dirty_entries, cluster)) {
+        fat_table.pending_distinct++;
+    }
+    test_and_set(fat_table.dirty_sectors, cluster * sizeof(uint32_t) / fat_table.sector_size);
+
+    if (was_free && !now_free) {
+        mark_free(cluster, 0);
+        fat_table.free_count--;
+        if (cluster == fat_table.next_free) {
+            fat_table.next_free = cluster + 1;
+        }
+    } else if (!was_free && now_free) {
+        bcache_discard(cluster);
+        mark_free(cluster, 1);
+        fat_table.free_count++;
+    }
+}
+
+void fat_table_set(uint32_t cluster, uint32_t value) {
+    fat_table_lock();
+    set_entry(cluster, value);
+    fat_table_unlock();
+}
+
+// Releases every cluster of the chain starting at FIRST. Only the
+// in-memory table changes; the whole chain reaches the image with the
+// next flush, one write per dirty FAT sector. Returns the clusters freed.
+uint32_t fat_table_free_chain(uint32_t first) {
+    fat_table_lock();
+    uint32_t cluster = first;
+    uint32_t freed = 0;
+
+    while (cluster >= 2 && cluster < fat_table.num_entries && freed < fat_table.num_entries) {
+        uint32_t next = fat_table_get(cluster);
+        if (next == 0) {
+            break;
+        }
+        set_entry(cluster, 0);
+        freed++;
+        cluster = next;
+    }
+    fat_table_unlock();
+    return freed;
+}
+
+// Scan [from, to) of the free bitmap a word at a time
+static uint32_t scan_free(uint32_t from, uint32_t to) {
+    uint32_t word = from >> 6;
+    uint32_t last_word = (to + 63) >> 6;
+    uint64_t bits = fat_table.free_map[word] & (~0ULL << (from & 63));
+
+    while (1) {
+        if (bits != 0) {
+            uint32_t cluster = (word << 6) + (uint32_t)__builtin_ctzll(bits);
+            return cluster < to ? cluster : 0;
+        }
+        if (++word >= last_word) {
+            return 0;
+        }
+        bits = fat_table.free_map[word];
+    }
+}
+
+static uint32_t find_free(void) {
+    if (fat_table.entries == NULL || fat_table.free_count == 0) {
+        return 0;
+    }
+
+    uint32_t hint = fat_table.next_free;
+    if (hint < 2 || hint >= fat_table.num_entries) {
+        hint = 2;
+    }
+
+    uint32_t cluster = scan_free(hint, fat_table.num_entries);
+    if (cluster == 0 && hint > 2) {
+        cluster = scan_free(2, hint);
+    }
+    if (cluster != 0) {
+        fat_table.next_free = cluster;
+    }
+    return cluster;
+}
+
+uint32_t fat_table_find_free(void) {
+    fat_table_lock();
+    uint32_t cluster = find_free();
+    fat_table_unlock();
+    return cluster;
+}
+
+// Write every dirty FAT sector to each FAT copy, sorted by sector number
+// and coalesced into one write per run of adjacent dirty sectors.
+static int flush_table(BlockDevice *dev, FAT32BootSector *bs, FatFlushStats *stats) {
+    FatFlushStats local = {0};
+    int result = 0;
+
+    if (stats == NULL) {
+        stats = &local;
+    }
+    memset(stats, 0, sizeof(*stats));
+    if (fat_table.entries == NULL || fat_table.pending_updates == 0) {
+        return 0;
+    }
+
+    // Bit 7 of ext_flags clear means the FAT is mirrored to all copies,
+    // otherwise only the active FAT in bits 0-3 is in use
+    uint32_t first_copy = 0;
+    uint32_t num_copies = bs->num_fats;
+    if (bs->ext_flags & 0x80) {
+        first_copy = bs->ext_flags & 0x0F;
+        num_copies = 1;
+    }
+
+    uint32_t sector_size = bs->bytes_per_sector;
+    uint8_t *fat_bytes = (uint8_t *)fat_table.entries;
+    uint32_t sector = 0;
+    IoRequest *requests = NULL;
+    size_t num_requests = 0;
+    size_t request_capacity = 0;
+
+    while (sector < fat_table.num_sectors) {
+        if ((fat_table.dirty_sectors[sector >> 6] & (1ULL << (sector & 63))) == 0) {
+            sector++;
+            continue;
+        }
+        uint32_t run_start = sector;
+        while (sector < fat_table.num_sectors && (fat_table.dirty_sectors[sector >> 6] & (1ULL << (sector & 63)))) {
+            sector++;
+        }
+        uint32_t run_length = sector - run_start;
+
+        for (uint32_t copy = first_copy; copy < first_copy + num_copies; copy++) {
+            uint64_t fat_start = ((uint64_t)bs->reserved_sector_count + (uint64_t)copy * bs->fat_size_32) * sector_size;
+            if (num_requests == request_capacity) {
+                request_capacity = request_capacity ? request_capacity * 2 : 16;
+                requests = realloc(requests, request_capacity * sizeof(IoRequest));
+            }
+            requests[num_requests++] = (IoRequest){ 1, fat_start + (uint64_t)run_start * sector_size,
+                                                    fat_bytes + (size_t)run_start * sector_size, (size_t)run_length * sector_size, 0 };
+            stats->writes++;
+        }
+        stats->sectors += run_length;
+    }
+
+    // Every run of every copy goes to the device (or the journal) as one batch
+    if (journal_write(dev, requests, num_requests) != 0) {
+        result = -1;
+    }
+    free(requests);
+
+    stats->updates = fat_table.pending_updates;
+    stats->copies = num_copies;
+    stats->ops_saved = fat_table.pending_updates * num_copies - stats->writes;
+    stats->bytes_saved = (fat_table.pending_updates - fat_table.pending_distinct) * sizeof(uint32_t) * num_copies;
+
+    fat_table.totals.updates += stats->updates;
+    fat_table.totals.sectors += stats->sectors;
+    fat_table.totals.copies = stats->copies;
+    fat_table.totals.writes += stats->writes;
+    fat_table.totals.ops_saved += stats->ops_saved;
+    fat_table.totals.bytes_saved += stats->bytes_saved;
+
+    memset(fat_table.dirty_sectors, 0, (fat_table.num_sectors + 63) / 64 * sizeof(uint64_t));
+    memset(fat_table.dirty_entries, 0, (fat_table.num_entries + 63) / 64 * sizeof(uint64_t));
+    fat_table.pending_updates = 0;
+    fat_table.pending_distinct = 0;
+    return result;
+}
+
+int fat_table_flush(BlockDevice *dev, FAT32BootSector *bs, FatFlushStats *stats) {
+    fat_table_lock();
+    int result = flush_table(dev, bs, stats);
+    fat_table_unlock();
+    return result;
+}
+
+// Counts free clusters starting at START, stopping at LIMIT clusters
+static uint32_t free_run_at(uint32_t start, uint32_t limit) {
+    uint32_t cluster = start;
+    uint32_t end = fat_table.num_entries;
+    if (limit < end - start) {
+        end = start + limit;
+    }
+
+    while (cluster < end) {
+        uint64_t bits = fat_table.free_map[cluster >> 6] >> (cluster & 63);
+        uint32_t available = 64 - (cluster & 63);
+        if (bits == (~0ULL >> (cluster & 63))) {
+            // Rest of this word is free
+            cluster += available;
+            continue;
+        }
+        uint32_t ones = (uint32_t)__builtin_ctzll(~bits);
+        cluster += ones;
+        break;
+    }
+    return (cluster < end ? cluster : end) - start;
+}
+
+// Finds free clusters for COUNT clusters of new data, preferring a run
+// that starts at GOAL (usually just past the file's last cluster), then
+// the first run long enough anywhere on the volume, and otherwise the
+// longest run available. Returns its first cluster and sets LENGTH to
+// how many clusters it holds (at most COUNT), or returns 0 when full.
+static uint32_t find_run(uint32_t count, uint32_t goal, uint32_t *length) {
+    uint32_t best_start = 0;
+    uint32_t best_length = 0;
+
+    *length = 0;
+    if (fat_table.entries == NULL || fat_table.free_count == 0 || count == 0) {
+        return 0;
+    }
+
+    if (goal >= 2 && goal < fat_table.num_entries) {
+        uint32_t run = free_run_at(goal, count);
+        if (run == count) {
+            *length = run;
+            return goal;
+        }
+        best_start = goal;
+        best_length = run;
+    }
+
+    // Search from the next-free hint to the end, then wrap around, so the
+    // allocated part at the start of the volume is not rescanned every time
+    uint32_t hint = fat_table.next_free;
+    if (hint < 2 || hint >= fat_table.num_entries) {
+        hint = 2;
+    }
+    uint32_t ranges[2][2] = { { hint, fat_table.num_entries }, { 2, hint } };
+    for (int r = 0; r < 2; r++) {
+        uint32_t cluster = ranges[r][0];
+        uint32_t end = ranges[r][1];
+        while (cluster < end) {
+            cluster = scan_free(cluster, end);
+            if (cluster == 0) {
+                break;
+            }
+            uint32_t run = free_run_at(cluster, count);
+            if (run == count) {
+                *length = run;
+                return cluster;
+            }
+            if (run > best_length) {
+                best_start = cluster;
+                best_length = run;
+            }
+            cluster += run;
+        }
+    }
+
+    *length = best_length;
+    return best_length ? best_start : 0;
+}
+
+uint32_t fat_table_find_run(uint32_t count, uint32_t goal, uint32_t *length) {
+    fat_table_lock();
+    uint32_t start = find_run(count, goal, length);
+    fat_table_unlock();
+    return start;
+}
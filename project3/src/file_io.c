@@ -0,0 +1,553 @@
+#include "file_io.h"
+#include "fat_table.h"
+#include "dir_index.h"
+#include "path.h"
+#include "handle.h"
+#include "ioengine.h"
+#include "stats.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Two output slots: while the writer thread drains one to the host, the
+// reader fills the other, so device reads overlap with output
+#define READ_SLOTS 2
+
+typedef struct {
+    uint8_t *buffer;       // owned buffer for the pread backend
+    const uint8_t *data;   // data to write: the buffer or a view into the mapping
+    size_t length;
+    int full;
+} ReadSlot;
+
+typedef struct {
+    ReadSlot slots[READ_SLOTS];
+    FILE *out;
+    int done;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ReadPipeline;
+
+static void *output_thread(void *arg) {
+    ReadPipeline *pipe = arg;
+    int next = 0;
+
+    while (1) {
+        pthread_mutex_lock(&pipe->lock);
+        while (!pipe->slots[next].full && !pipe->done) {
+            pthread_cond_wait(&pipe->changed, &pipe->lock);
+        }
+        if (!pipe->slots[next].full) {
+            pthread_mutex_unlock(&pipe->lock);
+            break;
+        }
+        ReadSlot *slot = &pipe->slots[next];
+        pthread_mutex_unlock(&pipe->lock);
+
+        if (fwrite(slot->data, 1, slot->length, pipe->out) != slot->length) {
+            pipe->failed = 1;
+        }
+
+        pthread_mutex_lock(&pipe->lock);
+        slot->full = 0;
+        pthread_cond_broadcast(&pipe->changed);
+        pthread_mutex_unlock(&pipe->lock);
+        next = (next + 1) % READ_SLOTS;
+    }
+    return NULL;
+}
+
+static ReadSlot *acquire_slot(ReadPipeline *pipe, int index) {
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->slots[index].full) {
+        pthread_cond_wait(&pipe->changed, &pipe->lock);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    return &pipe->slots[index];
+}
+
+static void submit_slot(ReadPipeline *pipe, ReadSlot *slot) {
+    pthread_mutex_lock(&pipe->lock);
+    slot->full = 1;
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+// Appends requests covering LENGTH bytes at OFFSET, cut into pieces of
+// IO_SPLIT_BYTES so that one large transfer keeps several requests in
+// flight. REQUESTS grows as needed.
+static void add_split_requests(IoRequest **requests, size_t *count, size_t *capacity, int write, uint64_t offset, uint8_t *buffer, size_t length) {
+    while (length > 0) {
+        size_t piece = length < IO_SPLIT_BYTES ? length : IO_SPLIT_BYTES;
+        if (*count == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 16;
+            *requests = realloc(*requests, *capacity * sizeof(IoRequest));
+        }
+        (*requests)[(*count)++] = (IoRequest){ write, offset, buffer, piece, 0 };
+        offset += piece;
+        buffer += piece;
+        length -= piece;
+    }
+}
+
+static int read_split(BlockDevice *dev, uint64_t offset, uint8_t *buffer, size_t length) {
+    IoRequest *requests = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+
+    add_split_requests(&requests, &count, &capacity, 0, offset, buffer, length);
+    int result = dev_submit(dev, requests, count);
+    free(requests);
+    return result;
+}
+
+// Streams LENGTH bytes of FILE starting at its current offset to OUT.
+// Each chunk covers at most one physically contiguous run, so it costs a
+// single device read (or none with the mmap backend). The chunk size
+// starts at the file's readahead window, which doubles on every
+// sequential chunk up to READ_WINDOW_MAX, and the device is asked to
+// prefetch the next window while the current one is being written out.
+// Returns the number of bytes read.
+static uint32_t stream_file(BlockDevice *dev, FAT32BootSector *bs, OpenFile *file, uint32_t length, FILE *out) {
+    uint32_t csize = cluster_size(bs);
+    uint32_t position = file->offset;
+    uint32_t end = file->offset + length;
+    ReadPipeline pipe;
+    pthread_t writer;
+    int next = 0;
+
+    if (file->offset != file->last_read_end || file->readahead < READ_WINDOW_MIN) {
+        // Random access: start over with a small window
+        file->readahead = READ_WINDOW_MIN;
+    }
+
+    if (length == 0) {
+        return 0;
+    }
+
+    // Small reads inside one cluster are served from the handle's cluster cache
+    uint32_t in_cluster = file->offset % csize;
+    if (dev->map == NULL && in_cluster + length <= csize) {
+        uint32_t cluster;
+        if (open_file_locate(file, bs, file->offset, &cluster, NULL) != 0) {
+            return 0;
+        }
+        if (file->cluster_cache == NULL) {
+            file->cluster_cache = malloc(csize);
+        }
+        if (file->cached_cluster != cluster) {
+            // File data stays out of the metadata block cache
+            if (dev_read(dev, cluster_to_offset(bs, cluster), file->cluster_cache, csize) != 0) {
+                return 0;
+            }
+            STAT_ADD(clusters_read, 1);
+            file->cached_cluster = cluster;
+        }
+        if (fwrite(file->cluster_cache + in_cluster, 1, length, out) != length) {
+            return 0;
+        }
+        file->offset += length;
+        file->last_read_end = file->offset;
+        return length;
+    }
+
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.out = out;
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.changed, NULL);
+    if (dev->map == NULL) {
+        // Double buffers belong to the handle and are kept between reads
+        uint32_t buffer_size = length < READ_WINDOW_MAX ? length : READ_WINDOW_MAX;
+        if (file->io_buffer_size < buffer_size) {
+            for (int i = 0; i < READ_SLOTS; i++) {
+                free(file->io_buffers[i]);
+                file->io_buffers[i] = malloc(buffer_size);
+            }
+            file->io_buffer_size = buffer_size;
+        }
+        for (int i = 0; i < READ_SLOTS; i++) {
+            pipe.slots[i].buffer = file->io_buffers[i];
+        }
+    }
+    pthread_create(&writer, NULL, output_thread, &pipe);
+
+    while (position < end && !pipe.failed) {
+        uint32_t cluster;
+        uint32_t run_remaining;
+        if (open_file_locate(file, bs, position, &cluster, &run_remaining) != 0) {
+            // The cluster chain is shorter than the recorded size
+            break;
+        }
+
+        in_cluster = position % csize;
+        uint64_t run_bytes = (uint64_t)run_remaining * csize - in_cluster;
+        uint32_t chunk = end - position;
+        if (chunk > file->readahead) {
+            chunk = file->readahead;
+        }
+        if (chunk > run_bytes) {
+            chunk = (uint32_t)run_bytes;
+        }
+        uint64_t offset = cluster_to_offset(bs, cluster) + in_cluster;
+
+        ReadSlot *slot = acquire_slot(&pipe, next);
+        const void *view = dev_view(dev, offset, chunk);
+        if (view != NULL) {
+            slot->data = view;
+        } else if (slot->buffer != NULL && read_split(dev, offset, slot->buffer, chunk) == 0) {
+            slot->data = slot->buffer;
+        } else {
+            break;
+        }
+        slot->length = chunk;
+        STAT_ADD(clusters_read, (in_cluster + chunk + cluster_size(bs) - 1) / cluster_size(bs));
+        submit_slot(&pipe, slot);
+        next = (next + 1) % READ_SLOTS;
+        position += chunk;
+
+        // Sequential access: widen the window and start fetching the next one
+        if (file->readahead < READ_WINDOW_MAX) {
+            file->readahead *= 2;
+        }
+        uint32_t next_cluster;
+        uint32_t next_run;
+        if (position < end && open_file_locate(file, bs, position, &next_cluster, &next_run) == 0) {
+            uint64_t ahead = (uint64_t)next_run * csize - position % csize;
+            if (ahead > file->readahead) {
+                ahead = file->readahead;
+            }
+            dev_prefetch(dev, cluster_to_offset(bs, next_cluster) + position % csize, ahead);
+        }
+    }
+
+    pthread_mutex_lock(&pipe.lock);
+    pipe.done = 1;
+    pthread_cond_broadcast(&pipe.changed);
+    pthread_mutex_unlock(&pipe.lock);
+    pthread_join(writer, NULL);
+
+    pthread_mutex_destroy(&pipe.lock);
+    pthread_cond_destroy(&pipe.changed);
+
+    file->offset = position;
+    file->last_read_end = position;
+    return position - (end - length);
+}
+
+void handle_read_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *filename, const char *size, const char *host_path) {
+    OpenFile *file = find_open_file(dev, bs, current_cluster, filename);
+    if (file == NULL) {
+        fprintf(shell_out, "Error: File '%s' is not open or does not exist.\n", filename);
+        return;
+    }
+    if (strchr(file->mode, 'r') == NULL) {
+        fprintf(shell_out, "Error: File '%s' is not opened for reading.\n", filename);
+        return;
+    }
+
+    // Reads must see data still sitting in the write buffer
+    if (file_flush(dev, bs, file) != 0) {
+        fprintf(shell_out, "Error: Failed to write buffered data for '%s'.\n", filename);
+        return;
+    }
+
+    char *end;
+    unsigned long requested = strtoul(size, &end, 10);
+    if (*size == '\0' || *end != '\0' || size[0] == '-') {
+        fprintf(shell_out, "Error: Invalid size '%s'.\n", size);
+        return;
+    }
+
+    // Stop at the end of the file
+    uint32_t length = file->offset < file->size ? file->size - file->offset : 0;
+    if (requested < length) {
+        length = (uint32_t)requested;
+    }
+
+    FILE *out = shell_out;
+    if (host_path != NULL) {
+        out = fopen(host_path, "wb");
+        if (out == NULL) {
+            fprintf(shell_out, "Error: Unable to open '%s' for writing.\n", host_path);
+            return;
+        }
+    }
+
+    fflush(shell_out);
+    uint32_t copied = stream_file(dev, bs, file, length, out);
+
+    if (host_path != NULL) {
+        fclose(out);
+        fprintf(shell_out, "Read %u bytes from '%s' into '%s'.\n", copied, filename, host_path);
+    } else {
+        fprintf(shell_out, "\n");
+    }
+    if (copied < length) {
+        fprintf(shell_out, "Error: Only %u of %u bytes could be read from '%s'.\n", copied, length, filename);
+    }
+}
+
+// Grows the file's cluster chain by COUNT clusters, taking the longest
+// contiguous free runs available and preferring the clusters right
+// after the current end of the chain. Returns 0 on success.
+static int allocate_clusters(BlockDevice *dev, FAT32BootSector *bs, OpenFile *file, uint32_t count) {
+    uint32_t last = 0;
+
+    if (file->cluster != 0) {
+        if ((!file->extents.valid && extent_map_build(&file->extents) != 0) || file->extents.num_runs == 0) {
+            return -1;
+        }
+        const Extent *tail = &file->extents.runs[file->extents.num_runs - 1];
+        last = tail->cluster + tail->length - 1;
+    }
+
+    uint32_t goal = last ? last + 1 : fat_table.next_free;
+    while (count > 0) {
+        uint32_t length;
+        fat_table_lock();
+        uint32_t start = fat_table_find_run(count, goal, &length);
+        if (start == 0) {
+            fat_table_unlock();
+            return -1;
+        }
+
+        for (uint32_t i = 0; i < length; i++) {
+            write_fat_entry(dev, bs, start + i, i + 1 < length ? start + i + 1 : 0xFFFFFFFF);
+        }
+        if (last != 0) {
+            write_fat_entry(dev, bs, last, start);
+        } else {
+            file->cluster = start;
+        }
+        fat_table_unlock();
+
+        last = start + length - 1;
+        count -= length;
+        goal = last + 1;
+    }
+
+    extent_map_free(&file->extents);
+    extent_map_init(&file->extents, file->cluster);
+    return 0;
+}
+
+// Ensures the chain holds enough clusters for SIZE bytes
+int file_preallocate(BlockDevice *dev, FAT32BootSector *bs, OpenFile *file, uint32_t size) {
+    uint32_t csize = cluster_size(bs);
+    uint32_t need = (uint32_t)(((uint64_t)size + csize - 1) / csize);
+    uint32_t have = 0;
+
+    if (file->cluster != 0) {
+        if (!file->extents.valid && extent_map_build(&file->extents) != 0) {
+            return -1;
+        }
+        have = file->extents.total_clusters;
+    }
+    if (need <= have) {
+        return 0;
+    }
+    return allocate_clusters(dev, bs, file, need - have);
+}
+
+// Writes the buffered range to the image. Clusters are only allocated
+// here, once the full extent of the write is known, so a file written
+// in many pieces still ends up in one contiguous run where possible.
+int file_flush(BlockDevice *dev, FAT32BootSector *bs, OpenFile *file) {
+    if (file->write_length == 0) {
+        return 0;
+    }
+
+    uint32_t first_cluster = file->cluster;
+    file->cached_cluster = 0;
+    uint32_t end = file->write_start + file->write_length;
+    if (file_preallocate(dev, bs, file, end) != 0) {
+        return -1;
+    }
+
+    // Every physically contiguous run of the range is queued, then the
+    // whole set goes to the device as one batch
+    IoRequest *requests = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    uint32_t position = file->write_start;
+    while (position < end) {
+        uint32_t cluster;
+        uint32_t run_remaining;
+        if (open_file_locate(file, bs, position, &cluster, &run_remaining) != 0) {
+            free(requests);
+            return -1;
+        }
+
+        uint32_t in_cluster = position % cluster_size(bs);
+        uint64_t run_bytes = (uint64_t)run_remaining * cluster_size(bs) - in_cluster;
+        uint32_t chunk = end - position;
+        if (chunk > run_bytes) {
+            chunk = (uint32_t)run_bytes;
+        }
+        add_split_requests(&requests, &count, &capacity, 1, cluster_to_offset(bs, cluster) + in_cluster,
+                           file->write_buffer + (position - file->write_start), chunk);
+        STAT_ADD(clusters_written, (in_cluster + chunk + cluster_size(bs) - 1) / cluster_size(bs));
+        position += chunk;
+    }
+    int written = dev_submit(dev, requests, count);
+    free(requests);
+    if (written != 0) {
+        return -1;
+    }
+    file->write_length = 0;
+
+    // Record the new size and first cluster in the directory entry
+    const DirIndexEntry *found = dir_index_lookup(dir_index_get(dev, bs, file->dir_cluster), file->short_name);
+    if (found == NULL) {
+        return -1;
+    }
+    DirectoryEntry entry = found->entry;
+    entry.filesize = file->size;
+    entry.firstclusthi = (file->cluster >> 16) & 0xFFFF;
+    entry.firstclustlo = file->cluster & 0xFFFF;
+    if (first_cluster != file->cluster) {
+        dcache_invalidate(file->dir_cluster, file->short_name);
+    }
+    return dir_update_entry(dev, bs, file->dir_cluster, &entry);
+}
+
+// Buffers LENGTH bytes at the file's offset and advances it. The buffer
+// is flushed first when the new data does not directly follow it or
+// would push it past WRITE_BUFFER_MAX.
+int file_write(BlockDevice *dev, FAT32BootSector *bs, OpenFile *file, const void *data, uint32_t length) {
+    if (file->write_length > 0 &&
+        (file->offset != file->write_start + file->write_length || file->write_length + length > WRITE_BUFFER_MAX)) {
+        if (file_flush(dev, bs, file) != 0) {
+            return -1;
+        }
+    }
+    if ((uint64_t)file->offset + length > UINT32_MAX) {
+        // FAT32 files are limited to 4 GiB - 1
+        return -1;
+    }
+
+    if (file->write_length == 0) {
+        file->write_start = file->offset;
+    }
+    if (file->write_length + length > file->write_capacity) {
+        uint32_t capacity = file->write_capacity ? file->write_capacity : 4096;
+        while (capacity < file->write_length + length) {
+            capacity *= 2;
+        }
+        uint8_t *buffer = realloc(file->write_buffer, capacity);
+        if (buffer == NULL) {
+            return -1;
+        }
+        file->write_buffer = buffer;
+        file->write_capacity = capacity;
+    }
+
+    memcpy(file->write_buffer + file->write_length, data, length);
+    file->write_length += length;
+    file->offset += length;
+    if (file->offset > file->size) {
+        file->size = file->offset;
+    }
+    return 0;
+}
+
+void flush_open_files(BlockDevice *dev, FAT32BootSector *bs) {
+    for (int fd = 0; fd < handle_table.capacity; fd++) {
+        OpenFile *file = handle_get(fd);
+        if (file != NULL && file_flush(dev, bs, file) != 0) {
+            fprintf(shell_out, "Error: Failed to write buffered data for '%s'.\n", file->filename);
+        }
+    }
+}
+
+void handle_write_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *filename, const char *text) {
+    OpenFile *file = find_open_file(dev, bs, current_cluster, filename);
+    if (file == NULL) {
+        fprintf(shell_out, "Error: File '%s' is not open or does not exist.\n", filename);
+        return;
+    }
+    if (strchr(file->mode, 'w') == NULL) {
+        fprintf(shell_out, "Error: File '%s' is not opened for writing.\n", filename);
+        return;
+    }
+
+    uint32_t length = (uint32_t)strlen(text);
+    if (file_write(dev, bs, file, text, length) != 0) {
+        fprintf(shell_out, "Error: Failed to write to '%s'.\n", filename);
+        return;
+    }
+    fprintf(shell_out, "Wrote %u bytes to '%s'.\n", length, filename);
+}
+
+// Copies a host file into a new file in the current directory. The host
+// size is known up front, so the whole chain is reserved as one
+// contiguous run before any data is written.
+void handle_import_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *host_path) {
+    const char *filename = strrchr(host_path, '/');
+    filename = filename ? filename + 1 : host_path;
+
+    FILE *in = fopen(host_path, "rb");
+    if (in == NULL) {
+        fprintf(shell_out, "Error: Unable to open '%s' for reading.\n", host_path);
+        return;
+    }
+    fseek(in, 0, SEEK_END);
+    long host_size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    if (host_size < 0 || (unsigned long)host_size > UINT32_MAX) {
+        fprintf(shell_out, "Error: '%s' is too large for a FAT32 file.\n", host_path);
+        fclose(in);
+        return;
+    }
+
+    DirectoryEntry entry;
+    if (create_file(dev, bs, current_cluster, filename, &entry) != 0) {
+        fclose(in);
+        return;
+    }
+
+    OpenFile file;
+    memset(&file, 0, sizeof(file));
+    snprintf(file.filename, sizeof(file.filename), "%s", filename);
+    strcpy(file.mode, "w");
+    file.dir_cluster = current_cluster;
+    memcpy(file.short_name, entry.name, 11);
+    extent_map_init(&file.extents, 0);
+
+    const char *failure = NULL;
+    if (file_preallocate(dev, bs, &file, (uint32_t)host_size) != 0) {
+        failure = "Not enough space to import";
+    }
+    uint8_t *chunk = malloc(WRITE_BUFFER_MAX);
+    size_t n;
+    while (failure == NULL && (n = fread(chunk, 1, WRITE_BUFFER_MAX, in)) > 0) {
+        if (file_write(dev, bs, &file, chunk, (uint32_t)n) != 0) {
+            failure = "Failed to write the image while importing";
+        }
+    }
+    if (failure == NULL && ferror(in)) {
+        failure = "Unable to read";
+    }
+    if (failure == NULL && file_flush(dev, bs, &file) != 0) {
+        failure = "Failed to write the image while importing";
+    }
+    free(chunk);
+    free(file.write_buffer);
+    extent_map_free(&file.extents);
+    fclose(in);
+
+    if (failure != NULL) {
+        // Nothing of the half-made file stays behind: the entry goes
+        // first, then whatever part of the chain had been allocated
+        dir_remove_entry(dev, bs, current_cluster, entry.name);
+        dcache_invalidate(current_cluster, entry.name);
+        if (file.cluster != 0) {
+            fat_table_free_chain(file.cluster);
+        }
+        fprintf(shell_out, "Error: %s '%s'.\n", failure, host_path);
+        return;
+    }
+    fprintf(shell_out, "Imported %u bytes from '%s' as '%s'.\n", file.size, host_path, filename);
+}
@@ -0,0 +1,227 @@
+#include "handle.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+__thread HandleTable handle_table = { NULL, NULL, 0, -1, 0, NULL, 0 };
+
+// Directory entries open in any session, as (cluster << 32 | position)
+// keys in an open-addressing set. 0 marks an empty cell; directory
+// clusters start at 2, so no real key is 0.
+static struct {
+    uint64_t *keys;
+    uint32_t capacity;     // power of two
+    uint32_t count;
+} registry;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_key(uint32_t dir_cluster, uint32_t entry_position) {
+    uint64_t key = ((uint64_t)dir_cluster << 32) | entry_position;
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(key >> 32);
+}
+
+static int bucket_of(uint32_t dir_cluster, uint32_t entry_position) {
+    int mask = handle_table.num_buckets - 1;
+    int i = hash_key(dir_cluster, entry_position) & mask;
+    while (handle_table.buckets[i] != -1) {
+        OpenFile *file = handle_table.files[handle_table.buckets[i]];
+        if (file->dir_cluster == dir_cluster && file->entry_position == entry_position) {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void rehash(int num_buckets) {
+    free(handle_table.buckets);
+    handle_table.num_buckets = num_buckets;
+    handle_table.buckets = malloc(num_buckets * sizeof(int));
+    memset(handle_table.buckets, 0xFF, num_buckets * sizeof(int));
+
+    for (int fd = 0; fd < handle_table.capacity; fd++) {
+        OpenFile *file = handle_table.files[fd];
+        if (file != NULL) {
+            handle_table.buckets[bucket_of(file->dir_cluster, file->entry_position)] = fd;
+        }
+    }
+}
+
+static void grow(void) {
+    int old_capacity = handle_table.capacity;
+    int capacity = old_capacity ? old_capacity * 2 : 16;
+
+    handle_table.files = realloc(handle_table.files, capacity * sizeof(OpenFile *));
+    handle_table.next_free = realloc(handle_table.next_free, capacity * sizeof(int));
+    for (int fd = capacity - 1; fd >= old_capacity; fd--) {
+        handle_table.files[fd] = NULL;
+        handle_table.next_free[fd] = handle_table.free_head;
+        handle_table.free_head = fd;
+    }
+    handle_table.capacity = capacity;
+
+    // Keep the hash at most half full
+    rehash(capacity * 2);
+}
+
+static uint32_t registry_cell(uint64_t key) {
+    uint32_t mask = registry.capacity - 1;
+    uint32_t i = hash_key((uint32_t)(key >> 32), (uint32_t)key) & mask;
+    while (registry.keys[i] != 0 && registry.keys[i] != key) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Adds KEY unless it is already there. Returns 0 if it was added.
+static int registry_add(uint64_t key) {
+    if ((registry.count + 1) * 2 > registry.capacity) {
+        uint64_t *old_keys = registry.keys;
+        uint32_t old_capacity = registry.capacity;
+        registry.capacity = old_capacity ? old_capacity * 2 : 64;
+        registry.keys = calloc(registry.capacity, sizeof(uint64_t));
+        for (uint32_t i = 0; i < old_capacity; i++) {
+            if (old_keys[i] != 0) {
+                registry.keys[registry_cell(old_keys[i])] = old_keys[i];
+            }
+        }
+        free(old_keys);
+    }
+    uint32_t i = registry_cell(key);
+    if (registry.keys[i] == key) {
+        return -1;
+    }
+    registry.keys[i] = key;
+    registry.count++;
+    return 0;
+}
+
+static void registry_remove(uint64_t key) {
+    uint32_t mask = registry.capacity - 1;
+    uint32_t i = registry_cell(key);
+    if (registry.keys[i] != key) {
+        return;
+    }
+    registry.keys[i] = 0;
+    for (uint32_t j = (i + 1) & mask; registry.keys[j] != 0; j = (j + 1) & mask) {
+        uint32_t home = hash_key((uint32_t)(registry.keys[j] >> 32), (uint32_t)registry.keys[j]) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            registry.keys[i] = registry.keys[j];
+            registry.keys[j] = 0;
+            i = j;
+        }
+    }
+    registry.count--;
+}
+
+// Whether any session has the file behind this directory entry open
+int handle_in_use(uint32_t dir_cluster, uint32_t entry_position) {
+    uint64_t key = ((uint64_t)dir_cluster << 32) | entry_position;
+    pthread_mutex_lock(&registry_lock);
+    int in_use = registry.count > 0 && registry.keys[registry_cell(key)] == key;
+    pthread_mutex_unlock(&registry_lock);
+    return in_use;
+}
+
+// Whether any session has a file of this directory open
+int handle_dir_in_use(uint32_t dir_cluster) {
+    int in_use = 0;
+    pthread_mutex_lock(&registry_lock);
+    for (uint32_t i = 0; i < registry.capacity && !in_use; i++) {
+        in_use = registry.keys[i] != 0 && (uint32_t)(registry.keys[i] >> 32) == dir_cluster;
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return in_use;
+}
+
+// Allocates a descriptor for the file behind the given directory entry,
+// or returns NULL if some session already has it open. The caller fills
+// in the rest of the returned OpenFile.
+OpenFile *handle_alloc(uint32_t dir_cluster, uint32_t entry_position) {
+    pthread_mutex_lock(&registry_lock);
+    int added = registry_add(((uint64_t)dir_cluster << 32) | entry_position) == 0;
+    pthread_mutex_unlock(&registry_lock);
+    if (!added) {
+        return NULL;
+    }
+
+    if (handle_table.free_head == -1) {
+        grow();
+    }
+
+    int fd = handle_table.free_head;
+    handle_table.free_head = handle_table.next_free[fd];
+
+    OpenFile *file = calloc(1, sizeof(OpenFile));
+    file->fd = fd;
+    file->dir_cluster = dir_cluster;
+    file->entry_position = entry_position;
+    handle_table.files[fd] = file;
+    handle_table.buckets[bucket_of(dir_cluster, entry_position)] = fd;
+    handle_table.count++;
+    return file;
+}
+
+OpenFile *handle_lookup(uint32_t dir_cluster, uint32_t entry_position) {
+    if (handle_table.count == 0) {
+        return NULL;
+    }
+    int fd = handle_table.buckets[bucket_of(dir_cluster, entry_position)];
+    return fd == -1 ? NULL : handle_table.files[fd];
+}
+
+OpenFile *handle_get(int fd) {
+    if (fd < 0 || fd >= handle_table.capacity) {
+        return NULL;
+    }
+    return handle_table.files[fd];
+}
+
+// Frees the descriptor and everything the handle owns
+void handle_release(OpenFile *file) {
+    pthread_mutex_lock(&registry_lock);
+    registry_remove(((uint64_t)file->dir_cluster << 32) | file->entry_position);
+    pthread_mutex_unlock(&registry_lock);
+
+    int mask = handle_table.num_buckets - 1;
+    int i = bucket_of(file->dir_cluster, file->entry_position);
+
+    // Backward-shift deletion keeps probe sequences intact without tombstones
+    handle_table.buckets[i] = -1;
+    for (int j = (i + 1) & mask; handle_table.buckets[j] != -1; j = (j + 1) & mask) {
+        OpenFile *other = handle_table.files[handle_table.buckets[j]];
+        int home = hash_key(other->dir_cluster, other->entry_position) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            handle_table.buckets[i] = handle_table.buckets[j];
+            handle_table.buckets[j] = -1;
+            i = j;
+        }
+    }
+
+    handle_table.files[file->fd] = NULL;
+    handle_table.next_free[file->fd] = handle_table.free_head;
+    handle_table.free_head = file->fd;
+    handle_table.count--;
+
+    free(file->write_buffer);
+    free(file->io_buffers[0]);
+    free(file->io_buffers[1]);
+    free(file->cluster_cache);
+    free(file->path);
+    extent_map_free(&file->extents);
+    free(file);
+}
+
+void handle_table_free(void) {
+    for (int fd = 0; fd < handle_table.capacity; fd++) {
+        if (handle_table.files[fd] != NULL) {
+            handle_release(handle_table.files[fd]);
+        }
+    }
+    free(handle_table.files);
+    free(handle_table.next_free);
+    free(handle_table.buckets);
+    memset(&handle_table, 0, sizeof(handle_table));
+    handle_table.free_head = -1;
+}
@@ -0,0 +1,434 @@
+#include "ioengine.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Asynchronous submission of cluster reads and writes for the pread
+// backend. A batch is handed over in one call and every request of it
+// is in flight at once (up to the queue depth); the call returns when
+// all of them have completed. io_uring is driven through the raw system
+// calls, so no liburing is needed; kernels without it get a pool of
+// pread/pwrite workers instead.
+
+typedef struct IoBatch {
+    IoRequest *requests;
+    size_t count;
+    size_t next;          // first request not yet taken by a worker
+    size_t remaining;     // requests not yet completed
+    int failed;
+    struct IoBatch *next_batch;
+} IoBatch;
+
+struct IoEngine {
+    IoEngineKind kind;
+    int fd;
+    pthread_mutex_t lock;
+
+    // io_uring
+    int ring_fd;
+    unsigned depth;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Thread pool
+    pthread_t threads[IO_THREADS];
+    unsigned num_threads;
+    IoBatch *queue_head;
+    IoBatch *queue_tail;
+    int stopping;
+    pthread_cond_t work;
+    pthread_cond_t finished;
+};
+
+// Completes a request (or the rest of one) with blocking positioned I/O
+static int transfer_sync(int fd, IoRequest *request, size_t done) {
+    uint8_t *buffer = (uint8_t *)request->buffer + done;
+    uint64_t offset = request->offset + done;
+    size_t length = request->length - done;
+
+    while (length > 0) {
+        ssize_t n = request->write ? pwrite(fd, buffer, length, (off_t)offset) : pread(fd, buffer, length, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buffer += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// io_uring
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void uring_unmap(IoEngine *engine) {
+    if (engine->sqes != NULL && engine->sqes != MAP_FAILED) {
+        munmap(engine->sqes, engine->depth * sizeof(struct io_uring_sqe));
+    }
+    if (engine->cq_ring != NULL && engine->cq_ring != MAP_FAILED && engine->cq_ring != engine->sq_ring) {
+        munmap(engine->cq_ring, engine->cq_ring_size);
+    }
+    if (engine->sq_ring != NULL && engine->sq_ring != MAP_FAILED) {
+        munmap(engine->sq_ring, engine->sq_ring_size);
+    }
+    close(engine->ring_fd);
+}
+
+static int uring_init(IoEngine *engine) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    engine->ring_fd = uring_setup(IO_QUEUE_DEPTH, &params);
+    if (engine->ring_fd < 0) {
+        return -1;
+    }
+    // IORING_OP_READ and IORING_OP_WRITE arrived in the same release as
+    // this feature flag
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(engine->ring_fd);
+        return -1;
+    }
+    engine->depth = params.sq_entries;
+
+    engine->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    engine->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (engine->cq_ring_size > engine->sq_ring_size) {
+            engine->sq_ring_size = engine->cq_ring_size;
+        }
+    }
+    engine->sq_ring = mmap(NULL, engine->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           engine->ring_fd, IORING_OFF_SQ_RING);
+    if (engine->sq_ring == MAP_FAILED) {
+        uring_unmap(engine);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        engine->cq_ring = engine->sq_ring;
+    } else {
+        engine->cq_ring = mmap(NULL, engine->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               engine->ring_fd, IORING_OFF_CQ_RING);
+        if (engine->cq_ring == MAP_FAILED) {
+            uring_unmap(engine);
+            return -1;
+        }
+    }
+    engine->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, engine->ring_fd, IORING_OFF_SQES);
+    if (engine->sqes == MAP_FAILED) {
+        uring_unmap(engine);
+        return -1;
+    }
+
+    uint8_t *sq = engine->sq_ring;
+    uint8_t *cq = engine->cq_ring;
+    engine->sq_head = (unsigned *)(sq + params.sq_off.head);
+    engine->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    engine->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    engine->sq_array = (unsigned *)(sq + params.sq_off.array);
+    engine->cq_head = (unsigned *)(cq + params.cq_off.head);
+    engine->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    engine->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    engine->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_queue(IoEngine *engine, IoRequest *request, size_t index) {
+    unsigned tail = *engine->sq_tail;
+    unsigned slot = tail & *engine->sq_mask;
+    struct io_uring_sqe *sqe = &engine->sqes[slot];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = engine->fd;
+    sqe->addr = (uint64_t)(uintptr_t)request->buffer;
+    sqe->len = (uint32_t)request->length;
+    sqe->off = request->offset;
+    sqe->user_data = index;
+    engine->sq_array[slot] = slot;
+    __atomic_store_n(engine->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Takes every completion the ring holds and records its result on the
+// request it belongs to. Returns how many there were.
+static unsigned uring_reap(IoEngine *engine, IoRequest *requests) {
+    unsigned head = *engine->cq_head;
+    unsigned tail = __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned reaped = 0;
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &engine->cqes[head & *engine->cq_mask];
+        IoRequest *request = &requests[cqe->user_data];
+        if (cqe->res < 0) {
+            // Old kernels reject the opcode; anything else is a real error
+            request->result = (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) ? transfer_sync(engine->fd, request, 0) : -1;
+        } else if ((size_t)cqe->res < request->length) {
+            // Short transfer: finish the rest in place
+            request->result = cqe->res == 0 ? -1 : transfer_sync(engine->fd, request, (size_t)cqe->res);
+        } else {
+            request->result = 0;
+        }
+        head++;
+        reaped++;
+    }
+    __atomic_store_n(engine->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+// Queued requests carry a result of 1 until their completion arrives
+#define URING_PENDING 1
+
+static int uring_submit(IoEngine *engine, IoRequest *requests, size_t count) {
+    size_t next = 0;
+    size_t completed = 0;
+    unsigned in_flight = 0;
+    unsigned queued = 0;
+    int result = 0;
+
+    pthread_mutex_lock(&engine->lock);
+    while (completed < count) {
+        while (next < count && in_flight < engine->depth) {
+            requests[next].result = URING_PENDING;
+            uring_queue(engine, &requests[next], next);
+            next++;
+            in_flight++;
+            queued++;
+        }
+
+        // Submits whatever is queued and waits for at least one completion.
+        // to_submit is an upper bound, so retrying after a signal is safe.
+        int entered = uring_enter(engine->ring_fd, queued, 1, IORING_ENTER_GETEVENTS);
+        if (entered < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        queued -= (unsigned)entered < queued ? (unsigned)entered : queued;
+
+        unsigned reaped = uring_reap(engine, requests);
+        in_flight -= reaped;
+        completed += reaped;
+    }
+
+    if (completed < count) {
+        // The ring failed outright. Entries it never took are withdrawn,
+        // so a later call cannot submit them into buffers that are gone.
+        unsigned sq_head = __atomic_load_n(engine->sq_head, __ATOMIC_ACQUIRE);
+        in_flight -= *engine->sq_tail - sq_head;
+        __atomic_store_n(engine->sq_tail, sq_head, __ATOMIC_RELEASE);
+
+        // The kernel still owns the buffers of everything it took, so
+        // wait for all of those to complete before returning
+        while (in_flight > 0) {
+            unsigned reaped = uring_reap(engine, requests);
+            in_flight -= reaped;
+            if (reaped == 0 && uring_enter(engine->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                sched_yield();
+            }
+        }
+
+        // Then the rest, including the withdrawn entries, is done without
+        // the ring
+        for (size_t i = 0; i < count; i++) {
+            if (i >= next || requests[i].result == URING_PENDING) {
+                requests[i].result = transfer_sync(engine->fd, &requests[i], 0);
+            }
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (requests[i].result != 0) {
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&engine->lock);
+    return result;
+}
+
+// Thread pool: batches queue up in order and idle workers take their
+// requests one at a time, so a batch of N requests keeps up to
+// IO_THREADS of them in flight
+
+static void *io_worker(void *arg) {
+    IoEngine *engine = arg;
+
+    pthread_mutex_lock(&engine->lock);
+    while (1) {
+        while (engine->queue_head == NULL && !engine->stopping) {
+            pthread_cond_wait(&engine->work, &engine->lock);
+        }
+        if (engine->queue_head == NULL) {
+            break;
+        }
+        IoBatch *batch = engine->queue_head;
+        IoRequest *request = &batch->requests[batch->next++];
+        if (batch->next == batch->count) {
+            engine->queue_head = batch->next_batch;
+            if (engine->queue_head == NULL) {
+                engine->queue_tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&engine->lock);
+
+        request->result = transfer_sync(engine->fd, request, 0);
+
+        pthread_mutex_lock(&engine->lock);
+        if (request->result != 0) {
+            batch->failed = 1;
+        }
+        if (--batch->remaining == 0) {
+            pthread_cond_broadcast(&engine->finished);
+        }
+    }
+    pthread_mutex_unlock(&engine->lock);
+    return NULL;
+}
+
+static int pool_init(IoEngine *engine) {
+    pthread_cond_init(&engine->work, NULL);
+    pthread_cond_init(&engine->finished, NULL);
+    for (unsigned i = 0; i < IO_THREADS; i++) {
+        if (pthread_create(&engine->threads[i], NULL, io_worker, engine) != 0) {
+            break;
+        }
+        engine->num_threads++;
+    }
+    return engine->num_threads > 0 ? 0 : -1;
+}
+
+static int pool_submit(IoEngine *engine, IoRequest *requests, size_t count) {
+    IoBatch batch = { requests, count, 0, count, 0, NULL };
+
+    pthread_mutex_lock(&engine->lock);
+    if (engine->queue_tail != NULL) {
+        engine->queue_tail->next_batch = &batch;
+    } else {
+        engine->queue_head = &batch;
+    }
+    engine->queue_tail = &batch;
+    pthread_cond_broadcast(&engine->work);
+    while (batch.remaining > 0) {
+        pthread_cond_wait(&engine->finished, &engine->lock);
+    }
+    pthread_mutex_unlock(&engine->lock);
+    return batch.failed ? -1 : 0;
+}
+
+static void pool_stop(IoEngine *engine) {
+    pthread_mutex_lock(&engine->lock);
+    engine->stopping = 1;
+    pthread_cond_broadcast(&engine->work);
+    pthread_mutex_unlock(&engine->lock);
+    for (unsigned i = 0; i < engine->num_threads; i++) {
+        pthread_join(engine->threads[i], NULL);
+    }
+    pthread_cond_destroy(&engine->work);
+    pthread_cond_destroy(&engine->finished);
+}
+
+// Creates an engine for FD. IO_ENGINE_AUTO tries io_uring and falls back
+// to the thread pool. Returns NULL for IO_ENGINE_SYNC or if neither
+// could be set up, in which case batches run inline.
+IoEngine *io_engine_create(int fd, IoEngineKind kind) {
+    if (kind == IO_ENGINE_SYNC) {
+        return NULL;
+    }
+
+    IoEngine *engine = calloc(1, sizeof(IoEngine));
+    engine->fd = fd;
+    engine->ring_fd = -1;
+    pthread_mutex_init(&engine->lock, NULL);
+
+    if ((kind == IO_ENGINE_AUTO || kind == IO_ENGINE_URING) && uring_init(engine) == 0) {
+        engine->kind = IO_ENGINE_URING;
+        return engine;
+    }
+    if (pool_init(engine) == 0) {
+        engine->kind = IO_ENGINE_THREADS;
+        return engine;
+    }
+    pthread_mutex_destroy(&engine->lock);
+    free(engine);
+    return NULL;
+}
+
+void io_engine_destroy(IoEngine *engine) {
+    if (engine == NULL) {
+        return;
+    }
+    if (engine->kind == IO_ENGINE_URING) {
+        uring_unmap(engine);
+    } else {
+        pool_stop(engine);
+    }
+    pthread_mutex_destroy(&engine->lock);
+    free(engine);
+}
+
+const char *io_engine_name(const IoEngine *engine) {
+    if (engine == NULL) {
+        return "sync";
+    }
+    return engine->kind == IO_ENGINE_URING ? "io_uring" : "threads";
+}
+
+// Requests a batch can have in flight at once
+unsigned io_engine_depth(const IoEngine *engine) {
+    if (engine == NULL) {
+        return 1;
+    }
+    return engine->kind == IO_ENGINE_URING ? engine->depth : engine->num_threads;
+}
+
+// Runs every request of the batch and waits for all of them. Each
+// request gets its own result; returns -1 if any of them failed.
+int io_engine_submit(IoEngine *engine, IoRequest *requests, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    if (engine->kind == IO_ENGINE_URING) {
+        return uring_submit(engine, requests, count);
+    }
+    return pool_submit(engine, requests, count);
+}
+
+int io_engine_parse(const char *name, IoEngineKind *kind) {
+    if (strcmp(name, "auto") == 0) {
+        *kind = IO_ENGINE_AUTO;
+    } else if (strcmp(name, "uring") == 0) {
+        *kind = IO_ENGINE_URING;
+    } else if (strcmp(name, "threads") == 0) {
+        *kind = IO_ENGINE_THREADS;
+    } else if (strcmp(name, "sync") == 0) {
+        *kind = IO_ENGINE_SYNC;
+    } else {
+        return -1;
+    }
+    return 0;
+}
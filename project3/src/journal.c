@@ -0,0 +1,484 @@
+#include "journal.h"
+#include "bcache.h"
+#include "fat_table.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FNV_BASIS 2166136261u
+
+Journal journal = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint32_t checksum(uint32_t hash, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int transfer(int fd, int write, uint64_t offset, void *buffer, size_t length) {
+    uint8_t *data = buffer;
+    while (length > 0) {
+        ssize_t n = write ? pwrite(fd, data, length, (off_t)offset) : pread(fd, data, length, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Bytes of data a record carries
+static uint32_t record_bytes(const JournalRecord *record) {
+    return record->length & JOURNAL_REVOKE ? 0 : record->length;
+}
+
+// Adds OP to a comma-separated list of operations unless it is already
+// there or the list is full
+static void add_op(char *ops, const char *op) {
+    size_t used = strlen(ops);
+    size_t length = strlen(op);
+    for (const char *at = ops; (at = strstr(at, op)) != NULL; at += length) {
+        if ((at == ops || at[-1] == ',') && (at[length] == ',' || at[length] == '\0')) {
+            return;
+        }
+    }
+    if (used + length + 2 > JOURNAL_OPS_BYTES) {
+        return;
+    }
+    if (used > 0) {
+        ops[used++] = ',';
+    }
+    memcpy(ops + used, op, length + 1);
+}
+
+// Reads the transaction at OFFSET into *HEADER and a malloc'd *BODY.
+// Returns -1 if it is torn, corrupt or out of sequence.
+static int read_transaction(int fd, uint64_t size, uint64_t offset, uint64_t sequence, JournalHeader *header, uint8_t **body) {
+    JournalCommit commit;
+    if (size - offset < sizeof(*header) + sizeof(commit) || transfer(fd, 0, offset, header, sizeof(*header)) != 0 ||
+        header->magic != JOURNAL_MAGIC || header->length > size - offset - sizeof(*header) - sizeof(commit) ||
+        header->num_records > header->length / sizeof(JournalRecord) || (offset > 0 && header->sequence != sequence)) {
+        return -1;
+    }
+    *body = malloc(header->length ? header->length : 1);
+    if (transfer(fd, 0, offset + sizeof(*header), *body, header->length) != 0 ||
+        transfer(fd, 0, offset + sizeof(*header) + header->length, &commit, sizeof(commit)) != 0 ||
+        commit.magic != JOURNAL_COMMIT_MAGIC || commit.sequence != header->sequence ||
+        commit.checksum != checksum(checksum(FNV_BASIS, header, sizeof(*header)), *body, header->length)) {
+        free(*body);
+        return -1;
+    }
+
+    uint64_t records_bytes = (uint64_t)header->num_records * sizeof(JournalRecord);
+    uint64_t position = 0;
+    for (uint32_t i = 0; i < header->num_records; i++) {
+        JournalRecord record;
+        memcpy(&record, *body + (size_t)i * sizeof(JournalRecord), sizeof(record));
+        if (record_bytes(&record) > header->length - records_bytes - position) {
+            free(*body);
+            return -1;
+        }
+        position += record_bytes(&record);
+    }
+    return 0;
+}
+
+// A revoked range and the transaction that revoked it
+typedef struct {
+    uint64_t offset;
+    uint64_t end;
+    uint32_t transaction;
+} JournalRevoke;
+
+static int is_revoked(const JournalRevoke *revokes, uint32_t count, uint32_t transaction, const JournalRecord *record) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (revokes[i].transaction > transaction && record->offset < revokes[i].end &&
+            revokes[i].offset < record->offset + record->length) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Reapplies the complete transactions at the start of the journal, in
+// order. A torn or corrupt transaction ends the replay: it never
+// committed, so none of its writes reached the image. A first pass
+// collects the revoked ranges, and writes that a later transaction
+// revoked are skipped.
+static int replay(BlockDevice *dev, int fd, uint32_t *replayed, char *ops) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    uint64_t size = (uint64_t)st.st_size;
+    uint64_t offset = 0;
+    uint64_t sequence = 0;
+    uint32_t count = 0;
+    JournalRevoke *revokes = NULL;
+    uint32_t num_revokes = 0;
+    uint32_t revoke_capacity = 0;
+    JournalHeader header;
+    uint8_t *body;
+
+    while (read_transaction(fd, size, offset, sequence, &header, &body) == 0) {
+        for (uint32_t i = 0; i < header.num_records; i++) {
+            JournalRecord record;
+            memcpy(&record, body + (size_t)i * sizeof(JournalRecord), sizeof(record));
+            if (record.length & JOURNAL_REVOKE) {
+                if (num_revokes == revoke_capacity) {
+                    revoke_capacity = revoke_capacity ? revoke_capacity * 2 : 64;
+                    revokes = realloc(revokes, revoke_capacity * sizeof(JournalRevoke));
+                }
+                uint64_t end = record.offset + (record.length & ~JOURNAL_REVOKE);
+                revokes[num_revokes++] = (JournalRevoke){ record.offset, end, count };
+            }
+        }
+        free(body);
+        count++;
+        sequence = header.sequence + 1;
+        offset += sizeof(header) + header.length + sizeof(JournalCommit);
+    }
+
+    offset = 0;
+    int result = 0;
+    for (uint32_t t = 0; t < count && result == 0; t++) {
+        // HEADER still holds the previous transaction, which the first
+        // pass already found in sequence
+        read_transaction(fd, size, offset, header.sequence + 1, &header, &body);
+        uint8_t *data = body + (size_t)header.num_records * sizeof(JournalRecord);
+        uint64_t position = 0;
+        uint32_t num_requests = 0;
+        IoRequest *requests = malloc((header.num_records ? header.num_records : 1) * sizeof(IoRequest));
+        for (uint32_t i = 0; i < header.num_records; i++) {
+            JournalRecord record;
+            memcpy(&record, body + (size_t)i * sizeof(JournalRecord), sizeof(record));
+            if (!(record.length & JOURNAL_REVOKE) && !is_revoked(revokes, num_revokes, t, &record)) {
+                requests[num_requests++] = (IoRequest){ 1, record.offset, data + position, record.length, 0 };
+            }
+            position += record_bytes(&record);
+        }
+        result = dev_submit(dev, requests, num_requests);
+        free(requests);
+        free(body);
+
+        header.ops[JOURNAL_OPS_BYTES - 1] = '\0';
+        for (char *op = strtok(header.ops, ","); op != NULL; op = strtok(NULL, ",")) {
+            add_op(ops, op);
+        }
+        (*replayed)++;
+        offset += sizeof(header) + header.length + sizeof(JournalCommit);
+    }
+    free(revokes);
+    journal.sequence = sequence;
+    return result == 0 ? 0 : -1;
+}
+
+// Opens the journal at PATH, creating it if needed, and first replays
+// whatever an earlier run committed but may not have written in place.
+// Must run before the FAT and any metadata are loaded from the image.
+int journal_open(BlockDevice *dev, const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Unable to open the journal '%s'.\n", path);
+        return -1;
+    }
+
+    uint32_t replayed = 0;
+    char ops[JOURNAL_OPS_BYTES] = "";
+    if (replay(dev, fd, &replayed, ops) != 0 || (replayed > 0 && dev_sync(dev) != 0)) {
+        fprintf(stderr, "Error: Unable to replay the journal '%s' into the image.\n", path);
+        close(fd);
+        return -1;
+    }
+    if (replayed > 0) {
+        fprintf(stderr, "Recovered %u transactions (%s) from '%s'.\n", replayed, ops[0] ? ops : "unnamed", path);
+    }
+    if (ftruncate(fd, 0) != 0 || fsync(fd) != 0) {
+        fprintf(stderr, "Error: Unable to reset the journal '%s'.\n", path);
+        close(fd);
+        return -1;
+    }
+
+    journal.fd = fd;
+    journal.path = strdup(path);
+    journal.size = 0;
+    return 0;
+}
+
+// Adds a revoke of LENGTH bytes at OFFSET, merged into the previous
+// record when that revokes the range just before
+static void stage_revoke(uint64_t offset, size_t length) {
+    if (journal.num_records > 0) {
+        JournalRecord *last = &journal.records[journal.num_records - 1];
+        uint32_t last_length = last->length & ~JOURNAL_REVOKE;
+        if ((last->length & JOURNAL_REVOKE) && last->offset + last_length == offset && last_length + length < JOURNAL_REVOKE) {
+            last->length += (uint32_t)length;
+            return;
+        }
+    }
+    if (journal.num_records == journal.record_capacity) {
+        journal.record_capacity = journal.record_capacity ? journal.record_capacity * 2 : 64;
+        journal.records = realloc(journal.records, journal.record_capacity * sizeof(JournalRecord));
+    }
+    journal.records[journal.num_records++] = (JournalRecord){ offset, (uint32_t)length | JOURNAL_REVOKE };
+}
+
+static void stage(const IoRequest *request) {
+    if (journal.num_records == journal.record_capacity) {
+        journal.record_capacity = journal.record_capacity ? journal.record_capacity * 2 : 64;
+        journal.records = realloc(journal.records, journal.record_capacity * sizeof(JournalRecord));
+    }
+    if (journal.data_length + request->length > journal.data_capacity) {
+        while (journal.data_length + request->length > journal.data_capacity) {
+            journal.data_capacity = journal.data_capacity ? journal.data_capacity * 2 : 64 * 1024;
+        }
+        journal.data = realloc(journal.data, journal.data_capacity);
+    }
+    journal.records[journal.num_records++] = (JournalRecord){ request->offset, (uint32_t)request->length };
+    memcpy(journal.data + journal.data_length, request->buffer, request->length);
+    journal.data_length += request->length;
+}
+
+// The image is synced, so nothing in the journal is needed any more
+static int checkpoint_locked(BlockDevice *dev) {
+    if (dev_sync(dev) != 0) {
+        return -1;
+    }
+    if (journal.size == 0) {
+        return 0;
+    }
+    if (ftruncate(journal.fd, 0) != 0 || fsync(journal.fd) != 0) {
+        return -1;
+    }
+    journal.size = 0;
+    journal.stats.checkpoints++;
+    return 0;
+}
+
+// Appends the staged transaction with a single sync, then writes it in
+// place. The in-place writes go ahead even if the journal could not take
+// the transaction: the data has to reach the image either way, it is
+// only no longer protected against a crash.
+static int commit_locked(BlockDevice *dev) {
+    if (journal.num_records == 0) {
+        return 0;
+    }
+
+    size_t records_bytes = (size_t)journal.num_records * sizeof(JournalRecord);
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+    header.num_records = journal.num_records;
+    header.sequence = journal.sequence;
+    header.length = records_bytes + journal.data_length;
+    memcpy(header.ops, journal.ops, sizeof(header.ops));
+
+    size_t total = sizeof(header) + header.length + sizeof(JournalCommit);
+    uint8_t *buffer = malloc(total);
+    uint8_t *at = buffer;
+    memcpy(at, &header, sizeof(header));
+    at += sizeof(header);
+    memcpy(at, journal.records, records_bytes);
+    at += records_bytes;
+    memcpy(at, journal.data, journal.data_length);
+    at += journal.data_length;
+    JournalCommit commit = { JOURNAL_COMMIT_MAGIC, checksum(FNV_BASIS, buffer, sizeof(header) + header.length), header.sequence };
+    memcpy(at, &commit, sizeof(commit));
+
+    int result = transfer(journal.fd, 1, journal.size, buffer, total);
+    if (result == 0) {
+        result = fdatasync(journal.fd);
+    }
+    free(buffer);
+    if (result == 0) {
+        journal.size += total;
+        journal.sequence++;
+        journal.stats.transactions++;
+        journal.stats.records += journal.num_records;
+        journal.stats.bytes += journal.data_length;
+    }
+
+    IoRequest *requests = malloc(journal.num_records * sizeof(IoRequest));
+    uint32_t num_requests = 0;
+    uint64_t position = 0;
+    for (uint32_t i = 0; i < journal.num_records; i++) {
+        if (!(journal.records[i].length & JOURNAL_REVOKE)) {
+            requests[num_requests++] = (IoRequest){ 1, journal.records[i].offset, journal.data + position, journal.records[i].length, 0 };
+        }
+        position += record_bytes(&journal.records[i]);
+    }
+    if (dev_submit(dev, requests, num_requests) != 0) {
+        result = -1;
+    }
+    free(requests);
+    journal.num_records = 0;
+    journal.data_length = 0;
+    journal.ops[0] = '\0';
+
+    if (result == 0 && journal.size >= JOURNAL_CHECKPOINT_BYTES) {
+        result = checkpoint_locked(dev);
+    }
+    return result;
+}
+
+void journal_begin(void) {
+    pthread_mutex_lock(&journal.lock);
+    journal.depth++;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+// Ends a transaction; the outermost end commits everything staged since
+// the outermost begin
+int journal_end(BlockDevice *dev) {
+    pthread_mutex_lock(&journal.lock);
+    int result = 0;
+    if (--journal.depth == 0 && journal.fd >= 0) {
+        result = commit_locked(dev);
+    }
+    pthread_mutex_unlock(&journal.lock);
+    return result;
+}
+
+// Metadata writes go through here. Without a journal they are submitted
+// directly; otherwise they join the open transaction, or form one of
+// their own when none is open (outside any command).
+int journal_write(BlockDevice *dev, IoRequest *requests, size_t count) {
+    if (journal.fd < 0) {
+        return dev_submit(dev, requests, count);
+    }
+    pthread_mutex_lock(&journal.lock);
+    for (size_t i = 0; i < count; i++) {
+        stage(&requests[i]);
+        requests[i].result = 0;
+    }
+    int result = journal.depth == 0 ? commit_locked(dev) : 0;
+    pthread_mutex_unlock(&journal.lock);
+    return result;
+}
+
+// Reads LENGTH bytes at OFFSET as the image will hold them once the open
+// transaction commits. Staged writes are already clean in the block
+// cache, so a cluster evicted and read back must come with them.
+int journal_read(BlockDevice *dev, uint64_t offset, void *buffer, size_t length) {
+    int result = dev_read(dev, offset, buffer, length);
+    if (journal.fd < 0) {
+        return result;
+    }
+    pthread_mutex_lock(&journal.lock);
+    uint64_t position = 0;
+    for (uint32_t i = 0; i < journal.num_records; i++) {
+        const JournalRecord *record = &journal.records[i];
+        uint64_t start = record->offset > offset ? record->offset : offset;
+        uint64_t end = record->offset + record_bytes(record) < offset + length ? record->offset + record_bytes(record) : offset + length;
+        if (start < end) {
+            memcpy((uint8_t *)buffer + (start - offset), journal.data + position + (start - record->offset), end - start);
+        }
+        position += record_bytes(record);
+    }
+    pthread_mutex_unlock(&journal.lock);
+    return result;
+}
+
+// Forgets the writes to LENGTH bytes at OFFSET, a cluster that was just
+// freed: it may be reused for file data written straight to the image,
+// which neither the commit nor a replay may overwrite. Staged writes
+// lying wholly inside the range are dropped; transactions already in the
+// journal get a revoke record.
+void journal_discard(uint64_t offset, size_t length) {
+    if (journal.fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&journal.lock);
+    uint32_t kept = 0;
+    uint64_t from = 0;
+    uint64_t to = 0;
+    for (uint32_t i = 0; i < journal.num_records; i++) {
+        JournalRecord record = journal.records[i];
+        uint32_t bytes = record_bytes(&record);
+        if ((record.length & JOURNAL_REVOKE) || record.offset < offset || record.offset + bytes > offset + length) {
+            memmove(journal.data + to, journal.data + from, bytes);
+            journal.records[kept++] = record;
+            to += bytes;
+        }
+        from += bytes;
+    }
+    journal.num_records = kept;
+    journal.data_length = to;
+    if (journal.size > 0) {
+        stage_revoke(offset, length);
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
+
+// Writes back the cached directory clusters and FAT sectors and commits
+// them at once, even inside a transaction, for code that is about to
+// read or rewrite the image directly. The metadata has to be consistent
+// at that point, since a crash right after leaves the image as it is.
+int journal_flush(BlockDevice *dev, FAT32BootSector *bs) {
+    int result = bcache_flush(dev, bs);
+    if (fat_table_flush(dev, bs, NULL) != 0) {
+        result = -1;
+    }
+    if (journal.fd >= 0) {
+        pthread_mutex_lock(&journal.lock);
+        if (commit_locked(dev) != 0) {
+            result = -1;
+        }
+        pthread_mutex_unlock(&journal.lock);
+    }
+    return result;
+}
+
+// Names the operation the staged writes belong to, for the recovery
+// report
+void journal_note(const char *op) {
+    pthread_mutex_lock(&journal.lock);
+    if (journal.fd >= 0) {
+        add_op(journal.ops, op);
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
+
+// Commits anything staged, syncs the image and empties the journal
+int journal_checkpoint(BlockDevice *dev) {
+    if (journal.fd < 0) {
+        return dev_sync(dev);
+    }
+    pthread_mutex_lock(&journal.lock);
+    int result = commit_locked(dev);
+    if (checkpoint_locked(dev) != 0) {
+        result = -1;
+    }
+    pthread_mutex_unlock(&journal.lock);
+    return result;
+}
+
+// Final checkpoint before the image is closed. A clean shutdown leaves
+// an empty journal behind.
+void journal_close(BlockDevice *dev) {
+    journal_checkpoint(dev);
+    if (journal.fd < 0) {
+        return;
+    }
+    close(journal.fd);
+    free(journal.path);
+    free(journal.records);
+    free(journal.data);
+    journal.fd = -1;
+    journal.path = NULL;
+    journal.records = NULL;
+    journal.data = NULL;
+    journal.record_capacity = 0;
+    journal.data_capacity = 0;
+}
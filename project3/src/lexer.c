@@ -1,49 +1,149 @@
 #include "lexer.h"
-#include <stdio.h>
 #include <string.h>
 
-#define BUFFER_SIZE 1024
+#define ARENA_MIN_BLOCK 4096
 
-char * get_input(void) {
-    char *buffer = malloc(BUFFER_SIZE * sizeof(char));
-    if (fgets(buffer, BUFFER_SIZE, stdin) != NULL) {
-        size_t len = strlen(buffer);
-        if (len > 0 && buffer[len - 1] == '\n') {
-            buffer[len - 1] = '\0';
+void arena_init(Arena *arena) {
+    arena->block = NULL;
+}
+
+static ArenaBlock *new_block(size_t capacity, ArenaBlock *prev) {
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + capacity);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->prev = prev;
+    block->used = 0;
+    block->capacity = capacity;
+    return block;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    ArenaBlock *block = arena->block;
+    if (block == NULL || block->capacity - block->used < size) {
+        size_t capacity = block ? block->capacity * 2 : ARENA_MIN_BLOCK;
+        while (capacity < size) {
+            capacity *= 2;
+        }
+        block = new_block(capacity, arena->block);
+        if (block == NULL) {
+            return NULL;
+        }
+        arena->block = block;
+    }
+
+    void *result = block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+// Releases everything allocated since the last reset. If the last command
+// needed more than one block they are merged into a single larger one.
+void arena_reset(Arena *arena) {
+    ArenaBlock *block = arena->block;
+    if (block == NULL) {
+        return;
+    }
+    if (block->prev != NULL) {
+        size_t total = 0;
+        while (block != NULL) {
+            ArenaBlock *prev = block->prev;
+            total += block->capacity;
+            free(block);
+            block = prev;
         }
-        return buffer;
+        arena->block = new_block(total, NULL);
+        return;
     }
-    free(buffer);
-    return NULL;
+    block->used = 0;
 }
 
-tokenlist * get_tokens(char *input) {
-    tokenlist *tokens = new_tokenlist();
-    char *token = strtok(input, " ");
-    while (token != NULL) {
-        add_token(tokens, token);
-        token = strtok(NULL, " ");
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->block;
+    while (block != NULL) {
+        ArenaBlock *prev = block->prev;
+        free(block);
+        block = prev;
     }
-    return tokens;
+    arena->block = NULL;
 }
 
-tokenlist * new_tokenlist(void) {
-    tokenlist *tokens = malloc(sizeof(tokenlist));
-    tokens->items = NULL;
-    tokens->size = 0;
-    return tokens;
+void lexer_init(Lexer *lexer) {
+    lexer->line = NULL;
+    lexer->line_capacity = 0;
+    arena_init(&lexer->arena);
+    lexer->tokens.items = NULL;
+    lexer->tokens.size = 0;
 }
 
-void add_token(tokenlist *tokens, char *item) {
-    tokens->size += 1;
-    tokens->items = realloc(tokens->items, tokens->size * sizeof(char *));
-    tokens->items[tokens->size - 1] = strdup(item);
+// Reads one line of any length into the lexer's buffer, reusing it
+// between calls. Returns NULL at end of input.
+char * lexer_read_line(Lexer *lexer, FILE *in) {
+    ssize_t length = getline(&lexer->line, &lexer->line_capacity, in);
+    if (length < 0) {
+        return NULL;
+    }
+    if (length > 0 && lexer->line[length - 1] == '\n') {
+        lexer->line[--length] = '\0';
+    }
+    if (length > 0 && lexer->line[length - 1] == '\r') {
+        lexer->line[--length] = '\0';
+    }
+    return lexer->line;
 }
 
-void free_tokens(tokenlist *tokens) {
-    for (size_t i = 0; i < tokens->size; i++) {
-        free(tokens->items[i]);
+// Splits INPUT on spaces and tabs in place. A double-quoted string is a
+// single token with the quotes removed; inside it \" and \\ are escapes.
+// The returned list and its items stay valid until the next call.
+tokenlist * lexer_tokenize(Lexer *lexer, char *input) {
+    arena_reset(&lexer->arena);
+    lexer->tokens.size = 0;
+
+    // A line of N bytes holds at most N / 2 + 1 tokens
+    size_t max_tokens = strlen(input) / 2 + 1;
+    lexer->tokens.items = arena_alloc(&lexer->arena, max_tokens * sizeof(char *));
+    if (lexer->tokens.items == NULL) {
+        return &lexer->tokens;
     }
-    free(tokens->items);
-    free(tokens);
+
+    char *read = input;
+    while (*read != '\0') {
+        while (*read == ' ' || *read == '\t') {
+            read++;
+        }
+        if (*read == '\0') {
+            break;
+        }
+
+        // Quotes are stripped by copying the token down over itself
+        char *token = read;
+        char *write = read;
+        bool quoted = false;
+        while (*read != '\0' && (quoted || (*read != ' ' && *read != '\t'))) {
+            if (*read == '"') {
+                quoted = !quoted;
+                read++;
+            } else if (quoted && *read == '\\' && (read[1] == '"' || read[1] == '\\')) {
+                *write++ = read[1];
+                read += 2;
+            } else {
+                *write++ = *read++;
+            }
+        }
+        if (*read != '\0') {
+            read++;
+        }
+        *write = '\0';
+        lexer->tokens.items[lexer->tokens.size++] = token;
+    }
+    return &lexer->tokens;
+}
+
+void lexer_free(Lexer *lexer) {
+    free(lexer->line);
+    lexer->line = NULL;
+    lexer->line_capacity = 0;
+    arena_free(&lexer->arena);
 }
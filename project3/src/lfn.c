@@ -0,0 +1,259 @@
+#include "lfn.h"
+#include <ctype.h>
+#include <string.h>
+
+#define LFN_ATTR 0x0F
+
+// Byte offsets of the 13 UTF-16 characters inside a long name entry
+static const uint8_t lfn_offsets[LFN_CHARS_PER_ENTRY] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+void lfn_reset(LfnState *state) {
+    state->next_order = 0;
+    state->count = 0;
+}
+
+// Adds one long name entry to STATE. A fragment that does not continue
+// the pending sequence discards it. Returns 1 when ENTRY starts a new
+// name, so the caller can note where its entries begin.
+int lfn_feed(LfnState *state, const DirectoryEntry *entry) {
+    const uint8_t *raw = (const uint8_t *)entry;
+    uint8_t order = raw[0] & LFN_ORDINAL_MASK;
+    int started = 0;
+
+    if (raw[0] & LFN_LAST_ENTRY) {
+        if (order == 0 || order > LFN_MAX_ENTRIES) {
+            lfn_reset(state);
+            return 0;
+        }
+        state->count = order;
+        state->next_order = order;
+        state->checksum = raw[13];
+        started = 1;
+    }
+    if (state->next_order == 0 || order != state->next_order || raw[13] != state->checksum) {
+        lfn_reset(state);
+        return 0;
+    }
+
+    uint16_t *units = state->units + (order - 1) * LFN_CHARS_PER_ENTRY;
+    for (int i = 0; i < LFN_CHARS_PER_ENTRY; i++) {
+        units[i] = (uint16_t)(raw[lfn_offsets[i]] | (raw[lfn_offsets[i] + 1] << 8));
+    }
+    state->next_order--;
+    return started;
+}
+
+static size_t put_utf8(char *out, uint32_t code) {
+    if (code < 0x80) {
+        out[0] = (char)code;
+        return 1;
+    }
+    if (code < 0x800) {
+        out[0] = (char)(0xC0 | (code >> 6));
+        out[1] = (char)(0x80 | (code & 0x3F));
+        return 2;
+    }
+    if (code < 0x10000) {
+        out[0] = (char)(0xE0 | (code >> 12));
+        out[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (code & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (code >> 18));
+    out[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (code & 0x3F));
+    return 4;
+}
+
+// Completes the pending name with the short entry that follows it. When
+// every fragment arrived and the checksum matches ENTRY, writes the name
+// as UTF-8 to NAME (LONG_NAME_BUFFER bytes) and returns 1; otherwise the
+// fragments are orphans (or spell a name with '/', "." or "..") and 0 is
+// returned. STATE is reset either way.
+int lfn_finish(LfnState *state, const DirectoryEntry *entry, char *name) {
+    int valid = state->count > 0 && state->next_order == 0 && state->checksum == lfn_checksum(entry->name);
+    size_t length = 0;
+
+    if (valid) {
+        int total = state->count * LFN_CHARS_PER_ENTRY;
+        if (total > LFN_MAX_UNITS) {
+            total = LFN_MAX_UNITS;
+        }
+        for (int i = 0; i < total && state->units[i] != 0x0000; i++) {
+            uint32_t code = state->units[i];
+            if (code >= 0xD800 && code < 0xDC00 && i + 1 < total &&
+                state->units[i + 1] >= 0xDC00 && state->units[i + 1] < 0xE000) {
+                code = 0x10000 + ((code - 0xD800) << 10) + (state->units[i + 1] - 0xDC00);
+                i++;
+            } else if (code >= 0xD800 && code < 0xE000) {
+                code = '?';  // unpaired surrogate
+            }
+            length += put_utf8(name + length, code);
+        }
+        valid = length > 0;
+    }
+    name[length] = '\0';
+    // Names that could step out of a host directory are not names a
+    // long entry may hold; lfn_encode never writes them
+    if (valid && (strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)) {
+        valid = 0;
+    }
+    lfn_reset(state);
+    return valid;
+}
+
+uint8_t lfn_checksum(const uint8_t *short_name) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) {
+        sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + short_name[i]);
+    }
+    return sum;
+}
+
+// Converts the UTF-8 NAME to UTF-16 in UNITS (LFN_MAX_UNITS long).
+// Returns the number of units, or -1 if NAME is malformed, too long or
+// contains a character a long name may not hold.
+int lfn_encode(const char *name, uint16_t *units) {
+    const uint8_t *p = (const uint8_t *)name;
+    int length = 0;
+    int visible = 0;
+
+    while (*p != '\0') {
+        uint32_t code;
+        int extra;
+        if (*p < 0x80) {
+            code = *p;
+            extra = 0;
+        } else if ((*p & 0xE0) == 0xC0) {
+            code = *p & 0x1F;
+            extra = 1;
+        } else if ((*p & 0xF0) == 0xE0) {
+            code = *p & 0x0F;
+            extra = 2;
+        } else if ((*p & 0xF8) == 0xF0) {
+            code = *p & 0x07;
+            extra = 3;
+        } else {
+            return -1;
+        }
+        p++;
+        for (int i = 0; i < extra; i++, p++) {
+            if ((*p & 0xC0) != 0x80) {
+                return -1;
+            }
+            code = (code << 6) | (*p & 0x3F);
+        }
+
+        if (code < 0x20 || code == 0x7F || (code < 0x80 && strchr("\"*/:<>?\\|", (int)code) != NULL) ||
+            (code >= 0xD800 && code < 0xE000) || code > 0x10FFFF) {
+            return -1;
+        }
+        if (code != ' ' && code != '.') {
+            visible = 1;
+        }
+
+        if (code >= 0x10000) {
+            if (length + 2 > LFN_MAX_UNITS) {
+                return -1;
+            }
+            code -= 0x10000;
+            units[length++] = (uint16_t)(0xD800 + (code >> 10));
+            units[length++] = (uint16_t)(0xDC00 + (code & 0x3FF));
+        } else {
+            if (length + 1 > LFN_MAX_UNITS) {
+                return -1;
+            }
+            units[length++] = (uint16_t)code;
+        }
+    }
+    return visible ? length : -1;
+}
+
+uint32_t lfn_entry_count(int length) {
+    return (uint32_t)(length + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY;
+}
+
+// Builds the long name entries for UNITS in on-disk order, last
+// fragment first. ENTRIES must hold lfn_entry_count(LENGTH) entries.
+void lfn_fill_entries(const uint16_t *units, int length, uint8_t checksum, DirectoryEntry *entries) {
+    uint32_t count = lfn_entry_count(length);
+
+    for (uint32_t n = 0; n < count; n++) {
+        uint32_t order = count - n;
+        uint8_t *raw = (uint8_t *)&entries[n];
+        memset(raw, 0, sizeof(DirectoryEntry));
+        raw[0] = (uint8_t)(order | (n == 0 ? LFN_LAST_ENTRY : 0));
+        raw[11] = LFN_ATTR;
+        raw[13] = checksum;
+
+        for (int i = 0; i < LFN_CHARS_PER_ENTRY; i++) {
+            int position = (int)(order - 1) * LFN_CHARS_PER_ENTRY + i;
+            // The name is terminated by one NUL and padded with 0xFFFF
+            uint16_t unit = position < length ? units[position] : (position == length ? 0x0000 : 0xFFFF);
+            raw[lfn_offsets[i]] = (uint8_t)(unit & 0xFF);
+            raw[lfn_offsets[i] + 1] = (uint8_t)(unit >> 8);
+        }
+    }
+}
+
+// Derives the 8.3 basis of a long name: upper case, spaces and leading
+// dots dropped, characters a short name cannot hold replaced by '_',
+// base cut to 8 and extension (after the last dot) to 3 characters
+void lfn_short_basis(const char *name, uint8_t *basis) {
+    const char *dot = strrchr(name, '.');
+    const char *p = name;
+    int length = 0;
+
+    memset(basis, ' ', 11);
+    while (*p == '.') {
+        p++;
+    }
+    if (dot != NULL && dot < p) {
+        dot = NULL;
+    }
+
+    for (; *p != '\0' && p != dot && length < 8; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c == ' ' || c == '.') {
+            continue;
+        }
+        if ((c & 0xC0) == 0x80) {
+            continue;  // UTF-8 continuation byte; the lead byte became '_'
+        }
+        basis[length++] = (c >= 0x80 || strchr("\"*+,/:;<=>?[\\]|", c) != NULL) ? '_' : (uint8_t)toupper(c);
+    }
+    if (length == 0) {
+        basis[length++] = '_';
+    }
+
+    if (dot != NULL) {
+        length = 8;
+        for (p = dot + 1; *p != '\0' && length < 11; p++) {
+            unsigned char c = (unsigned char)*p;
+            if (c == ' ' || (c & 0xC0) == 0x80) {
+                continue;
+            }
+            basis[length++] = (c >= 0x80 || strchr("\"*+,/:;<=>?[\\]|", c) != NULL) ? '_' : (uint8_t)toupper(c);
+        }
+    }
+}
+
+// Writes BASIS with the numeric tail "~N" into SHORT_NAME, shortening
+// the base as the tail grows
+void lfn_apply_tail(uint8_t *short_name, const uint8_t *basis, uint32_t n) {
+    char tail[12];
+    int tail_length = snprintf(tail, sizeof(tail), "~%u", n);
+    int base_length = 0;
+
+    while (base_length < 8 && basis[base_length] != ' ') {
+        base_length++;
+    }
+    if (base_length > 8 - tail_length) {
+        base_length = 8 - tail_length;
+    }
+
+    memcpy(short_name, basis, 11);
+    memset(short_name + base_length, ' ', 8 - base_length);
+    memcpy(short_name + base_length, tail, (size_t)tail_length);
+}
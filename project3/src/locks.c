@@ -0,0 +1,47 @@
+#define _GNU_SOURCE  // writer-preferring rwlocks
+#include "locks.h"
+#include <pthread.h>
+
+static pthread_rwlock_t image_rwlock;
+static pthread_rwlock_t dir_rwlocks[DIR_LOCK_STRIPES];
+
+static pthread_rwlock_t *dir_stripe(uint32_t cluster) {
+    return &dir_rwlocks[(cluster * 2654435761u) >> 24 & (DIR_LOCK_STRIPES - 1)];
+}
+
+// Writers are preferred so a stream of listings cannot starve an rm or
+// a mkdir waiting on the same lock
+void locks_init(void) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&image_rwlock, &attr);
+    for (int i = 0; i < DIR_LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&dir_rwlocks[i], &attr);
+    }
+    pthread_rwlockattr_destroy(&attr);
+}
+
+void image_lock(int exclusive) {
+    if (exclusive) {
+        pthread_rwlock_wrlock(&image_rwlock);
+    } else {
+        pthread_rwlock_rdlock(&image_rwlock);
+    }
+}
+
+void image_unlock(void) {
+    pthread_rwlock_unlock(&image_rwlock);
+}
+
+void dir_lock(uint32_t cluster, int exclusive) {
+    if (exclusive) {
+        pthread_rwlock_wrlock(dir_stripe(cluster));
+    } else {
+        pthread_rwlock_rdlock(dir_stripe(cluster));
+    }
+}
+
+void dir_unlock(uint32_t cluster) {
+    pthread_rwlock_unlock(dir_stripe(cluster));
+}
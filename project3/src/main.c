@@ -1,111 +1,190 @@
 #include "lexer.h"
 #include "fat32.h"
+#include "fat_table.h"
+#include "bcache.h"
+#include "ioengine.h"
+#include "stats.h"
+#include "commands.h"
+#include "locks.h"
+#include "server.h"
+#include "overlay.h"
+#include "journal.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-// Implement command functions
-void handle_info_command(FAT32BootSector *bs) {
-    print_boot_sector_info(bs);
-}
+#define BATCH_OUTPUT_BUFFER (1 << 16)
 
-void handle_exit_command(FILE *image) {
-    fclose(image);
-    printf("Exiting...\n");
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-p] [-a auto|uring|threads|sync] [-b script|-] [-s socket] [-c clusters] [-t trace.csv] [-o delta] <image_file>\n", program);
 }
 
-void handle_ls_command(FILE *image, FAT32BootSector *bs, uint32_t cluster);
-
-void handle_cd_command(FILE *image, FAT32BootSector *bs, uint32_t *current_cluster, uint32_t *parent_cluster, char *current_path, const char *dirname);
-
-void handle_mkdir_command(FILE *image, FAT32BootSector *bs, uint32_t current_cluster, const char *dirname);
+int main(int argc, char *argv[]) {
+    DevBackend backend = DEV_BACKEND_MMAP;
+    const char *script_path = NULL;
+    uint32_t cache_clusters = BCACHE_DEFAULT_CLUSTERS;
+    const char *trace_path = NULL;
+    const char *socket_path = NULL;
+    const char *delta_path = NULL;
+    IoEngineKind engine = IO_ENGINE_AUTO;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "pa:b:s:c:t:o:")) != -1) {
+        switch (opt) {
+        case 'p':
+            // Use positioned reads and writes instead of mapping the image
+            backend = DEV_BACKEND_PREAD;
+            break;
+        case 'a':
+            // Asynchronous engine for batched I/O with the pread backend
+            if (io_engine_parse(optarg, &engine) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            // Run commands from a script ("-" for stdin) without prompts
+            script_path = optarg;
+            break;
+        case 's':
+            // Serve concurrent sessions on a Unix domain socket
+            socket_path = optarg;
+            break;
+        case 'c':
+            // Size of the metadata block cache, in clusters
+            cache_clusters = (uint32_t)strtoul(optarg, NULL, 10);
+            if (cache_clusters == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            // Record one line per command to a trace file
+            trace_path = optarg;
+            break;
+        case 'o':
+            // Keep the image read-only and write changes to a delta file
+            delta_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || (socket_path != NULL && script_path != NULL)) {
+        usage(argv[0]);
+        return 1;
+    }
+    shell_out = stdout;
+    locks_init();
+
+    Shell sh;
+    memset(&sh, 0, sizeof(sh));
+    sh.image_path = argv[optind];
+
+    FILE *in = stdin;
+    if (script_path != NULL) {
+        sh.batch = 1;
+        if (strcmp(script_path, "-") != 0) {
+            in = fopen(script_path, "r");
+            if (in == NULL) {
+                perror("Error opening script file");
+                return 1;
+            }
+        }
+        // Prompts are gone, so let stdio batch the output into large writes
+        setvbuf(stdout, NULL, _IOFBF, BATCH_OUTPUT_BUFFER);
+    }
 
-void handle_creat_command(FILE *image, FAT32BootSector *bs, uint32_t current_cluster, const char *filename);
+    BlockDevice image;
+    sh.dev = &image;
+    if (delta_path != NULL) {
+        if (overlay_open(sh.dev, sh.image_path, delta_path) != 0) {
+            return 1;
+        }
+    } else if (dev_open(sh.dev, sh.image_path, backend) != 0) {
+        perror("Error opening image file");
+        return 1;
+    }
+    if (sh.dev->map == NULL && sh.dev->overlay == NULL) {
+        // Mapped images are copied in memory; only positioned I/O is
+        // worth handing to an asynchronous engine
+        sh.dev->engine = io_engine_create(sh.dev->fd, engine);
+    }
+    if (!sh.dev->writable) {
+        fprintf(stderr, "Warning: '%s' is read-only, changes cannot be saved.\n", sh.image_path);
+    }
 
-void handle_open_command(FILE *image, FAT32BootSector *bs, uint32_t current_cluster, const char *filename, const char *mode);
+    if (dev_read(sh.dev, 0, &sh.bs, sizeof(FAT32BootSector)) != 0) {
+        fprintf(stderr, "Error: Unable to read the boot sector from '%s'.\n", sh.image_path);
+        dev_close(sh.dev);
+        return 1;
+    }
 
-void handle_close_command(const char *filename);
+    // Metadata writes are logged to a sidecar journal first, so a crash
+    // part way through a command is repaired here before anything is
+    // loaded. With an overlay the journal protects the delta.
+    if (sh.dev->writable) {
+        char journal_path[4096];
+        snprintf(journal_path, sizeof(journal_path), "%s.journal", delta_path != NULL ? delta_path : sh.image_path);
+        if (journal_open(sh.dev, journal_path) != 0) {
+            dev_close(sh.dev);
+            return 1;
+        }
+    }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <image_file>\n", argv[0]);
+    // Load the FAT once so allocation never has to re-read it
+    if (fat_table_load(sh.dev, &sh.bs) != 0) {
+        fprintf(stderr, "Error: Unable to load the FAT from '%s'.\n", sh.image_path);
+        dev_close(sh.dev);
         return 1;
     }
 
-    FILE *image = fopen(argv[1], "rb");
-    if (!image) {
-        perror("Error opening image file");
+    if (bcache_init(&sh.bs, cache_clusters) != 0) {
+        fprintf(stderr, "Error: Unable to allocate a block cache of %u clusters.\n", cache_clusters);
+        fat_table_free();
+        dev_close(sh.dev);
         return 1;
     }
 
-    FAT32BootSector bs;
-    fseek(image, 0, SEEK_SET);
-    fread(&bs, sizeof(FAT32BootSector), 1, image);
-
-    uint32_t current_cluster = bs.root_cluster;
-    uint32_t parent_cluster = bs.root_cluster; // Root is its own parent initially
-    char current_path[256] = "";  // Initialize the current path with the image name
+    sh.current_cluster = sh.bs.root_cluster;
+    sh.running = 1;
+    commands_init();
+    if (trace_path != NULL) {
+        handle_trace_command(trace_path);
+    }
 
-    snprintf(current_path, sizeof(current_path), "%s", argv[1]);
+    if (socket_path != NULL) {
+        // The sessions own the image until the server is stopped
+        int result = server_run(&sh, socket_path);
+        handle_exit_command(sh.dev, &sh.bs);
+        stats_free();
+        return result == 0 ? 0 : 1;
+    }
 
-    // Initialize open files array
-    memset(open_files, 0, sizeof(open_files));
+    Lexer lexer;
+    lexer_init(&lexer);
 
     char *input;
-    tokenlist *tokens;
-    while (1) {
-        printf("[%s]/>", current_path);
-        input = get_input();
-        tokens = get_tokens(input);
-
-        if (tokens->size > 0) {
-            if (strcmp(tokens->items[0], "info") == 0) {
-                handle_info_command(&bs);
-            } else if (strcmp(tokens->items[0], "ls") == 0) {
-                handle_ls_command(image, &bs, current_cluster);
-            } else if (strcmp(tokens->items[0], "cd") == 0) {
-                if (tokens->size == 2) {
-                    handle_cd_command(image, &bs, &current_cluster, &parent_cluster, current_path, tokens->items[1]);
-                } else {
-                    printf("Error: Incorrect number of arguments for 'cd' command.\n");
-                }
-            } else if (strcmp(tokens->items[0], "mkdir") == 0) {
-                if (tokens->size == 2) {
-                    handle_mkdir_command(image, &bs, current_cluster, tokens->items[1]);
-                } else {
-                    printf("Error: Incorrect number of arguments for 'mkdir' command.\n");
-                }
-            } else if (strcmp(tokens->items[0], "creat") == 0) {
-                if (tokens->size == 2) {
-                    handle_creat_command(image, &bs, current_cluster, tokens->items[1]);
-                } else {
-                    printf("Error: Incorrect number of arguments for 'creat' command.\n");
-                }
-            } else if (strcmp(tokens->items[0], "open") == 0) {
-                if (tokens->size == 3) {
-                    handle_open_command(image, &bs, current_cluster, tokens->items[1], tokens->items[2]);
-                } else {
-                    printf("Error: Incorrect number of arguments for 'open' command.\n");
-                }
-            } else if (strcmp(tokens->items[0], "close") == 0) {
-                if (tokens->size == 2) {
-                    handle_close_command(tokens->items[1]);
-                } else {
-                    printf("Error: Incorrect number of arguments for 'close' command.\n");
-                }
-            } else if (strcmp(tokens->items[0], "exit") == 0) {
-                handle_exit_command(image);
-                free_tokens(tokens);
-                free(input);
-                break;
-            } else {
-                printf("Unknown command\n");
-            }
+    while (sh.running) {
+        if (!sh.batch) {
+            printf("[%s%s]/>", sh.image_path, sh.current_path);
         }
-
-        free_tokens(tokens);
-        free(input);
+        input = lexer_read_line(&lexer, in);
+        if (input == NULL) {
+            // End of input behaves like exit
+            end_batch(&sh);
+            handle_exit_command(sh.dev, &sh.bs);
+            break;
+        }
+        run_command(&sh, lexer_tokenize(&lexer, input));
     }
+    lexer_free(&lexer);
+    stats_free();
 
+    if (in != stdin) {
+        fclose(in);
+    }
     return 0;
 }
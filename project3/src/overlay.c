@@ -0,0 +1,591 @@
+#include "overlay.h"
+#include "bcache.h"
+#include "fat_table.h"
+#include "journal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Reads or writes all of LENGTH bytes at OFFSET of FD
+static int transfer(int fd, int write, uint64_t offset, void *buffer, size_t length) {
+    uint8_t *data = buffer;
+    while (length > 0) {
+        ssize_t n = write ? pwrite(fd, data, length, (off_t)offset) : pread(fd, data, length, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static size_t bitmap_bytes(const OverlayHeader *header) {
+    return (header->num_blocks + 7) / 8;
+}
+
+static int block_present(const Overlay *ov, uint32_t block) {
+    return ov->present[block >> 3] >> (block & 7) & 1;
+}
+
+static void mark_present(Overlay *ov, uint32_t block) {
+    if (!block_present(ov, block)) {
+        ov->present[block >> 3] |= 1 << (block & 7);
+        ov->stored++;
+        ov->bitmap_dirty = 1;
+    }
+}
+
+static uint32_t block_of(const Overlay *ov, uint64_t offset) {
+    return (uint32_t)((offset + ov->header.shift) / ov->header.block_size);
+}
+
+// Image range [*START, *END) covered by BLOCK; the first and last blocks
+// of the grid can stick out of the image
+static void block_range(const Overlay *ov, uint32_t block, uint64_t *start, uint64_t *end) {
+    uint64_t first = (uint64_t)block * ov->header.block_size;
+    *start = first > ov->header.shift ? first - ov->header.shift : 0;
+    *end = first + ov->header.block_size - ov->header.shift;
+    if (*end > ov->header.base_size) {
+        *end = ov->header.base_size;
+    }
+}
+
+static uint64_t delta_position(const Overlay *ov, uint64_t offset) {
+    return ov->header.data_offset + ov->header.shift + offset;
+}
+
+static int write_header(Overlay *ov) {
+    return transfer(ov->delta_fd, 1, 0, &ov->header, sizeof(ov->header));
+}
+
+static int write_bitmap(Overlay *ov) {
+    return transfer(ov->delta_fd, 1, OVERLAY_HEADER_BYTES, ov->present, bitmap_bytes(&ov->header));
+}
+
+// Overlay backend
+
+// Serves each run of blocks from whichever file holds it
+static int overlay_read(BlockDevice *dev, uint64_t offset, void *buffer, size_t length) {
+    Overlay *ov = dev->overlay;
+    uint8_t *out = buffer;
+    int result = 0;
+
+    pthread_rwlock_rdlock(&ov->lock);
+    while (length > 0 && result == 0) {
+        uint32_t block = block_of(ov, offset);
+        int present = block_present(ov, block);
+        uint64_t start;
+        uint64_t end;
+        block_range(ov, block, &start, &end);
+        while (end - offset < length && block_present(ov, block + 1) == present) {
+            block_range(ov, ++block, &start, &end);
+        }
+        size_t run = end - offset < length ? end - offset : length;
+        result = present ? transfer(ov->delta_fd, 0, delta_position(ov, offset), out, run) : transfer(dev->fd, 0, offset, out, run);
+        out += run;
+        offset += run;
+        length -= run;
+    }
+    pthread_rwlock_unlock(&ov->lock);
+    return result;
+}
+
+// Brings the base contents of BLOCK into the delta
+static int copy_up(BlockDevice *dev, Overlay *ov, uint32_t block) {
+    uint64_t start;
+    uint64_t end;
+    block_range(ov, block, &start, &end);
+    uint8_t *buffer = malloc(end - start);
+    int result = transfer(dev->fd, 0, start, buffer, end - start);
+    if (result == 0) {
+        result = transfer(ov->delta_fd, 1, delta_position(ov, start), buffer, end - start);
+    }
+    free(buffer);
+    return result;
+}
+
+// Writes go to the delta in one piece. Only the first and last block
+// can be partly covered; if the delta does not hold them yet, the rest
+// of their contents is copied up from the base first.
+static int overlay_write(BlockDevice *dev, uint64_t offset, const void *buffer, size_t length) {
+    Overlay *ov = dev->overlay;
+    if (length == 0) {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&ov->lock);
+    uint32_t first = block_of(ov, offset);
+    uint32_t last = block_of(ov, offset + length - 1);
+    uint32_t edges[2] = { first, last };
+    int result = 0;
+    for (int i = 0; i < (first == last ? 1 : 2) && result == 0; i++) {
+        uint64_t start;
+        uint64_t end;
+        block_range(ov, edges[i], &start, &end);
+        if (!block_present(ov, edges[i]) && (start < offset || end > offset + length)) {
+            result = copy_up(dev, ov, edges[i]);
+        }
+    }
+    if (result == 0) {
+        result = transfer(ov->delta_fd, 1, delta_position(ov, offset), (void *)buffer, length);
+    }
+    if (result == 0) {
+        for (uint32_t block = first; block <= last; block++) {
+            mark_present(ov, block);
+        }
+    }
+    pthread_rwlock_unlock(&ov->lock);
+    return result;
+}
+
+// Block data must be durable before the bitmap claims it
+static int sync_delta(Overlay *ov) {
+    int result = fsync(ov->delta_fd);
+    if (result == 0 && ov->bitmap_dirty) {
+        result = write_bitmap(ov);
+        if (result == 0) {
+            result = fsync(ov->delta_fd);
+        }
+        if (result == 0) {
+            ov->bitmap_dirty = 0;
+        }
+    }
+    return result;
+}
+
+static int overlay_sync(BlockDevice *dev) {
+    Overlay *ov = dev->overlay;
+    pthread_rwlock_wrlock(&ov->lock);
+    int result = sync_delta(ov);
+    pthread_rwlock_unlock(&ov->lock);
+    return result;
+}
+
+static void overlay_prefetch(BlockDevice *dev, uint64_t offset, size_t length) {
+    posix_fadvise(dev->fd, (off_t)offset, (off_t)length, POSIX_FADV_WILLNEED);
+}
+
+static void free_overlay(Overlay *ov) {
+    if (ov->delta_fd >= 0) {
+        close(ov->delta_fd);
+    }
+    free(ov->present);
+    free(ov->image_path);
+    free(ov->delta_path);
+    free(ov);
+}
+
+static void overlay_close(BlockDevice *dev) {
+    Overlay *ov = dev->overlay;
+    sync_delta(ov);
+    pthread_rwlock_destroy(&ov->lock);
+    free_overlay(ov);
+    dev->overlay = NULL;
+}
+
+static const BlockDeviceOps overlay_ops = {
+    "overlay", overlay_read, overlay_write, overlay_sync, overlay_prefetch, overlay_close
+};
+
+// Checks an existing delta against the header a new one would get and
+// loads its bitmap. A delta caught in the middle of a commit has already
+// changed the base, so its modification time cannot match.
+static int load_delta(Overlay *ov, const OverlayHeader *expected) {
+    if (transfer(ov->delta_fd, 0, 0, &ov->header, sizeof(ov->header)) != 0 ||
+        memcmp(ov->header.magic, OVERLAY_MAGIC, sizeof(ov->header.magic)) != 0 || ov->header.version != OVERLAY_VERSION ||
+        ov->header.data_offset < OVERLAY_HEADER_BYTES + bitmap_bytes(&ov->header)) {
+        fprintf(stderr, "Error: '%s' is not a delta file.\n", ov->delta_path);
+        return -1;
+    }
+    if (ov->header.block_size != expected->block_size || ov->header.shift != expected->shift ||
+        ov->header.num_blocks != expected->num_blocks || ov->header.base_size != expected->base_size ||
+        (!ov->header.committing &&
+         (ov->header.base_mtime_sec != expected->base_mtime_sec || ov->header.base_mtime_nsec != expected->base_mtime_nsec))) {
+        fprintf(stderr, "Error: '%s' was made against a different or since modified image.\n", ov->delta_path);
+        return -1;
+    }
+    if (transfer(ov->delta_fd, 0, OVERLAY_HEADER_BYTES, ov->present, bitmap_bytes(&ov->header)) != 0) {
+        fprintf(stderr, "Error: Unable to read the block bitmap of '%s'.\n", ov->delta_path);
+        return -1;
+    }
+    for (size_t i = 0; i < bitmap_bytes(&ov->header); i++) {
+        ov->stored += __builtin_popcount(ov->present[i]);
+    }
+    return 0;
+}
+
+// Finds the first run of at most LIMIT blocks held in the delta at or
+// after *BLOCK. Returns its length, 0 once no blocks are left.
+static uint32_t next_run(const Overlay *ov, uint32_t *block, uint32_t limit) {
+    uint32_t b = *block;
+    while (b < ov->header.num_blocks && !block_present(ov, b)) {
+        // Whole empty bitmap bytes at a time
+        b = (b & 7) == 0 && ov->present[b >> 3] == 0 ? b + 8 : b + 1;
+    }
+    *block = b;
+    uint32_t count = 0;
+    while (b + count < ov->header.num_blocks && count < limit && block_present(ov, b + count)) {
+        count++;
+    }
+    return count;
+}
+
+// Copies every block held in the delta to FD: into the image when
+// TO_BASE is set, otherwise to the same position of another delta file
+static int copy_blocks(Overlay *ov, int fd, int to_base, uint64_t *bytes) {
+    uint8_t *buffer = malloc(OVERLAY_COPY_BYTES);
+    uint32_t limit = OVERLAY_COPY_BYTES / ov->header.block_size;
+    uint32_t count;
+    int result = 0;
+
+    for (uint32_t block = 0; result == 0 && (count = next_run(ov, &block, limit)) > 0; block += count) {
+        uint64_t start;
+        uint64_t end;
+        uint64_t last_start;
+        block_range(ov, block, &start, &end);
+        block_range(ov, block + count - 1, &last_start, &end);
+        size_t length = end - start;
+        result = transfer(ov->delta_fd, 0, delta_position(ov, start), buffer, length);
+        if (result == 0) {
+            result = transfer(fd, 1, to_base ? start : delta_position(ov, start), buffer, length);
+        }
+        *bytes += length;
+    }
+    free(buffer);
+    return result;
+}
+
+// Copies the delta into the base through BASE_FD and empties it. The
+// header is marked before the first base write, so a commit cut short by
+// a crash is recognised at the next mount and run again. The reset
+// writes the empty bitmap, then the header, and only then drops the
+// block data, so no crash leaves a marked header over missing blocks.
+static int commit_delta(Overlay *ov, int base_fd, int write_fd, uint64_t *bytes) {
+    ov->header.committing = 1;
+    int result = write_header(ov);
+    if (result == 0) {
+        result = fsync(ov->delta_fd);
+    }
+    if (result == 0) {
+        result = copy_blocks(ov, write_fd, 1, bytes);
+    }
+    if (result == 0) {
+        result = fsync(write_fd);
+    }
+
+    struct stat st;
+    if (result == 0) {
+        result = fstat(base_fd, &st);
+    }
+    if (result == 0) {
+        // The base has changed, so the empty delta is made against it anew
+        memset(ov->present, 0, bitmap_bytes(&ov->header));
+        ov->stored = 0;
+        ov->header.base_mtime_sec = st.st_mtim.tv_sec;
+        ov->header.base_mtime_nsec = st.st_mtim.tv_nsec;
+        ov->header.committing = 0;
+        result = write_bitmap(ov);
+        if (result == 0) {
+            result = write_header(ov);
+        }
+        if (result == 0) {
+            result = fsync(ov->delta_fd);
+        }
+        if (result == 0) {
+            result = ftruncate(ov->delta_fd, (off_t)ov->header.data_offset);
+        }
+        ov->bitmap_dirty = result != 0;
+    }
+    return result;
+}
+
+// Mounts IMAGE_PATH read-only with every change kept in DELTA_PATH,
+// which is created when missing. The delta records the base's size and
+// modification time, so it is refused once the base has changed under
+// it.
+int overlay_open(BlockDevice *dev, const char *image_path, const char *delta_path) {
+    FAT32BootSector bs;
+    struct stat st;
+
+    memset(dev, 0, sizeof(*dev));
+    dev->fd = open(image_path, O_RDONLY);
+    if (dev->fd < 0) {
+        fprintf(stderr, "Error: Unable to open '%s'.\n", image_path);
+        return -1;
+    }
+    if (fstat(dev->fd, &st) != 0 || transfer(dev->fd, 0, 0, &bs, sizeof(bs)) != 0 || bs.bytes_per_sector == 0 ||
+        bs.sectors_per_cluster == 0) {
+        fprintf(stderr, "Error: '%s' is not a FAT32 image.\n", image_path);
+        close(dev->fd);
+        return -1;
+    }
+
+    Overlay *ov = calloc(1, sizeof(Overlay));
+    ov->image_path = strdup(image_path);
+    ov->delta_path = strdup(delta_path);
+    ov->fat_start = (uint64_t)bs.reserved_sector_count * bs.bytes_per_sector;
+    ov->data_start = ov->fat_start + (uint64_t)bs.num_fats * bs.fat_size_32 * bs.bytes_per_sector;
+
+    OverlayHeader expected;
+    uint32_t block_size = cluster_size(&bs);
+    uint64_t align = block_size > 4096 ? block_size : 4096;
+    memset(&expected, 0, sizeof(expected));
+    memcpy(expected.magic, OVERLAY_MAGIC, sizeof(expected.magic));
+    expected.version = OVERLAY_VERSION;
+    expected.block_size = block_size;
+    expected.shift = (uint32_t)((block_size - ov->data_start % block_size) % block_size);
+    expected.num_blocks = (uint32_t)(((uint64_t)st.st_size + expected.shift + block_size - 1) / block_size);
+    expected.base_size = (uint64_t)st.st_size;
+    expected.base_mtime_sec = st.st_mtim.tv_sec;
+    expected.base_mtime_nsec = st.st_mtim.tv_nsec;
+    expected.data_offset = (OVERLAY_HEADER_BYTES + bitmap_bytes(&expected) + align - 1) / align * align;
+    ov->header = expected;
+    ov->present = calloc(bitmap_bytes(&expected), 1);
+
+    struct stat delta_st;
+    ov->delta_fd = open(delta_path, O_RDWR | O_CREAT, 0644);
+    if (ov->delta_fd < 0 || fstat(ov->delta_fd, &delta_st) != 0) {
+        fprintf(stderr, "Error: Unable to open the delta file '%s'.\n", delta_path);
+        close(dev->fd);
+        free_overlay(ov);
+        return -1;
+    }
+    if (delta_st.st_size == 0) {
+        // A new delta: nothing differs from the base yet
+        if (ftruncate(ov->delta_fd, (off_t)ov->header.data_offset) != 0 || write_header(ov) != 0 || fsync(ov->delta_fd) != 0) {
+            fprintf(stderr, "Error: Unable to create the delta file '%s'.\n", delta_path);
+            close(dev->fd);
+            free_overlay(ov);
+            return -1;
+        }
+    } else if (load_delta(ov, &expected) != 0) {
+        close(dev->fd);
+        free_overlay(ov);
+        return -1;
+    } else if (ov->header.committing) {
+        fprintf(stderr, "Finishing the interrupted commit of '%s' to '%s'.\n", delta_path, image_path);
+        uint64_t bytes = 0;
+        int fd = open(image_path, O_WRONLY);
+        if (fd < 0 || commit_delta(ov, dev->fd, fd, &bytes) != 0) {
+            fprintf(stderr, "Error: Unable to finish committing '%s' to '%s'.\n", delta_path, image_path);
+            if (fd >= 0) {
+                close(fd);
+            }
+            close(dev->fd);
+            free_overlay(ov);
+            return -1;
+        }
+        close(fd);
+    }
+
+    pthread_rwlock_init(&ov->lock, NULL);
+    dev->size = (uint64_t)st.st_size;
+    dev->writable = 1;
+    dev->ops = &overlay_ops;
+    dev->overlay = ov;
+    return 0;
+}
+
+// Everything cached must be in the delta before it is copied or compared
+static Overlay *prepare_overlay(BlockDevice *dev, FAT32BootSector *bs) {
+    if (dev->overlay == NULL) {
+        fprintf(shell_out, "Error: The image is not mounted with a delta file (-o).\n");
+        return NULL;
+    }
+    journal_flush(dev, bs);
+    if (dev_sync(dev) != 0) {
+        fprintf(shell_out, "Error: Failed to write back to '%s'.\n", dev->overlay->delta_path);
+        return NULL;
+    }
+    return dev->overlay;
+}
+
+// Saves the current delta as a new delta file at PATH. Mounting a copy
+// of it later returns the image to this point; only changed blocks are
+// copied, and holes stay holes.
+void handle_snapshot_command(BlockDevice *dev, FAT32BootSector *bs, const char *path) {
+    Overlay *ov = prepare_overlay(dev, bs);
+    if (ov == NULL) {
+        return;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        fprintf(shell_out, "Error: Unable to create '%s'%s.\n", path, errno == EEXIST ? ": it already exists" : "");
+        return;
+    }
+    uint64_t bytes = 0;
+    pthread_rwlock_rdlock(&ov->lock);
+    int result = transfer(fd, 1, 0, &ov->header, sizeof(ov->header));
+    if (result == 0) {
+        result = transfer(fd, 1, OVERLAY_HEADER_BYTES, ov->present, bitmap_bytes(&ov->header));
+    }
+    if (result == 0) {
+        result = ftruncate(fd, (off_t)ov->header.data_offset);
+    }
+    if (result == 0) {
+        result = copy_blocks(ov, fd, 0, &bytes);
+    }
+    uint32_t stored = ov->stored;
+    pthread_rwlock_unlock(&ov->lock);
+    if (result == 0) {
+        result = fsync(fd);
+    }
+    close(fd);
+
+    if (result != 0) {
+        unlink(path);
+        fprintf(shell_out, "Error: Failed to write the snapshot '%s'.\n", path);
+        return;
+    }
+    fprintf(shell_out, "Snapshot of %u changed blocks (%llu bytes) saved to '%s'.\n", stored, (unsigned long long)bytes, path);
+}
+
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+} ClusterRange;
+
+static void print_ranges(const ClusterRange *ranges, size_t count) {
+    int column = 0;
+    for (size_t i = 0; i < count; i++) {
+        char text[32];
+        if (ranges[i].first == ranges[i].last) {
+            snprintf(text, sizeof(text), "%u", ranges[i].first);
+        } else {
+            snprintf(text, sizeof(text), "%u-%u", ranges[i].first, ranges[i].last);
+        }
+        if (column > 0 && column + strlen(text) + 2 > 76) {
+            fprintf(shell_out, ",\n");
+            column = 0;
+        } else if (column > 0) {
+            fprintf(shell_out, ", ");
+            column += 2;
+        }
+        if (column == 0) {
+            fprintf(shell_out, "  ");
+            column = 2;
+        }
+        fprintf(shell_out, "%s", text);
+        column += strlen(text);
+    }
+    if (column > 0) {
+        fprintf(shell_out, "\n");
+    }
+}
+
+// Lists what the delta changes relative to the base, by region and, in
+// the data region, by cluster. Blocks copied up but written back with
+// their old contents are counted separately.
+void handle_diff_command(BlockDevice *dev, FAT32BootSector *bs) {
+    Overlay *ov = prepare_overlay(dev, bs);
+    if (ov == NULL) {
+        return;
+    }
+
+    uint32_t size = ov->header.block_size;
+    uint32_t limit = OVERLAY_COPY_BYTES / size;
+    uint8_t *delta = malloc(OVERLAY_COPY_BYTES);
+    uint8_t *base = malloc(OVERLAY_COPY_BYTES);
+    uint32_t reserved = 0;
+    uint32_t fat = 0;
+    uint32_t data = 0;
+    uint32_t unchanged = 0;
+    ClusterRange *ranges = NULL;
+    size_t num_ranges = 0;
+    size_t capacity = 0;
+    uint32_t count;
+    int result = 0;
+
+    pthread_rwlock_rdlock(&ov->lock);
+    for (uint32_t block = 0; result == 0 && (count = next_run(ov, &block, limit)) > 0; block += count) {
+        uint64_t run_start;
+        uint64_t end;
+        uint64_t last_start;
+        block_range(ov, block, &run_start, &end);
+        block_range(ov, block + count - 1, &last_start, &end);
+        result = transfer(ov->delta_fd, 0, delta_position(ov, run_start), delta, end - run_start);
+        if (result == 0) {
+            result = transfer(dev->fd, 0, run_start, base, end - run_start);
+        }
+        for (uint32_t i = 0; i < count && result == 0; i++) {
+            uint64_t start;
+            block_range(ov, block + i, &start, &end);
+            if (memcmp(delta + (start - run_start), base + (start - run_start), end - start) == 0) {
+                unchanged++;
+            } else if (end <= ov->fat_start) {
+                reserved++;
+            } else if (start < ov->data_start) {
+                fat++;
+            } else {
+                uint32_t cluster = (uint32_t)((start - ov->data_start) / size) + 2;
+                data++;
+                if (num_ranges > 0 && ranges[num_ranges - 1].last + 1 == cluster) {
+                    ranges[num_ranges - 1].last = cluster;
+                    continue;
+                }
+                if (num_ranges == capacity) {
+                    capacity = capacity ? capacity * 2 : 64;
+                    ranges = realloc(ranges, capacity * sizeof(ClusterRange));
+                }
+                ranges[num_ranges++] = (ClusterRange){ cluster, cluster };
+            }
+        }
+    }
+    uint32_t stored = ov->stored;
+    pthread_rwlock_unlock(&ov->lock);
+    free(delta);
+    free(base);
+
+    if (result != 0) {
+        fprintf(shell_out, "Error: Failed to compare '%s' with the image.\n", ov->delta_path);
+        free(ranges);
+        return;
+    }
+    fprintf(shell_out, "Delta '%s' holds %u blocks of %u bytes.\n", ov->delta_path, stored, size);
+    fprintf(shell_out, "Reserved sectors: %u blocks changed.\n", reserved);
+    fprintf(shell_out, "FAT: %u blocks changed.\n", fat);
+    fprintf(shell_out, "Data: %u clusters changed%s\n", data, data > 0 ? ":" : ".");
+    print_ranges(ranges, num_ranges);
+    if (unchanged > 0) {
+        fprintf(shell_out, "%u blocks were copied but still match the image.\n", unchanged);
+    }
+    free(ranges);
+}
+
+// Writes every block of the delta into the base image and empties the
+// delta. The blocks go out in image order; the delta is only reset once
+// the image is on disk, so a commit that fails part way can be retried.
+void handle_commit_command(BlockDevice *dev, FAT32BootSector *bs) {
+    Overlay *ov = prepare_overlay(dev, bs);
+    if (ov == NULL) {
+        return;
+    }
+
+    int fd = open(ov->image_path, O_WRONLY);
+    if (fd < 0) {
+        fprintf(shell_out, "Error: Unable to open '%s' for writing.\n", ov->image_path);
+        return;
+    }
+    uint64_t bytes = 0;
+    pthread_rwlock_wrlock(&ov->lock);
+    uint32_t stored = ov->stored;
+    int result = commit_delta(ov, dev->fd, fd, &bytes);
+    close(fd);
+    pthread_rwlock_unlock(&ov->lock);
+
+    if (result != 0) {
+        fprintf(shell_out, "Error: Failed to commit '%s' to '%s'.\n", ov->delta_path, ov->image_path);
+        return;
+    }
+    fprintf(shell_out, "Committed %u blocks (%llu bytes) to '%s'.\n", stored, (unsigned long long)bytes, ov->image_path);
+}
@@ -0,0 +1,288 @@
+#include "path.h"
+#include "dir_index.h"
+#include "locks.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+DentryCache dcache;
+
+// Guards the hash chains and LRU list. It is not held while a miss reads
+// the directory index, so one slow lookup never stalls the others.
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_key(uint32_t parent, const uint8_t *name) {
+    uint32_t hash = 2166136261u ^ parent;
+    hash *= 16777619u;
+    for (int i = 0; i < 11; i++) {
+        hash ^= name[i];
+        hash *= 16777619u;
+    }
+    return hash % DCACHE_CAPACITY;
+}
+
+static void lru_unlink(Dentry *d) {
+    if (d->lru_prev != NULL) {
+        d->lru_prev->lru_next = d->lru_next;
+    } else {
+        dcache.lru_head = d->lru_next;
+    }
+    if (d->lru_next != NULL) {
+        d->lru_next->lru_prev = d->lru_prev;
+    } else {
+        dcache.lru_tail = d->lru_prev;
+    }
+    d->lru_prev = d->lru_next = NULL;
+}
+
+static void lru_push_front(Dentry *d) {
+    d->lru_prev = NULL;
+    d->lru_next = dcache.lru_head;
+    if (dcache.lru_head != NULL) {
+        dcache.lru_head->lru_prev = d;
+    }
+    dcache.lru_head = d;
+    if (dcache.lru_tail == NULL) {
+        dcache.lru_tail = d;
+    }
+}
+
+static void remove_dentry(Dentry *d) {
+    Dentry **link = &dcache.buckets[hash_key(d->parent, d->name)];
+    while (*link != d) {
+        link = &(*link)->hash_next;
+    }
+    *link = d->hash_next;
+    lru_unlink(d);
+    dcache.count--;
+    free(d);
+}
+
+static Dentry *find_dentry(uint32_t parent, const uint8_t *name) {
+    for (Dentry *d = dcache.buckets[hash_key(parent, name)]; d != NULL; d = d->hash_next) {
+        if (d->parent == parent && memcmp(d->name, name, 11) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// Resolves one component, consulting the cache before the directory index.
+// Returns 1 when found.
+int dcache_lookup(BlockDevice *dev, FAT32BootSector *bs, uint32_t parent, const uint8_t *short_name, uint32_t *cluster, uint8_t *attr) {
+    pthread_mutex_lock(&dcache_lock);
+    Dentry *d = find_dentry(parent, short_name);
+    if (d != NULL) {
+        dcache.hits++;
+        lru_unlink(d);
+        lru_push_front(d);
+        *cluster = d->cluster;
+        *attr = d->attr;
+        pthread_mutex_unlock(&dcache_lock);
+        return 1;
+    }
+    dcache.misses++;
+    pthread_mutex_unlock(&dcache_lock);
+
+    const DirIndexEntry *found = dir_index_lookup(dir_index_get(dev, bs, parent), short_name);
+    if (found == NULL) {
+        return 0;
+    }
+    *cluster = entry_cluster(&found->entry);
+    *attr = found->entry.attr;
+
+    // A ".." entry pointing at cluster 0 means the root directory
+    if (*cluster == 0 && (*attr & ATTR_DIRECTORY)) {
+        *cluster = bs->root_cluster;
+    }
+
+    pthread_mutex_lock(&dcache_lock);
+    // Another session may have added the same entry in the meantime
+    if (find_dentry(parent, short_name) == NULL) {
+        if (dcache.count == DCACHE_CAPACITY) {
+            remove_dentry(dcache.lru_tail);
+        }
+        d = calloc(1, sizeof(Dentry));
+        d->parent = parent;
+        memcpy(d->name, short_name, 11);
+        d->cluster = *cluster;
+        d->attr = *attr;
+        uint32_t bucket = hash_key(parent, short_name);
+        d->hash_next = dcache.buckets[bucket];
+        dcache.buckets[bucket] = d;
+        lru_push_front(d);
+        dcache.count++;
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return 1;
+}
+
+void dcache_invalidate(uint32_t parent, const uint8_t *short_name) {
+    pthread_mutex_lock(&dcache_lock);
+    Dentry *d = find_dentry(parent, short_name);
+    if (d != NULL) {
+        remove_dentry(d);
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_clear(void) {
+    pthread_mutex_lock(&dcache_lock);
+    while (dcache.lru_head != NULL) {
+        remove_dentry(dcache.lru_head);
+    }
+    dcache.hits = 0;
+    dcache.misses = 0;
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// Resolves a relative or absolute path of any depth. "." and ".." are
+// followed through the directory entries themselves, so ".." chains work
+// from anywhere. Returns 0 and the final cluster and attribute on success.
+int path_resolve(BlockDevice *dev, FAT32BootSector *bs, uint32_t cwd_cluster, const char *path, uint32_t *cluster, uint8_t *attr) {
+    uint32_t current = (path[0] == '/') ? bs->root_cluster : cwd_cluster;
+    uint8_t current_attr = ATTR_DIRECTORY;
+    const char *p = path;
+
+    while (*p != '\0') {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+
+        const char *end = strchr(p, '/');
+        size_t length = end ? (size_t)(end - p) : strlen(p);
+        char component[MAX_PATH_LENGTH];
+        if (length >= sizeof(component)) {
+            return -1;
+        }
+        memcpy(component, p, length);
+        component[length] = '\0';
+        p += length;
+
+        // Only the last component may be something other than a directory
+        if ((current_attr & ATTR_DIRECTORY) == 0) {
+            return -1;
+        }
+        if (strcmp(component, ".") == 0) {
+            continue;
+        }
+        if (strcmp(component, "..") == 0 && current == bs->root_cluster) {
+            // The root directory is its own parent
+            continue;
+        }
+
+        // Long names are matched through the directory index; the
+        // dentry cache is always keyed by the entry's 8.3 alias. Each
+        // directory is read-locked only while its entry is looked up.
+        uint32_t parent = current;
+        uint8_t short_name[11];
+        int found = 0;
+        dir_lock(parent, 0);
+        if (name_to_short(component, short_name) == 0 && dcache_lookup(dev, bs, parent, short_name, &current, &current_attr)) {
+            found = 1;
+        } else {
+            const DirIndexEntry *entry = dir_index_find(dir_index_get(dev, bs, parent), component);
+            if (entry != NULL) {
+                memcpy(short_name, entry->entry.name, 11);
+                found = dcache_lookup(dev, bs, parent, short_name, &current, &current_attr);
+            }
+        }
+        dir_unlock(parent);
+        if (!found) {
+            return -1;
+        }
+    }
+
+    *cluster = current;
+    *attr = current_attr;
+    return 0;
+}
+
+// Resolves every component of PATH but the last, which is copied to
+// LEAF. Used by commands that act on a directory entry rather than on
+// what it points to. Returns -1 if the parent does not exist or the
+// path has no final component.
+int path_resolve_parent(BlockDevice *dev, FAT32BootSector *bs, uint32_t cwd_cluster, const char *path, uint32_t *parent, char *leaf, size_t leaf_size) {
+    char prefix[MAX_PATH_LENGTH];
+    size_t length = strlen(path);
+
+    while (length > 1 && path[length - 1] == '/') {
+        length--;
+    }
+    size_t start = length;
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+    if (start == length || length - start >= leaf_size || start >= sizeof(prefix)) {
+        return -1;
+    }
+    memcpy(leaf, path + start, length - start);
+    leaf[length - start] = '\0';
+
+    if (start == 0) {
+        *parent = cwd_cluster;
+        return 0;
+    }
+    memcpy(prefix, path, start);
+    prefix[start] = '\0';
+
+    uint8_t attr;
+    if (path_resolve(dev, bs, cwd_cluster, prefix, parent, &attr) != 0 || (attr & ATTR_DIRECTORY) == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Applies PATH to the displayed CURRENT_PATH ("" for the root, otherwise
+// "/A/B"), normalizing "." and "..". Returns -1 if the result would not fit.
+int path_join(char *current_path, size_t size, const char *path) {
+    char result[MAX_PATH_LENGTH];
+    size_t length = 0;
+    const char *p = path;
+
+    if (path[0] != '/') {
+        length = strlen(current_path);
+        if (length >= sizeof(result)) {
+            return -1;
+        }
+        memcpy(result, current_path, length);
+    }
+    result[length] = '\0';
+
+    while (*p != '\0') {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        const char *end = strchr(p, '/');
+        size_t component_length = end ? (size_t)(end - p) : strlen(p);
+
+        if (component_length == 1 && p[0] == '.') {
+            // Stay in the current directory
+        } else if (component_length == 2 && p[0] == '.' && p[1] == '.') {
+            char *last_slash = strrchr(result, '/');
+            length = last_slash ? (size_t)(last_slash - result) : 0;
+            result[length] = '\0';
+        } else {
+            if (length + component_length + 2 > sizeof(result)) {
+                return -1;
+            }
+            result[length++] = '/';
+            memcpy(result + length, p, component_length);
+            length += component_length;
+            result[length] = '\0';
+        }
+        p += component_length;
+    }
+
+    if (length + 1 > size) {
+        return -1;
+    }
+    memcpy(current_path, result, length + 1);
+    return 0;
+}
@@ -0,0 +1,211 @@
+#include "server.h"
+#include "handle.h"
+#include "locks.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Live sessions, so shutdown can reach every one and rm can tell which
+// directories are some session's working directory
+static Session *sessions;
+static uint32_t num_sessions;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sessions_done = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t stopping;
+
+static void handle_stop_signal(int signo) {
+    (void)signo;
+    stopping = 1;
+}
+
+// Whether CLUSTER is the working directory of any session. Only
+// meaningful under the exclusive image lock, which keeps every session
+// out of cd.
+int server_cwd_in_use(uint32_t cluster) {
+    int in_use = 0;
+    pthread_mutex_lock(&sessions_lock);
+    for (Session *session = sessions; session != NULL && !in_use; session = session->next) {
+        in_use = session->shell.current_cluster == cluster;
+    }
+    pthread_mutex_unlock(&sessions_lock);
+    return in_use;
+}
+
+static void unlink_session(Session *session) {
+    pthread_mutex_lock(&sessions_lock);
+    Session **link = &sessions;
+    while (*link != session) {
+        link = &(*link)->next;
+    }
+    *link = session->next;
+    num_sessions--;
+    pthread_cond_broadcast(&sessions_done);
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+// Reads commands from the client until it sends exit or hangs up. The
+// prompt is written after every command, so a client knows where the
+// output of one command ends.
+static void *session_main(void *arg) {
+    Session *session = arg;
+    Shell *sh = &session->shell;
+    Lexer lexer;
+    char *input;
+
+    shell_out = session->out;
+    lexer_init(&lexer);
+    while (sh->running) {
+        fprintf(shell_out, "[%s%s]/>", sh->image_path, sh->current_path);
+        fflush(shell_out);
+        input = lexer_read_line(&lexer, session->in);
+        if (input == NULL) {
+            break;
+        }
+        run_command(sh, lexer_tokenize(&lexer, input));
+    }
+    lexer_free(&lexer);
+
+    end_session(sh);
+    fflush(shell_out);
+    unlink_session(session);
+    fclose(session->in);
+    fclose(session->out);
+    free(session);
+    return NULL;
+}
+
+// Starts a thread serving the client on FD. FD is closed on failure.
+static int start_session(const Shell *shell, int fd) {
+    Session *session = calloc(1, sizeof(Session));
+    int out_fd = dup(fd);
+    FILE *in = fdopen(fd, "r");
+    FILE *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    if (session == NULL || in == NULL || out == NULL) {
+        if (in != NULL) {
+            fclose(in);
+        } else {
+            close(fd);
+        }
+        if (out != NULL) {
+            fclose(out);
+        } else if (out_fd >= 0) {
+            close(out_fd);
+        }
+        free(session);
+        return -1;
+    }
+    session->fd = fd;
+    session->in = in;
+    session->out = out;
+
+    session->shell.dev = shell->dev;
+    session->shell.bs = shell->bs;
+    session->shell.image_path = shell->image_path;
+    session->shell.current_cluster = shell->bs.root_cluster;
+    session->shell.running = 1;
+    session->shell.session = 1;
+
+    pthread_mutex_lock(&sessions_lock);
+    session->next = sessions;
+    sessions = session;
+    num_sessions++;
+    pthread_mutex_unlock(&sessions_lock);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, session_main, session) != 0) {
+        unlink_session(session);
+        fclose(session->in);
+        fclose(session->out);
+        free(session);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Serves the mounted image to clients connecting on SOCKET_PATH until
+// SIGINT or SIGTERM. Open sessions are then disconnected, and each one
+// flushes its open files before this returns.
+int server_run(Shell *shell, const char *socket_path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long.\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    // A socket left behind by an earlier server is replaced; anything
+    // else at the path (an image given by mistake, say) is left alone
+    struct stat st;
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Error: '%s' exists and is not a socket.\n", socket_path);
+            return -1;
+        }
+        if (unlink(socket_path) != 0) {
+            perror("Error removing old socket");
+            return -1;
+        }
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("Error creating socket");
+        return -1;
+    }
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, SERVER_BACKLOG) != 0) {
+        perror("Error listening on socket");
+        close(listener);
+        return -1;
+    }
+
+    // No SA_RESTART, so a signal interrupts accept
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    // A client hanging up mid-reply must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving '%s' on '%s'.\n", shell->image_path, socket_path);
+    fflush(stdout);
+
+    while (!stopping) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("Error accepting connection");
+                break;
+            }
+            continue;
+        }
+        if (start_session(shell, fd) != 0) {
+            fprintf(stderr, "Error: Unable to start a session.\n");
+        }
+    }
+    close(listener);
+    unlink(socket_path);
+
+    // Hang up on every client; each session then ends as if it had read
+    // end of input
+    pthread_mutex_lock(&sessions_lock);
+    for (Session *session = sessions; session != NULL; session = session->next) {
+        shutdown(session->fd, SHUT_RDWR);
+    }
+    while (num_sessions > 0) {
+        pthread_cond_wait(&sessions_done, &sessions_lock);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+    return 0;
+}
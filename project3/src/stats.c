@@ -0,0 +1,160 @@
+#include "stats.h"
+
+#ifdef FS_STATS
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+__thread IoCounters stats_io;
+
+// Guards the per-command totals and the trace file, shared by every session
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static CommandStats *command_stats;
+static size_t num_command_stats;
+static FILE *trace_file;
+static uint64_t trace_origin;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Values below STATS_HIST_SUB get a bucket each; above that every power
+// of two is split into STATS_HIST_SUB equal buckets, so the percentiles
+// are accurate to within 1/8 of the value
+static uint32_t bucket_of(uint64_t value) {
+    if (value < STATS_HIST_SUB) {
+        return (uint32_t)value;
+    }
+    uint32_t msb = 63 - (uint32_t)__builtin_clzll(value);
+    uint32_t group = msb - 2;
+    uint32_t bucket = group * STATS_HIST_SUB + (uint32_t)((value >> (msb - 3)) & (STATS_HIST_SUB - 1));
+    return bucket < STATS_HIST_BUCKETS ? bucket : STATS_HIST_BUCKETS - 1;
+}
+
+static uint64_t bucket_value(uint32_t bucket) {
+    if (bucket < STATS_HIST_SUB) {
+        return bucket;
+    }
+    uint32_t group = bucket / STATS_HIST_SUB;
+    uint64_t sub = bucket % STATS_HIST_SUB;
+    return (STATS_HIST_SUB + sub) << (group - 1);
+}
+
+static uint64_t percentile(const CommandStats *stats, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * stats->calls + 0.5);
+    uint64_t seen = 0;
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (uint32_t bucket = 0; bucket < STATS_HIST_BUCKETS; bucket++) {
+        seen += stats->histogram[bucket];
+        if (seen >= rank) {
+            return bucket_value(bucket);
+        }
+    }
+    return stats->max_ns;
+}
+
+void stats_init(size_t num_commands) {
+    command_stats = calloc(num_commands, sizeof(CommandStats));
+    num_command_stats = command_stats ? num_commands : 0;
+    memset(&stats_io, 0, sizeof(stats_io));
+    trace_origin = now_ns();
+}
+
+void stats_free(void) {
+    stats_trace_close();
+    free(command_stats);
+    command_stats = NULL;
+    num_command_stats = 0;
+}
+
+uint64_t stats_begin(void) {
+    memset(&stats_io, 0, sizeof(stats_io));
+    return now_ns();
+}
+
+// Charges the time since START and the I/O counted since stats_begin
+// to COMMAND, and appends a record to the trace file if one is open
+void stats_end(size_t command, const char *name, uint64_t start) {
+    uint64_t end = now_ns();
+    uint64_t elapsed = end - start;
+    if (command >= num_command_stats) {
+        return;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    CommandStats *stats = &command_stats[command];
+    stats->name = name;
+    stats->calls++;
+    stats->total_ns += elapsed;
+    if (elapsed > stats->max_ns) {
+        stats->max_ns = elapsed;
+    }
+    stats->histogram[bucket_of(elapsed)]++;
+    stats->io.clusters_read += stats_io.clusters_read;
+    stats->io.clusters_written += stats_io.clusters_written;
+    stats->io.fat_entries += stats_io.fat_entries;
+    stats->io.seeks += stats_io.seeks;
+    stats->io.bytes_read += stats_io.bytes_read;
+    stats->io.bytes_written += stats_io.bytes_written;
+
+    if (trace_file != NULL) {
+        fprintf(trace_file, "%s,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n", name,
+                (unsigned long long)((start - trace_origin) / 1000), (unsigned long long)(elapsed / 1000),
+                (unsigned long long)stats_io.clusters_read, (unsigned long long)stats_io.clusters_written,
+                (unsigned long long)stats_io.fat_entries, (unsigned long long)stats_io.seeks,
+                (unsigned long long)stats_io.bytes_read, (unsigned long long)stats_io.bytes_written);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_report(FILE *out) {
+    pthread_mutex_lock(&stats_lock);
+    fprintf(out, "%-8s %8s %10s %9s %9s %9s %9s %9s %8s\n",
+            "COMMAND", "CALLS", "TOTAL_MS", "P50_US", "P99_US", "CL_READ", "CL_WRITE", "FAT_ENT", "SEEKS");
+    for (size_t i = 0; i < num_command_stats; i++) {
+        const CommandStats *stats = &command_stats[i];
+        if (stats->calls == 0) {
+            continue;
+        }
+        fprintf(out, "%-8s %8llu %10.3f %9.1f %9.1f %9llu %9llu %9llu %8llu\n", stats->name,
+                (unsigned long long)stats->calls, stats->total_ns / 1e6,
+                percentile(stats, 0.50) / 1e3, percentile(stats, 0.99) / 1e3,
+                (unsigned long long)stats->io.clusters_read, (unsigned long long)stats->io.clusters_written,
+                (unsigned long long)stats->io.fat_entries, (unsigned long long)stats->io.seeks);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Starts writing one CSV record per command to PATH; the file is
+// completed when tracing is turned off or at exit
+int stats_trace_open(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    fprintf(file, "command,start_us,duration_us,clusters_read,clusters_written,fat_entries,seeks,bytes_read,bytes_written\n");
+
+    stats_trace_close();
+    pthread_mutex_lock(&stats_lock);
+    trace_file = file;
+    pthread_mutex_unlock(&stats_lock);
+    return 0;
+}
+
+void stats_trace_close(void) {
+    pthread_mutex_lock(&stats_lock);
+    if (trace_file != NULL) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+#endif // FS_STATS
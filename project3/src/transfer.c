@@ -0,0 +1,877 @@
+#include "transfer.h"
+#include "dir_index.h"
+#include "fat_table.h"
+#include "ioengine.h"
+#include "lfn.h"
+#include "path.h"
+#include "walk.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+// ---------------------------------------------------------------------
+// Pipeline
+
+static void pipe_init(TransferPipe *pipe) {
+    memset(pipe, 0, sizeof(*pipe));
+    for (int i = 0; i < TRANSFER_SLOTS; i++) {
+        pipe->slots[i].buffer = malloc(TRANSFER_CHUNK_BYTES);
+    }
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->changed, NULL);
+}
+
+static void pipe_destroy(TransferPipe *pipe) {
+    for (int i = 0; i < TRANSFER_SLOTS; i++) {
+        free(pipe->slots[i].buffer);
+    }
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->changed);
+}
+
+// Waits until the slot at INDEX is free and returns it emptied, or NULL
+// once the consumer has given up
+static TransferSlot *pipe_take_empty(TransferPipe *pipe, int index) {
+    TransferSlot *slot = &pipe->slots[index];
+    pthread_mutex_lock(&pipe->lock);
+    while (slot->full && !pipe->failed) {
+        pthread_cond_wait(&pipe->changed, &pipe->lock);
+    }
+    int failed = pipe->failed;
+    pthread_mutex_unlock(&pipe->lock);
+    if (failed) {
+        return NULL;
+    }
+    slot->num_segments = 0;
+    slot->used = 0;
+    return slot;
+}
+
+static void pipe_publish(TransferPipe *pipe, TransferSlot *slot) {
+    pthread_mutex_lock(&pipe->lock);
+    slot->full = 1;
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+// Waits for the slot at INDEX to be filled. Returns NULL when the
+// producer has finished (or either side failed) and nothing is left.
+static TransferSlot *pipe_take_full(TransferPipe *pipe, int index) {
+    TransferSlot *slot = &pipe->slots[index];
+    pthread_mutex_lock(&pipe->lock);
+    while (!slot->full && !pipe->done && !pipe->failed) {
+        pthread_cond_wait(&pipe->changed, &pipe->lock);
+    }
+    int ready = slot->full && !pipe->failed;
+    pthread_mutex_unlock(&pipe->lock);
+    return ready ? slot : NULL;
+}
+
+static void pipe_release(TransferPipe *pipe, TransferSlot *slot) {
+    pthread_mutex_lock(&pipe->lock);
+    slot->full = 0;
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+static void pipe_finish(TransferPipe *pipe, int failed) {
+    pthread_mutex_lock(&pipe->lock);
+    pipe->done = 1;
+    if (failed) {
+        pipe->failed = 1;
+    }
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+// Appends a device request for LENGTH bytes at OFFSET, extending the
+// previous one when both the device range and the buffer continue it
+static void add_request(IoRequest **requests, size_t *count, size_t *capacity, int write, uint64_t offset, uint8_t *buffer, size_t length) {
+    if (*count > 0) {
+        IoRequest *last = &(*requests)[*count - 1];
+        if (last->offset + last->length == offset && (uint8_t *)last->buffer + last->length == buffer &&
+            last->length + length <= IO_SPLIT_BYTES) {
+            last->length += length;
+            return;
+        }
+    }
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *requests = realloc(*requests, *capacity * sizeof(IoRequest));
+    }
+    (*requests)[(*count)++] = (IoRequest){ write, offset, buffer, length, 0 };
+}
+
+// Position in one file's cluster chain, moved forward as its pieces
+// stream past in order
+typedef struct {
+    uint32_t item;
+    uint32_t cluster;
+    uint32_t index;        // cluster number within the file
+} ChainCursor;
+
+// Adds requests moving LENGTH bytes at OFFSET of a file (whose chain
+// starts at FIRST) to or from BUFFER. Returns the bytes covered, less
+// than LENGTH if the chain ends early.
+static uint32_t add_file_requests(FAT32BootSector *bs, ChainCursor *cursor, uint32_t item, uint32_t first, uint32_t offset, uint8_t *buffer, uint32_t length,
+                                  int write, IoRequest **requests, size_t *count, size_t *capacity) {
+    uint32_t csize = cluster_size(bs);
+    uint32_t done = 0;
+
+    if (cursor->item != item || offset / csize < cursor->index) {
+        cursor->item = item;
+        cursor->cluster = first;
+        cursor->index = 0;
+    }
+    while (done < length) {
+        uint32_t index = (offset + done) / csize;
+        while (cursor->index < index && cursor->cluster >= 2 && cursor->cluster < FAT_EOC) {
+            cursor->cluster = fat_table_get(cursor->cluster);
+            cursor->index++;
+        }
+        if (cursor->cluster < 2 || cursor->cluster >= FAT_EOC || cursor->cluster >= fat_table.num_entries) {
+            break;
+        }
+        uint32_t inner = (offset + done) % csize;
+        uint32_t piece = csize - inner < length - done ? csize - inner : length - done;
+        add_request(requests, count, capacity, write, cluster_to_offset(bs, cursor->cluster) + inner, buffer + done, piece);
+        done += piece;
+    }
+    return done;
+}
+
+// ---------------------------------------------------------------------
+// Import
+
+// One file or directory of the host tree. Children of a directory are
+// contiguous in the node array, in the order their entries are written.
+typedef struct {
+    char *name;
+    char *host_path;
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t num_children;
+    uint32_t size;
+    uint32_t clusters;
+    uint32_t first_cluster;
+    uint8_t short_name[11];
+    uint8_t is_dir;
+    uint8_t lfn_count;     // long name entries in front of its short entry
+    uint8_t unreadable;    // the host file could not be read in full
+} ImportNode;
+
+typedef struct {
+    ImportNode *nodes;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t files;
+    uint32_t directories;
+    uint32_t skipped;
+    uint32_t unreadable;
+    uint64_t bytes;
+    uint64_t clusters;
+    uint32_t csize;
+} ImportPlan;
+
+typedef struct {
+    ImportPlan *plan;
+    TransferPipe *pipe;
+} ImportReader;
+
+static uint32_t plan_push(ImportPlan *plan) {
+    if (plan->count == plan->capacity) {
+        plan->capacity = plan->capacity ? plan->capacity * 2 : 256;
+        plan->nodes = realloc(plan->nodes, plan->capacity * sizeof(ImportNode));
+    }
+    memset(&plan->nodes[plan->count], 0, sizeof(ImportNode));
+    return plan->count++;
+}
+
+static void plan_free(ImportPlan *plan) {
+    for (uint32_t i = 0; i < plan->count; i++) {
+        free(plan->nodes[i].name);
+        free(plan->nodes[i].host_path);
+    }
+    free(plan->nodes);
+}
+
+static int compare_nodes(const void *a, const void *b) {
+    return strcasecmp(((const ImportNode *)a)->name, ((const ImportNode *)b)->name);
+}
+
+// Open-addressing set of the 8.3 names taken in one directory
+typedef struct {
+    uint8_t (*names)[11];
+    uint32_t mask;
+} ShortNameSet;
+
+static uint32_t short_name_home(const ShortNameSet *set, const uint8_t *name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 11; i++) {
+        hash = (hash ^ name[i]) * 16777619u;
+    }
+    return hash & set->mask;
+}
+
+// Adds NAME to the set. Returns -1 if it was already there.
+static int short_name_add(ShortNameSet *set, const uint8_t *name) {
+    uint32_t i = short_name_home(set, name);
+    while (set->names[i][0] != 0) {
+        if (memcmp(set->names[i], name, 11) == 0) {
+            return -1;
+        }
+        i = (i + 1) & set->mask;
+    }
+    memcpy(set->names[i], name, 11);
+    return 0;
+}
+
+// Gives every child an 8.3 name unique within the directory: names that
+// fit are used as they are, the others get "~N" aliases. Children come
+// sorted, so similar long names share a basis in a row and the tail
+// counter simply carries on.
+static void assign_short_names(ImportNode *children, uint32_t count) {
+    ShortNameSet set;
+    uint32_t capacity = 16;
+    while (capacity < count * 2) {
+        capacity <<= 1;
+    }
+    set.names = calloc(capacity, 11);
+    set.mask = capacity - 1;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (children[i].lfn_count == 0) {
+            short_name_add(&set, children[i].short_name);
+        }
+    }
+
+    uint8_t last_basis[11];
+    uint32_t next = 1;
+    memset(last_basis, 0, sizeof(last_basis));
+    for (uint32_t i = 0; i < count; i++) {
+        if (children[i].lfn_count == 0) {
+            continue;
+        }
+        uint8_t basis[11];
+        lfn_short_basis(children[i].name, basis);
+        if (memcmp(basis, last_basis, 11) != 0) {
+            memcpy(last_basis, basis, 11);
+            next = 1;
+        }
+        do {
+            lfn_apply_tail(children[i].short_name, basis, next++);
+        } while (short_name_add(&set, children[i].short_name) != 0);
+    }
+    free(set.names);
+}
+
+// Reads the host directory behind node DIR and appends its usable
+// entries as that node's children, sorted by name. Entries that cannot
+// be stored (other file types, invalid names, names differing only in
+// case, files of 4 GiB or more) are reported and left out.
+static void scan_host_directory(ImportPlan *plan, uint32_t dir) {
+    DIR *host = opendir(plan->nodes[dir].host_path);
+    if (host == NULL) {
+        fprintf(shell_out, "Warning: Unable to read '%s'; it is imported empty.\n", plan->nodes[dir].host_path);
+        plan->skipped++;
+        return;
+    }
+
+    ImportNode *found = NULL;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+    struct dirent *item;
+    while ((item = readdir(host)) != NULL) {
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) {
+            continue;
+        }
+        size_t length = strlen(plan->nodes[dir].host_path) + strlen(item->d_name) + 2;
+        char *path = malloc(length);
+        snprintf(path, length, "%s/%s", plan->nodes[dir].host_path, item->d_name);
+
+        struct stat st;
+        uint16_t units[LFN_MAX_UNITS];
+        const char *reason = NULL;
+        if (lstat(path, &st) != 0 || (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))) {
+            reason = "not a regular file or directory";
+        } else if (S_ISREG(st.st_mode) && (uint64_t)st.st_size > UINT32_MAX) {
+            reason = "too large for FAT32";
+        } else if (lfn_encode(item->d_name, units) < 0) {
+            reason = "not a valid FAT name";
+        }
+        if (reason != NULL) {
+            fprintf(shell_out, "Warning: Skipping '%s': %s.\n", path, reason);
+            plan->skipped++;
+            free(path);
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            found = realloc(found, capacity * sizeof(ImportNode));
+        }
+        ImportNode *node = &found[count++];
+        memset(node, 0, sizeof(*node));
+        node->name = strdup(item->d_name);
+        node->host_path = path;
+        node->is_dir = S_ISDIR(st.st_mode);
+        node->size = node->is_dir ? 0 : (uint32_t)st.st_size;
+        if (name_to_short(node->name, node->short_name) != 0) {
+            node->lfn_count = (uint8_t)lfn_entry_count(lfn_encode(node->name, units));
+        }
+    }
+    closedir(host);
+
+    // FAT compares names without regard to case, so of names that differ
+    // only in case the first one wins
+    qsort(found, count, sizeof(ImportNode), compare_nodes);
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (kept > 0 && strcasecmp(found[kept - 1].name, found[i].name) == 0) {
+            fprintf(shell_out, "Warning: Skipping '%s': name clashes with '%s'.\n", found[i].host_path, found[kept - 1].name);
+            plan->skipped++;
+            free(found[i].name);
+            free(found[i].host_path);
+            continue;
+        }
+        found[kept++] = found[i];
+    }
+    assign_short_names(found, kept);
+
+    uint32_t first = plan->count;
+    for (uint32_t i = 0; i < kept; i++) {
+        uint32_t index = plan_push(plan);
+        found[i].parent = dir;
+        plan->nodes[index] = found[i];
+    }
+    plan->nodes[dir].first_child = first;
+    plan->nodes[dir].num_children = kept;
+    free(found);
+}
+
+// Cluster counts: files by size, directories by their entries ("." and
+// "..", then each child's long name fragments and short entry)
+static void size_node(ImportPlan *plan, ImportNode *node) {
+    if (node->is_dir) {
+        uint64_t slots = 2;
+        for (uint32_t i = 0; i < node->num_children; i++) {
+            slots += 1 + plan->nodes[node->first_child + i].lfn_count;
+        }
+        node->clusters = (uint32_t)((slots * sizeof(DirectoryEntry) + plan->csize - 1) / plan->csize);
+        plan->directories++;
+    } else {
+        node->clusters = (uint32_t)(((uint64_t)node->size + plan->csize - 1) / plan->csize);
+        plan->files++;
+        plan->bytes += node->size;
+    }
+    plan->clusters += node->clusters;
+}
+
+static void release_chains(ImportPlan *plan) {
+    for (uint32_t i = 0; i < plan->count; i++) {
+        if (plan->nodes[i].first_cluster != 0) {
+            fat_table_free_chain(plan->nodes[i].first_cluster);
+            plan->nodes[i].first_cluster = 0;
+        }
+    }
+}
+
+// Claims the clusters of every node in one forward sweep of the cached
+// FAT: each chain starts where the previous one ended, so a tree going
+// onto free space is laid out contiguously in node order. Everything is
+// released again if the volume runs out part way.
+static int allocate_plan(ImportPlan *plan) {
+    fat_table_lock();
+    if (plan->clusters > fat_table.free_count) {
+        fat_table_unlock();
+        return -1;
+    }
+
+    uint32_t goal = fat_table.next_free;
+    for (uint32_t i = 0; i < plan->count; i++) {
+        ImportNode *node = &plan->nodes[i];
+        uint32_t remaining = node->clusters;
+        uint32_t last = 0;
+        while (remaining > 0) {
+            uint32_t length;
+            uint32_t start = fat_table_find_run(remaining, goal, &length);
+            if (start == 0) {
+                release_chains(plan);
+                fat_table_unlock();
+                return -1;
+            }
+            for (uint32_t k = 0; k < length; k++) {
+                fat_table_set(start + k, k + 1 < length ? start + k + 1 : 0x0FFFFFFF);
+            }
+            if (last != 0) {
+                fat_table_set(last, start);
+            } else {
+                node->first_cluster = start;
+            }
+            last = start + length - 1;
+            remaining -= length;
+            goal = last + 1;
+        }
+    }
+    fat_table_unlock();
+    return 0;
+}
+
+static void fill_entry(DirectoryEntry *entry, const ImportNode *node) {
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->name, node->short_name, 11);
+    entry->attr = node->is_dir ? ATTR_DIRECTORY : ATTR_ARCHIVE;
+    entry->firstclusthi = (node->first_cluster >> 16) & 0xFFFF;
+    entry->firstclustlo = node->first_cluster & 0xFFFF;
+    entry->filesize = node->size;
+}
+
+// Builds the whole contents of a new directory in memory and writes its
+// clusters with one batch, instead of one cached write per entry
+static int write_directory(BlockDevice *dev, FAT32BootSector *bs, ImportPlan *plan, uint32_t dir, uint32_t parent_cluster) {
+    ImportNode *node = &plan->nodes[dir];
+    size_t length = (size_t)node->clusters * plan->csize;
+    DirectoryEntry *entries = calloc(1, length);
+    uint32_t slot = 2;
+
+    create_special_entries(entries, node->first_cluster, parent_cluster == bs->root_cluster ? 0 : parent_cluster);
+    for (uint32_t i = 0; i < node->num_children; i++) {
+        const ImportNode *child = &plan->nodes[node->first_child + i];
+        if (child->lfn_count > 0) {
+            uint16_t units[LFN_MAX_UNITS];
+            int units_length = lfn_encode(child->name, units);
+            lfn_fill_entries(units, units_length, lfn_checksum(child->short_name), &entries[slot]);
+            slot += child->lfn_count;
+        }
+        fill_entry(&entries[slot++], child);
+    }
+
+    IoRequest *requests = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    ChainCursor cursor = { UINT32_MAX, 0, 0 };
+    add_file_requests(bs, &cursor, dir, node->first_cluster, 0, (uint8_t *)entries, (uint32_t)length, 1, &requests, &count, &capacity);
+    int result = dev_submit(dev, requests, count);
+    free(requests);
+    free(entries);
+    return result;
+}
+
+// Reader thread: streams the contents of every file in node order into
+// the pipe. A file that cannot be read in full is padded with zeros so
+// the layout planned for it stays valid.
+static void *import_reader(void *arg) {
+    ImportReader *reader = arg;
+    ImportPlan *plan = reader->plan;
+    TransferPipe *pipe = reader->pipe;
+    int next = 0;
+    TransferSlot *slot = pipe_take_empty(pipe, next);
+
+    for (uint32_t i = 0; i < plan->count && slot != NULL; i++) {
+        ImportNode *node = &plan->nodes[i];
+        if (node->is_dir || node->size == 0) {
+            continue;
+        }
+        FILE *in = fopen(node->host_path, "rb");
+        uint32_t offset = 0;
+        while (offset < node->size && slot != NULL) {
+            if (slot->used == TRANSFER_CHUNK_BYTES || slot->num_segments == TRANSFER_SEGMENTS) {
+                pipe_publish(pipe, slot);
+                next = (next + 1) % TRANSFER_SLOTS;
+                slot = pipe_take_empty(pipe, next);
+                continue;
+            }
+            uint32_t length = TRANSFER_CHUNK_BYTES - slot->used;
+            if (length > node->size - offset) {
+                length = node->size - offset;
+            }
+            uint8_t *data = slot->buffer + slot->used;
+            size_t got = in != NULL ? fread(data, 1, length, in) : 0;
+            if (got < length) {
+                memset(data + got, 0, length - got);
+                node->unreadable = 1;
+            }
+            slot->segments[slot->num_segments++] = (TransferSegment){ i, offset, length, slot->used };
+            slot->used += length;
+            offset += length;
+        }
+        if (in != NULL) {
+            fclose(in);
+        }
+    }
+    if (slot != NULL && slot->num_segments > 0) {
+        pipe_publish(pipe, slot);
+    }
+    pipe_finish(pipe, 0);
+    return NULL;
+}
+
+// Writer side, on the command's thread: every chunk becomes one batch of
+// device writes, merged wherever pieces are contiguous on the volume
+static int import_writer(BlockDevice *dev, FAT32BootSector *bs, ImportPlan *plan, TransferPipe *pipe) {
+    ChainCursor cursor = { UINT32_MAX, 0, 0 };
+    IoRequest *requests = NULL;
+    size_t capacity = 0;
+    int result = 0;
+    int next = 0;
+    TransferSlot *slot;
+
+    while ((slot = pipe_take_full(pipe, next)) != NULL) {
+        size_t count = 0;
+        for (uint32_t s = 0; s < slot->num_segments; s++) {
+            const TransferSegment *segment = &slot->segments[s];
+            const ImportNode *node = &plan->nodes[segment->item];
+            add_file_requests(bs, &cursor, segment->item, node->first_cluster, segment->offset, slot->buffer + segment->position,
+                              segment->length, 1, &requests, &count, &capacity);
+        }
+        if (dev_submit(dev, requests, count) != 0) {
+            result = -1;
+            pipe_finish(pipe, 1);
+            break;
+        }
+        pipe_release(pipe, slot);
+        next = (next + 1) % TRANSFER_SLOTS;
+    }
+    free(requests);
+    return result;
+}
+
+static const char *host_basename(char *path) {
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/') {
+        path[--length] = '\0';
+    }
+    const char *slash = strrchr(path, '/');
+    return slash != NULL && slash[1] != '\0' ? slash + 1 : path;
+}
+
+// Copies the host directory HOST_PATH, with everything below it, into a
+// new directory of the same name in the current directory. The whole
+// tree is planned first, so its clusters are claimed in one pass and
+// each new directory is written exactly once; file data then streams
+// from a host reader thread to the device, and the new directory only
+// becomes visible once all of it is on the image.
+void handle_import_tree_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *host_path) {
+    ImportPlan plan;
+    char *root_path = strdup(host_path);
+    const char *name = host_basename(root_path);
+
+    if (!dev->writable) {
+        fprintf(shell_out, "Error: The image is read-only.\n");
+        free(root_path);
+        return;
+    }
+    uint16_t units[LFN_MAX_UNITS];
+    if (lfn_encode(name, units) < 0) {
+        fprintf(shell_out, "Error: '%s' is not a valid file name.\n", name);
+        free(root_path);
+        return;
+    }
+    if (dir_find_entry(dev, bs, current_cluster, name, NULL, NULL)) {
+        fprintf(shell_out, "Error: Directory or file with the name '%s' already exists.\n", name);
+        free(root_path);
+        return;
+    }
+
+    memset(&plan, 0, sizeof(plan));
+    plan.csize = cluster_size(bs);
+    uint32_t root = plan_push(&plan);
+    plan.nodes[root].name = strdup(name);
+    plan.nodes[root].host_path = root_path;
+    plan.nodes[root].is_dir = 1;
+
+    // Breadth first: the node array grows behind this loop
+    for (uint32_t i = 0; i < plan.count; i++) {
+        if (plan.nodes[i].is_dir) {
+            scan_host_directory(&plan, i);
+        }
+    }
+    for (uint32_t i = 0; i < plan.count; i++) {
+        size_node(&plan, &plan.nodes[i]);
+    }
+
+    if (allocate_plan(&plan) != 0) {
+        fprintf(shell_out, "Error: Not enough space to import '%s' (%llu clusters needed).\n", host_path,
+                (unsigned long long)plan.clusters);
+        plan_free(&plan);
+        return;
+    }
+
+    TransferPipe pipe;
+    ImportReader reader = { &plan, &pipe };
+    pthread_t thread;
+    pipe_init(&pipe);
+    pthread_create(&thread, NULL, import_reader, &reader);
+    int failed = import_writer(dev, bs, &plan, &pipe) != 0;
+    pthread_join(thread, NULL);
+    pipe_destroy(&pipe);
+
+    for (uint32_t i = 0; i < plan.count && !failed; i++) {
+        ImportNode *node = &plan.nodes[i];
+        if (node->is_dir) {
+            uint32_t parent_cluster = i == root ? current_cluster : plan.nodes[node->parent].first_cluster;
+            failed = write_directory(dev, bs, &plan, i, parent_cluster) != 0;
+        }
+        if (node->unreadable) {
+            fprintf(shell_out, "Warning: '%s' could not be read in full; the rest is zero-filled.\n", node->host_path);
+        }
+    }
+
+    // The new clusters are written directly, not through the journal, so
+    // they are synced before the FAT and then the entry make them
+    // reachable
+    DirectoryEntry entry;
+    if (!failed) {
+        failed = dev_sync(dev) != 0 || fat_table_flush(dev, bs, NULL) != 0;
+    }
+    if (!failed) {
+        fill_entry(&entry, &plan.nodes[root]);
+        int result = dir_create_entry(dev, bs, current_cluster, name, &entry, NULL);
+        if (result != DIR_CREATE_OK) {
+            release_chains(&plan);
+            fprintf(shell_out, "Error: Unable to add '%s' to the current directory.\n", name);
+            plan_free(&plan);
+            return;
+        }
+    }
+    if (failed) {
+        release_chains(&plan);
+        fprintf(shell_out, "Error: Failed to write '%s' to the image.\n", host_path);
+        plan_free(&plan);
+        return;
+    }
+
+    fprintf(shell_out, "Imported '%s': %u files, %u directories, %llu bytes in %llu clusters.\n", name, plan.files,
+            plan.directories, (unsigned long long)plan.bytes, (unsigned long long)plan.clusters);
+    if (plan.skipped > 0) {
+        fprintf(shell_out, "Skipped %u entries that cannot be stored.\n", plan.skipped);
+    }
+    plan_free(&plan);
+}
+
+// ---------------------------------------------------------------------
+// Export
+
+typedef struct {
+    char *host_path;
+    uint32_t cluster;
+    uint32_t size;
+} ExportFile;
+
+typedef struct {
+    const char *host_root;
+    ExportFile *files;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t directories;
+    uint32_t failures;     // host files or directories that could not be written
+    uint32_t damaged;      // files whose chain ends before their size
+    uint64_t bytes;
+    TransferPipe *pipe;
+} ExportState;
+
+static char *host_child_path(const char *root, const char *dir_path, const char *name) {
+    size_t length = strlen(root) + strlen(dir_path) + strlen(name) + 2;
+    char *path = malloc(length);
+    snprintf(path, length, "%s%s/%s", root, dir_path, name);
+    return path;
+}
+
+// Creates host directories as the walk reaches them and collects files
+static int export_visit(const WalkDir *dir, const DirectoryEntry *entry, const DirSlot *slot, const char *name, void *arg) {
+    ExportState *state = arg;
+    (void)slot;
+
+    if (entry == NULL) {
+        return WALK_CONTINUE;
+    }
+    // A crafted image can hold short names with '/' in them; nothing may
+    // land outside the target directory
+    if (name[0] == '\0' || strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        fprintf(shell_out, "Warning: Skipping an entry of '%s' named '%s': not a usable host name.\n", dir->path[0] ? dir->path : "/", name);
+        return WALK_SKIP;
+    }
+    char *path = host_child_path(state->host_root, dir->path, name);
+    if (entry->attr & ATTR_DIRECTORY) {
+        if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+            fprintf(shell_out, "Error: Unable to create '%s'.\n", path);
+            state->failures++;
+            free(path);
+            return WALK_SKIP;
+        }
+        state->directories++;
+        free(path);
+        return WALK_CONTINUE;
+    }
+
+    if (state->count == state->capacity) {
+        state->capacity = state->capacity ? state->capacity * 2 : 256;
+        state->files = realloc(state->files, state->capacity * sizeof(ExportFile));
+    }
+    state->files[state->count++] = (ExportFile){ path, entry_cluster(entry), entry->filesize };
+    return WALK_CONTINUE;
+}
+
+static int compare_export_files(const void *a, const void *b) {
+    uint32_t x = ((const ExportFile *)a)->cluster;
+    uint32_t y = ((const ExportFile *)b)->cluster;
+    return (x > y) - (x < y);
+}
+
+// Writer thread: appends every piece to its host file. Each file gets at
+// least one (possibly empty) piece, so empty files are created too.
+static void *export_writer(void *arg) {
+    ExportState *state = arg;
+    TransferPipe *pipe = state->pipe;
+    uint32_t current = UINT32_MAX;
+    FILE *out = NULL;
+    int next = 0;
+    TransferSlot *slot;
+
+    while ((slot = pipe_take_full(pipe, next)) != NULL) {
+        for (uint32_t s = 0; s < slot->num_segments; s++) {
+            const TransferSegment *segment = &slot->segments[s];
+            if (segment->item != current) {
+                if (out != NULL) {
+                    fclose(out);
+                }
+                current = segment->item;
+                out = fopen(state->files[current].host_path, "wb");
+                if (out == NULL) {
+                    state->failures++;
+                }
+            }
+            if (out != NULL && segment->length > 0 && fwrite(slot->buffer + segment->position, 1, segment->length, out) != segment->length) {
+                state->failures++;
+                fclose(out);
+                out = NULL;
+            }
+        }
+        pipe_release(pipe, slot);
+        next = (next + 1) % TRANSFER_SLOTS;
+    }
+    if (out != NULL) {
+        fclose(out);
+    }
+    return NULL;
+}
+
+// Reader side, on the command's thread: fills each chunk with one batch
+// of device reads. Files are taken in order of their first cluster, so
+// the device sees one forward sweep over the volume.
+static int export_reader(BlockDevice *dev, FAT32BootSector *bs, ExportState *state) {
+    TransferPipe *pipe = state->pipe;
+    ChainCursor cursor = { UINT32_MAX, 0, 0 };
+    IoRequest *requests = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    int result = 0;
+    int next = 0;
+    TransferSlot *slot = pipe_take_empty(pipe, next);
+
+    for (uint32_t i = 0; i < state->count && slot != NULL; i++) {
+        ExportFile *file = &state->files[i];
+        uint32_t offset = 0;
+        // Every file gets at least one segment, an empty one for an empty
+        // file, so the loop only ends once a segment has been added
+        while (1) {
+            if (slot->used == TRANSFER_CHUNK_BYTES || slot->num_segments == TRANSFER_SEGMENTS) {
+                if (dev_submit(dev, requests, count) != 0) {
+                    result = -1;
+                    slot = NULL;
+                    break;
+                }
+                count = 0;
+                pipe_publish(pipe, slot);
+                next = (next + 1) % TRANSFER_SLOTS;
+                slot = pipe_take_empty(pipe, next);
+                if (slot == NULL) {
+                    break;
+                }
+                continue;
+            }
+            uint32_t length = TRANSFER_CHUNK_BYTES - slot->used;
+            if (length > file->size - offset) {
+                length = file->size - offset;
+            }
+            uint32_t got = add_file_requests(bs, &cursor, i, file->cluster, offset, slot->buffer + slot->used, length, 0, &requests, &count, &capacity);
+            slot->segments[slot->num_segments++] = (TransferSegment){ i, offset, got, slot->used };
+            slot->used += got;
+            offset += got;
+            state->bytes += got;
+            if (got < length) {
+                state->damaged++;
+                break;
+            }
+            if (offset >= file->size) {
+                break;
+            }
+        }
+    }
+    if (slot != NULL && slot->num_segments > 0) {
+        if (dev_submit(dev, requests, count) != 0) {
+            result = -1;
+        } else {
+            pipe_publish(pipe, slot);
+        }
+    }
+    pipe_finish(pipe, result != 0);
+    free(requests);
+    return result;
+}
+
+// Copies the image directory PATH, with everything below it, into the
+// host directory HOST_DIR (created if missing). Directories are created
+// during a batched walk of the tree; file data then streams from the
+// device on this thread to a host writer thread.
+void handle_export_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *path, const char *host_dir) {
+    uint32_t cluster;
+    uint8_t attr;
+    ExportState state;
+
+    if (path_resolve(dev, bs, current_cluster, path, &cluster, &attr) != 0 || (attr & ATTR_DIRECTORY) == 0) {
+        fprintf(shell_out, "Error: '%s' is not a directory.\n", path);
+        return;
+    }
+    struct stat st;
+    if (mkdir(host_dir, 0777) != 0 && (errno != EEXIST || stat(host_dir, &st) != 0 || !S_ISDIR(st.st_mode))) {
+        fprintf(shell_out, "Error: Unable to create '%s'.\n", host_dir);
+        return;
+    }
+
+    memset(&state, 0, sizeof(state));
+    state.host_root = host_dir;
+    state.directories = 1;
+    tree_walk(dev, bs, cluster, "", export_visit, &state, NULL);
+    qsort(state.files, state.count, sizeof(ExportFile), compare_export_files);
+
+    TransferPipe pipe;
+    pthread_t thread;
+    state.pipe = &pipe;
+    pipe_init(&pipe);
+    pthread_create(&thread, NULL, export_writer, &state);
+    int failed = export_reader(dev, bs, &state) != 0;
+    pthread_join(thread, NULL);
+    pipe_destroy(&pipe);
+
+    if (failed) {
+        fprintf(shell_out, "Error: Failed to read '%s' from the image.\n", path);
+    } else {
+        fprintf(shell_out, "Exported '%s': %u files, %u directories, %llu bytes to '%s'.\n", path, state.count,
+                state.directories, (unsigned long long)state.bytes, host_dir);
+    }
+    if (state.damaged > 0) {
+        fprintf(shell_out, "Warning: %u files have broken cluster chains and were exported short.\n", state.damaged);
+    }
+    if (state.failures > 0) {
+        fprintf(shell_out, "Error: %u host files or directories could not be written.\n", state.failures);
+    }
+    for (uint32_t i = 0; i < state.count; i++) {
+        free(state.files[i].host_path);
+    }
+    free(state.files);
+}
@@ -0,0 +1,407 @@
+#include "tree.h"
+#include "dir_index.h"
+#include "fat_table.h"
+#include "handle.h"
+#include "path.h"
+#include "server.h"
+#include "walk.h"
+#include <ctype.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Everything below a directory that rm -r is about to release
+typedef struct {
+    uint32_t *chains;        // first cluster of every file and directory
+    uint32_t *directories;   // first cluster of every directory
+    size_t num_chains;
+    size_t num_directories;
+    size_t chain_capacity;
+    size_t directory_capacity;
+    uint32_t files;
+    uint32_t current_cluster;
+    int busy;
+} RemoveState;
+
+static void push_cluster(uint32_t **list, size_t *count, size_t *capacity, uint32_t cluster) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 256;
+        *list = realloc(*list, *capacity * sizeof(uint32_t));
+    }
+    (*list)[(*count)++] = cluster;
+}
+
+static int remove_visit(const WalkDir *dir, const DirectoryEntry *entry, const DirSlot *slot, const char *name, void *arg) {
+    RemoveState *state = arg;
+
+    if (entry == NULL) {
+        if (dir->cluster == state->current_cluster) {
+            fprintf(shell_out, "Error: '%s' is the current directory or contains it.\n", dir->path);
+            state->busy = 1;
+            return WALK_STOP;
+        }
+        if (server_cwd_in_use(dir->cluster)) {
+            fprintf(shell_out, "Error: '%s' is the current directory of another session.\n", dir->path);
+            state->busy = 1;
+            return WALK_STOP;
+        }
+        push_cluster(&state->directories, &state->num_directories, &state->directory_capacity, dir->cluster);
+        return WALK_CONTINUE;
+    }
+
+    // The whole subtree goes away, so none of its names may stay cached
+    dcache_invalidate(dir->cluster, entry->name);
+
+    uint32_t cluster = entry_cluster(entry);
+    if (entry->attr & ATTR_DIRECTORY) {
+        if (cluster != 0) {
+            push_cluster(&state->chains, &state->num_chains, &state->chain_capacity, cluster);
+        }
+        return WALK_CONTINUE;
+    }
+
+    if (handle_in_use(dir->cluster, slot->position)) {
+        fprintf(shell_out, "Error: '%s/%s' is open; close it first.\n", dir->path, name);
+        state->busy = 1;
+        return WALK_STOP;
+    }
+    if (cluster != 0) {
+        push_cluster(&state->chains, &state->num_chains, &state->chain_capacity, cluster);
+    }
+    state->files++;
+    return WALK_CONTINUE;
+}
+
+// Looks up the entry PATH names, refusing "." and ".." (ACTION says what
+// was refused)
+static int find_target(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *path, const char *action, uint32_t *parent, DirectoryEntry *entry, DirSlot *slot) {
+    char leaf[MAX_PATH_LENGTH];
+
+    if (path_resolve_parent(dev, bs, current_cluster, path, parent, leaf, sizeof(leaf)) != 0) {
+        fprintf(shell_out, "Error: '%s' not found.\n", path);
+        return -1;
+    }
+    if (strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0) {
+        fprintf(shell_out, "Error: Refusing to %s '%s'.\n", action, path);
+        return -1;
+    }
+    if (!dir_find_entry(dev, bs, *parent, leaf, entry, slot)) {
+        fprintf(shell_out, "Error: '%s' not found.\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Drops the entry from its parent first and releases clusters after, so
+// an interrupted removal can only leak clusters, never leave an entry
+// pointing at freed ones
+static void unlink_entry(BlockDevice *dev, FAT32BootSector *bs, uint32_t parent, const DirectoryEntry *entry) {
+    dir_remove_entry(dev, bs, parent, entry->name);
+    dcache_invalidate(parent, entry->name);
+}
+
+static void remove_tree(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *path, uint32_t parent, const DirectoryEntry *entry) {
+    RemoveState state;
+    WalkStats stats;
+    uint32_t cluster = entry_cluster(entry);
+
+    memset(&state, 0, sizeof(state));
+    state.current_cluster = current_cluster;
+    if (cluster != 0) {
+        tree_walk(dev, bs, cluster, path, remove_visit, &state, &stats);
+        push_cluster(&state.chains, &state.num_chains, &state.chain_capacity, cluster);
+    }
+
+    if (!state.busy) {
+        unlink_entry(dev, bs, parent, entry);
+
+        // Every chain is released in memory and reaches the image as one
+        // flush of the dirty FAT sectors
+        uint32_t freed = 0;
+        for (size_t i = 0; i < state.num_chains; i++) {
+            freed += fat_table_free_chain(state.chains[i]);
+        }
+        for (size_t i = 0; i < state.num_directories; i++) {
+            dir_index_invalidate(state.directories[i]);
+        }
+        fprintf(shell_out, "Removed '%s': %u files, %zu directories, %u clusters freed.\n",
+               path, state.files, state.num_directories, freed);
+    }
+
+    free(state.chains);
+    free(state.directories);
+}
+
+void handle_rm_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *path, int recursive) {
+    uint32_t parent;
+    DirectoryEntry entry;
+    DirSlot slot;
+
+    if (find_target(dev, bs, current_cluster, path, "remove", &parent, &entry, &slot) != 0) {
+        return;
+    }
+
+    if (entry.attr & ATTR_DIRECTORY) {
+        if (!recursive) {
+            fprintf(shell_out, "Error: '%s' is a directory; use rm -r or rmdir.\n", path);
+            return;
+        }
+        remove_tree(dev, bs, current_cluster, path, parent, &entry);
+        return;
+    }
+
+    if (handle_in_use(parent, slot.position)) {
+        fprintf(shell_out, "Error: '%s' is open; close it first.\n", path);
+        return;
+    }
+    unlink_entry(dev, bs, parent, &entry);
+    fat_table_free_chain(entry_cluster(&entry));
+    fprintf(shell_out, "File '%s' removed successfully.\n", path);
+}
+
+static int empty_visit(const WalkDir *dir, const DirectoryEntry *entry, const DirSlot *slot, const char *name, void *arg) {
+    (void)dir;
+    (void)slot;
+    (void)name;
+    (void)arg;
+    return entry == NULL ? WALK_CONTINUE : WALK_STOP;
+}
+
+void handle_rmdir_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *path) {
+    uint32_t parent;
+    DirectoryEntry entry;
+    DirSlot slot;
+
+    if (find_target(dev, bs, current_cluster, path, "remove", &parent, &entry, &slot) != 0) {
+        return;
+    }
+    if ((entry.attr & ATTR_DIRECTORY) == 0) {
+        fprintf(shell_out, "Error: '%s' is not a directory.\n", path);
+        return;
+    }
+
+    uint32_t cluster = entry_cluster(&entry);
+    if (cluster == current_cluster) {
+        fprintf(shell_out, "Error: Cannot remove the current directory.\n");
+        return;
+    }
+    if (server_cwd_in_use(cluster)) {
+        fprintf(shell_out, "Error: '%s' is the current directory of another session.\n", path);
+        return;
+    }
+    if (cluster != 0 && tree_walk(dev, bs, cluster, path, empty_visit, NULL, NULL)) {
+        fprintf(shell_out, "Error: Directory '%s' is not empty.\n", path);
+        return;
+    }
+
+    unlink_entry(dev, bs, parent, &entry);
+    fat_table_free_chain(cluster);
+    dir_index_invalidate(cluster);
+    fprintf(shell_out, "Directory '%s' removed successfully.\n", path);
+}
+
+// Gives the entry PATH names a new 8.3 name in the same directory. The
+// entry keeps its slot and clusters; a long name it had is dropped.
+void handle_rename_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *path, const char *new_name) {
+    uint32_t parent;
+    DirectoryEntry entry;
+    DirSlot slot;
+    uint8_t short_name[11];
+
+    if (find_target(dev, bs, current_cluster, path, "rename", &parent, &entry, &slot) != 0) {
+        return;
+    }
+    if (strcmp(new_name, ".") == 0 || strcmp(new_name, "..") == 0 || name_to_short(new_name, short_name) != 0) {
+        fprintf(shell_out, "Error: '%s' is not a valid 8.3 name.\n", new_name);
+        return;
+    }
+    if (dir_find_entry(dev, bs, parent, new_name, NULL, NULL)) {
+        fprintf(shell_out, "Error: '%s' already exists.\n", new_name);
+        return;
+    }
+
+    // Open files and session paths remember the old name
+    if (entry.attr & ATTR_DIRECTORY) {
+        uint32_t cluster = entry_cluster(&entry);
+        if (cluster == current_cluster) {
+            fprintf(shell_out, "Error: Cannot rename the current directory.\n");
+            return;
+        }
+        if (server_cwd_in_use(cluster)) {
+            fprintf(shell_out, "Error: '%s' is the current directory of another session.\n", path);
+            return;
+        }
+    } else if (handle_in_use(parent, slot.position)) {
+        fprintf(shell_out, "Error: '%s' is open; close it first.\n", path);
+        return;
+    }
+
+    if (dir_rename_entry(dev, bs, parent, entry.name, short_name) != 0) {
+        fprintf(shell_out, "Error: Could not rename '%s'.\n", path);
+        return;
+    }
+    dcache_invalidate(parent, entry.name);
+    dcache_invalidate(parent, short_name);
+    fprintf(shell_out, "Renamed '%s' to '%s'.\n", path, new_name);
+}
+
+// Resolves the directory a du or find starts from, along with the path
+// it is displayed under
+static int resolve_start(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *current_path, const char *path, uint32_t *cluster, char *display) {
+    uint8_t attr;
+
+    if (path_resolve(dev, bs, current_cluster, path, cluster, &attr) != 0 || (attr & ATTR_DIRECTORY) == 0) {
+        fprintf(shell_out, "Error: Directory '%s' not found or is not a directory.\n", path);
+        return -1;
+    }
+    if (*cluster == 0) {
+        // ".." entries of top-level directories point at cluster 0
+        *cluster = bs->root_cluster;
+    }
+    strcpy(display, current_path);
+    if (path_join(display, MAX_PATH_LENGTH, path) != 0) {
+        fprintf(shell_out, "Error: Path '%s' is too long.\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t chain_length(uint32_t cluster) {
+    uint32_t length = 0;
+    while (cluster >= 2 && cluster < fat_table.num_entries && length < fat_table.num_entries) {
+        length++;
+        cluster = fat_table_get(cluster);
+    }
+    return length;
+}
+
+// Per-directory totals, indexed by WalkDir id
+typedef struct {
+    uint64_t *allocated;
+    uint32_t *parent;
+    char **paths;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t apparent;
+    uint32_t files;
+    uint32_t csize;
+} DuState;
+
+static int du_visit(const WalkDir *dir, const DirectoryEntry *entry, const DirSlot *slot, const char *name, void *arg) {
+    DuState *state = arg;
+    (void)slot;
+    (void)name;
+
+    if (entry == NULL) {
+        if (dir->id >= state->capacity) {
+            uint32_t capacity = state->capacity ? state->capacity * 2 : 256;
+            while (capacity <= dir->id) {
+                capacity *= 2;
+            }
+            state->allocated = realloc(state->allocated, capacity * sizeof(uint64_t));
+            state->parent = realloc(state->parent, capacity * sizeof(uint32_t));
+            state->paths = realloc(state->paths, capacity * sizeof(char *));
+            memset(state->paths + state->capacity, 0, (capacity - state->capacity) * sizeof(char *));
+            state->capacity = capacity;
+        }
+        state->allocated[dir->id] = (uint64_t)chain_length(dir->cluster) * state->csize;
+        state->parent[dir->id] = dir->parent_id;
+        state->paths[dir->id] = strdup(dir->path);
+        if (dir->id + 1 > state->count) {
+            state->count = dir->id + 1;
+        }
+        return WALK_CONTINUE;
+    }
+
+    if ((entry->attr & ATTR_DIRECTORY) == 0) {
+        // Whole clusters are allocated for every byte of the file
+        uint64_t clusters = ((uint64_t)entry->filesize + state->csize - 1) / state->csize;
+        state->allocated[dir->id] += clusters * state->csize;
+        state->apparent += entry->filesize;
+        state->files++;
+    }
+    return WALK_CONTINUE;
+}
+
+void handle_du_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *current_path, const char *path) {
+    uint32_t cluster;
+    char display[MAX_PATH_LENGTH];
+    DuState state;
+    WalkStats stats;
+
+    if (resolve_start(dev, bs, current_cluster, current_path, path, &cluster, display) != 0) {
+        return;
+    }
+
+    memset(&state, 0, sizeof(state));
+    state.csize = cluster_size(bs);
+    tree_walk(dev, bs, cluster, display, du_visit, &state, &stats);
+
+    // Children always have higher ids than their parents, so one reverse
+    // pass rolls every subtree up into its ancestors
+    for (uint32_t id = state.count; id-- > 1;) {
+        state.allocated[state.parent[id]] += state.allocated[id];
+    }
+    for (uint32_t id = 0; id < state.count; id++) {
+        fprintf(shell_out, "%12llu  %s\n", (unsigned long long)state.allocated[id], state.paths[id][0] ? state.paths[id] : "/");
+        free(state.paths[id]);
+    }
+    fprintf(shell_out, "Total: %llu bytes allocated, %llu bytes in %u files, %u directories.\n",
+           (unsigned long long)(state.count ? state.allocated[0] : 0), (unsigned long long)state.apparent,
+           state.files, stats.directories);
+
+    free(state.allocated);
+    free(state.parent);
+    free(state.paths);
+}
+
+typedef struct {
+    const char *pattern;
+    uint32_t matches;
+} FindState;
+
+static int find_visit(const WalkDir *dir, const DirectoryEntry *entry, const DirSlot *slot, const char *name, void *arg) {
+    FindState *state = arg;
+    (void)slot;
+
+    if (entry == NULL) {
+        return WALK_CONTINUE;
+    }
+    // FAT names are case-insensitive, so both sides are compared in upper case
+    char upper[LONG_NAME_BUFFER];
+    size_t i = 0;
+    for (; name[i] != '\0' && i + 1 < sizeof(upper); i++) {
+        upper[i] = (char)toupper((unsigned char)name[i]);
+    }
+    upper[i] = '\0';
+    if (state->pattern == NULL || fnmatch(state->pattern, upper, 0) == 0) {
+        fprintf(shell_out, "%s %s/%s\n", (entry->attr & ATTR_DIRECTORY) ? "[DIR]" : "[FILE]", dir->path, name);
+        state->matches++;
+    }
+    return WALK_CONTINUE;
+}
+
+void handle_find_command(BlockDevice *dev, FAT32BootSector *bs, uint32_t current_cluster, const char *current_path, const char *path, const char *pattern) {
+    uint32_t cluster;
+    char display[MAX_PATH_LENGTH];
+    char upper[MAX_PATH_LENGTH];
+    FindState state = { NULL, 0 };
+    WalkStats stats;
+
+    if (resolve_start(dev, bs, current_cluster, current_path, path, &cluster, display) != 0) {
+        return;
+    }
+    if (pattern != NULL) {
+        size_t i = 0;
+        for (; pattern[i] != '\0' && i + 1 < sizeof(upper); i++) {
+            upper[i] = (char)toupper((unsigned char)pattern[i]);
+        }
+        upper[i] = '\0';
+        state.pattern = upper;
+    }
+
+    tree_walk(dev, bs, cluster, display, find_visit, &state, &stats);
+    fprintf(shell_out, "%u matches in %u directories (%u clusters, %u reads).\n",
+           state.matches, stats.directories, stats.clusters, stats.reads);
+}
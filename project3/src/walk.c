@@ -0,0 +1,292 @@
+#include "walk.h"
+#include "fat_table.h"
+#include "bcache.h"
+#include "ioengine.h"
+#include "journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A directory of the batch being read, with its whole chain buffered
+typedef struct {
+    WalkDir dir;
+    uint32_t *chain;
+    uint32_t length;
+    uint8_t *data;
+} WalkBatchDir;
+
+// One cluster of the batch and where its contents belong
+typedef struct {
+    uint32_t cluster;
+    uint32_t dir;        // index into the batch
+    uint32_t position;   // index within that directory's chain
+} WalkRef;
+
+typedef struct {
+    WalkDir *dirs;
+    size_t count;
+    size_t capacity;
+} WalkLevel;
+
+static void level_push(WalkLevel *level, WalkDir dir) {
+    if (level->count == level->capacity) {
+        level->capacity = level->capacity ? level->capacity * 2 : 64;
+        level->dirs = realloc(level->dirs, level->capacity * sizeof(WalkDir));
+    }
+    level->dirs[level->count++] = dir;
+}
+
+static int compare_refs(const void *a, const void *b) {
+    const WalkRef *x = a;
+    const WalkRef *y = b;
+    return (x->cluster > y->cluster) - (x->cluster < y->cluster);
+}
+
+// Collects the chain of a directory from the in-memory FAT, stopping at
+// anything that is not a valid next cluster (including loops that would
+// run past the size of the volume)
+static uint32_t collect_chain(uint32_t first, uint32_t **chain) {
+    uint32_t length = 0;
+    uint32_t capacity = 8;
+    uint32_t cluster = first;
+
+    *chain = malloc(capacity * sizeof(uint32_t));
+    while (cluster >= 2 && cluster < fat_table.num_entries && length < fat_table.num_entries) {
+        if (length == capacity) {
+            capacity *= 2;
+            *chain = realloc(*chain, capacity * sizeof(uint32_t));
+        }
+        (*chain)[length++] = cluster;
+        cluster = fat_table_get(cluster);
+    }
+    return length;
+}
+
+// Reads every cluster of the batch in ascending physical order with one
+// request per run of adjacent clusters, all submitted together so the
+// device has the whole batch queued at once
+static void read_batch(BlockDevice *dev, FAT32BootSector *bs, WalkBatchDir *batch, size_t count, WalkStats *stats) {
+    uint32_t csize = cluster_size(bs);
+    size_t total = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        total += batch[i].length;
+    }
+    WalkRef *refs = malloc(total * sizeof(WalkRef));
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        for (uint32_t k = 0; k < batch[i].length; k++) {
+            refs[n].cluster = batch[i].chain[k];
+            refs[n].dir = (uint32_t)i;
+            refs[n].position = k;
+            n++;
+        }
+    }
+    qsort(refs, n, sizeof(WalkRef), compare_refs);
+
+    // Runs are read into one staging buffer in sorted order, then copied
+    // to the directories they belong to
+    uint8_t *staging = malloc(n * csize);
+    IoRequest *requests = malloc(n * sizeof(IoRequest));
+    size_t *run_starts = malloc((n + 1) * sizeof(size_t));
+    size_t runs = 0;
+    for (size_t i = 0; i < n;) {
+        size_t j = i + 1;
+        while (j < n && refs[j].cluster == refs[j - 1].cluster + 1 && (j - i) * csize < IO_SPLIT_BYTES) {
+            j++;
+        }
+        requests[runs] = (IoRequest){ 0, cluster_to_offset(bs, refs[i].cluster), staging + i * csize, (j - i) * csize, 0 };
+        run_starts[runs++] = i;
+        i = j;
+    }
+    run_starts[runs] = n;
+    dev_submit(dev, requests, runs);
+
+    for (size_t r = 0; r < runs; r++) {
+        if (requests[r].result != 0) {
+            // Unreadable clusters are treated as empty directories
+            memset(requests[r].buffer, 0, requests[r].length);
+        }
+        for (size_t k = run_starts[r]; k < run_starts[r + 1]; k++) {
+            WalkBatchDir *target = &batch[refs[k].dir];
+            memcpy(target->data + (size_t)refs[k].position * csize, staging + k * csize, csize);
+        }
+    }
+    stats->clusters += (uint32_t)n;
+    stats->reads += (uint32_t)runs;
+    free(run_starts);
+    free(requests);
+    free(staging);
+    free(refs);
+}
+
+static char *child_path(const char *parent, const char *name) {
+    size_t length = strlen(parent) + strlen(name) + 2;
+    char *path = malloc(length);
+    snprintf(path, length, "%s/%s", parent, name);
+    return path;
+}
+
+// Marks directory CLUSTER in the bitmap of directories queued so far.
+// Returns 1 if it was already there.
+static int mark_queued(uint8_t *queued, uint32_t cluster) {
+    if (cluster >= fat_table.num_entries) {
+        return 0;
+    }
+    uint8_t bit = 1 << (cluster & 7);
+    int seen = (queued[cluster >> 3] & bit) != 0;
+    queued[cluster >> 3] |= bit;
+    return seen;
+}
+
+// Hands every entry of a buffered directory to the visitor and queues
+// its subdirectories on NEXT. A subdirectory whose first cluster was
+// queued before (a corrupted entry pointing back at an ancestor, or two
+// entries sharing a directory) is reported and left out entirely.
+// Returns WALK_STOP if the visitor asked to.
+static int scan_batch_dir(FAT32BootSector *bs, WalkBatchDir *bd, WalkLevel *next, uint32_t *next_id, uint8_t *queued, WalkVisitor visit, void *arg) {
+    uint32_t per_cluster = cluster_size(bs) / sizeof(DirectoryEntry);
+    uint32_t total = bd->length * per_cluster;
+    const DirectoryEntry *entries = (const DirectoryEntry *)bd->data;
+    char name[LONG_NAME_BUFFER];
+    LfnState lfn;
+
+    lfn_reset(&lfn);
+
+    if (visit(&bd->dir, NULL, NULL, NULL, arg) == WALK_STOP) {
+        return WALK_STOP;
+    }
+    for (uint32_t i = 0; i < total; i++) {
+        const DirectoryEntry *entry = &entries[i];
+        if (entry->name[0] == DIR_ENTRY_END) {
+            break;
+        }
+        if (entry->name[0] == DIR_ENTRY_DELETED) {
+            lfn_reset(&lfn);
+            continue;
+        }
+        if ((entry->attr & ATTR_LONG_NAME) == ATTR_LONG_NAME) {
+            lfn_feed(&lfn, entry);
+            continue;
+        }
+        if (entry->attr & 0x08) {
+            lfn_reset(&lfn);
+            continue;
+        }
+        if (!lfn_finish(&lfn, entry, name)) {
+            entry_name(entry, name);
+        }
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+
+        uint32_t cluster = entry_cluster(entry);
+        int is_dir = (entry->attr & ATTR_DIRECTORY) && cluster != 0;
+        if (is_dir && cluster < fat_table.num_entries && (queued[cluster >> 3] >> (cluster & 7) & 1)) {
+            fprintf(shell_out, "Warning: '%s/%s' leads back to a directory already reached; skipped.\n", bd->dir.path, name);
+            continue;
+        }
+
+        DirSlot slot = { bd->chain[i / per_cluster], i % per_cluster, i };
+        int action = visit(&bd->dir, entry, &slot, name, arg);
+        if (action == WALK_STOP) {
+            return WALK_STOP;
+        }
+
+        if (action == WALK_CONTINUE && is_dir && !mark_queued(queued, cluster)) {
+            WalkDir child = { cluster, (*next_id)++, bd->dir.id, bd->dir.depth + 1, child_path(bd->dir.path, name) };
+            level_push(next, child);
+        }
+    }
+    return WALK_CONTINUE;
+}
+
+// Breadth-first walk of the tree below CLUSTER. Each level is processed
+// in batches of directories: their chains are gathered from the in-memory
+// FAT, all of their clusters are sorted by physical location and read
+// with one call per contiguous run, and only then are the entries handed
+// to VISIT. VISIT is called once with a NULL entry as each directory is
+// entered and then once per live entry, skipping "." and "..". Each
+// directory is entered at most once, so a cycle in a corrupted tree
+// cannot keep the walk going.
+// Returns 1 if the visitor stopped the walk, 0 otherwise.
+int tree_walk(BlockDevice *dev, FAT32BootSector *bs, uint32_t cluster, const char *path, WalkVisitor visit, void *arg, WalkStats *stats) {
+    uint32_t csize = cluster_size(bs);
+    uint32_t batch_clusters = WALK_BATCH_BYTES / csize;
+    WalkLevel current = { NULL, 0, 0 };
+    WalkLevel next = { NULL, 0, 0 };
+    WalkStats local;
+    uint32_t next_id = 1;
+    int stopped = 0;
+
+    if (stats == NULL) {
+        stats = &local;
+    }
+    memset(stats, 0, sizeof(*stats));
+
+    // Directory clusters are read straight from the image below
+    journal_flush(dev, bs);
+
+    uint8_t *queued = calloc(fat_table.num_entries / 8 + 1, 1);
+    mark_queued(queued, cluster);
+    WalkDir start = { cluster, 0, 0, 0, strdup(path) };
+    level_push(&current, start);
+
+    while (current.count > 0) {
+        size_t done = 0;
+        while (done < current.count) {
+            if (stopped) {
+                for (; done < current.count; done++) {
+                    free(current.dirs[done].path);
+                }
+                break;
+            }
+
+            // Take directories until the batch holds enough clusters
+            size_t count = 0;
+            size_t capacity = 16;
+            uint32_t clusters = 0;
+            WalkBatchDir *batch = malloc(capacity * sizeof(WalkBatchDir));
+            while (done + count < current.count && (count == 0 || clusters < batch_clusters)) {
+                if (count == capacity) {
+                    capacity *= 2;
+                    batch = realloc(batch, capacity * sizeof(WalkBatchDir));
+                }
+                WalkBatchDir *bd = &batch[count++];
+                bd->dir = current.dirs[done + count - 1];
+                bd->length = collect_chain(bd->dir.cluster, &bd->chain);
+                bd->data = calloc(bd->length ? bd->length : 1, csize);
+                clusters += bd->length;
+            }
+
+            read_batch(dev, bs, batch, count, stats);
+            for (size_t i = 0; i < count; i++) {
+                if (!stopped) {
+                    stats->directories++;
+                    stopped = scan_batch_dir(bs, &batch[i], &next, &next_id, queued, visit, arg) == WALK_STOP;
+                }
+                free(batch[i].chain);
+                free(batch[i].data);
+                free(batch[i].dir.path);
+            }
+            free(batch);
+            done += count;
+        }
+
+        if (stopped) {
+            for (size_t i = 0; i < next.count; i++) {
+                free(next.dirs[i].path);
+            }
+            next.count = 0;
+        }
+        WalkLevel swap = current;
+        current = next;
+        next = swap;
+        next.count = 0;
+    }
+
+    free(current.dirs);
+    free(next.dirs);
+    free(queued);
+    return stopped;
+}